@@ -0,0 +1,227 @@
+//vim:fileencoding=utf8
+/*
+ scan_bench.c   Check and time the MPEG start code scanners of dvd-vr
+                on the sectors of a VRO file
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+/*
+    Usage: scan_bench VR_MOVIE.VRO [MAX_MIB]
+
+    Every sector, and the tails of it starting at a few odd offsets,
+    is scanned by each scanner the CPU supports and the codes found
+    are compared to those of a naive loop.
+
+    Then the per sector work of process_mpeg2() before the scanner is
+    timed against it: a per byte search for the video stream header
+    and another for the sequence header, versus one scan and two
+    lookups in the codes found.
+*/
+
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "start_codes.h"
+
+#define DVD_SECTOR_SIZE 2048
+#define SEQUENCE_ID 0xB3
+#define VIDEO_STREAM_0 0xE0
+#define SEQUENCE_LEN 4
+#define VIDEO_STREAM_LEN 3
+#define REPEATS 5
+
+typedef void (*scanner_t)(const uint8_t* buf, const unsigned int bs, start_codes_t* codes);
+
+/* The header search from before the scanner, as in upstream dvd-vr */
+static int old_find_mpeg_header(const uint8_t* buf, const unsigned int bs, const uint8_t type)
+{
+    unsigned int offset=0;
+    const uint8_t start_code[4] = { 0x00, 0x00, 0x01, type };
+    uint32_t header;
+    memcpy(&header, start_code, sizeof (header));
+    while (offset <= bs - sizeof (header)) {
+        if (*(uint32_t*)(buf+offset) == header)
+            return offset;
+        offset++;
+    }
+    return -1;
+}
+
+static void naive_start_codes(const uint8_t* buf, const unsigned int bs, start_codes_t* codes)
+{
+    unsigned int offset;
+    codes->count = 0;
+    for (offset=0; offset + START_CODE_LEN <= bs; offset++) {
+        if (!buf[offset] && !buf[offset+1] && buf[offset+2] == 1)
+            add_start_code(buf, offset, codes);
+    }
+}
+
+static bool same_codes(const start_codes_t* a, const start_codes_t* b)
+{
+    return a->count == b->count &&
+           !memcmp(a->offset, b->offset, a->count * sizeof(a->offset[0])) &&
+           !memcmp(a->type, b->type, a->count * sizeof(a->type[0]));
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint8_t* read_sectors(const char* name, size_t max_size, size_t* sectors)
+{
+    int fd = open(name, O_RDONLY);
+    if (fd == -1) {
+        fprintf(stderr, "Error opening [%s] (%s)\n", name, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    uint8_t* data = malloc(max_size);
+    if (!data) {
+        fprintf(stderr, "Error allocating %zu bytes\n", max_size);
+        exit(EXIT_FAILURE);
+    }
+    size_t size = 0;
+    while (size < max_size) {
+        ssize_t bytes = read(fd, data + size, max_size - size);
+        if (bytes == -1) {
+            fprintf(stderr, "Error reading [%s] (%s)\n", name, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        if (!bytes)
+            break;
+        size += bytes;
+    }
+    close(fd);
+    *sectors = size / DVD_SECTOR_SIZE;
+    if (!*sectors) {
+        fprintf(stderr, "Error: [%s] has no whole sector\n", name);
+        exit(EXIT_FAILURE);
+    }
+    return data;
+}
+
+int main(int argc, char** argv)
+{
+    static const struct {
+        const char* name;
+        scanner_t   scan;
+    } scanners[] = {
+        { "scalar", find_start_codes_c },
+#ifdef HAVE_X86_SIMD
+        { "sse2", find_start_codes_sse2 },
+        { "avx2", find_start_codes_avx2 },
+#endif
+    };
+    static const unsigned int skips[] = { 0, 1, 7, 31, 333, 2040 };
+    const int nr_of_scanners = sizeof(scanners) / sizeof(scanners[0]);
+
+    if (argc < 2 || argc > 3) {
+        fprintf(stderr, "Usage: %s VR_MOVIE.VRO [MAX_MIB]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    size_t max_mib = argc > 2 ? strtoul(argv[2], NULL, 10) : 256;
+    size_t sectors;
+    uint8_t* data = read_sectors(argv[1], max_mib << 20, &sectors);
+
+    bool supported[sizeof(scanners) / sizeof(scanners[0])] = { true };
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    supported[1] = __builtin_cpu_supports("sse2");
+    supported[2] = __builtin_cpu_supports("avx2");
+#endif
+    int s;
+    for (s=0; s<nr_of_scanners; s++) {
+        if (!supported[s])
+            printf("%-8s: not supported by this CPU\n", scanners[s].name);
+    }
+
+    /* Check the codes found against the naive loop */
+    static start_codes_t expected, codes;
+    unsigned long mismatches = 0, nr_of_codes = 0;
+    size_t sector;
+    for (sector=0; sector<sectors; sector++) {
+        const uint8_t* buf = data + sector*DVD_SECTOR_SIZE;
+        unsigned int i;
+        for (i=0; i<sizeof(skips)/sizeof(skips[0]); i++) {
+            naive_start_codes(buf + skips[i], DVD_SECTOR_SIZE - skips[i], &expected);
+            if (!i)
+                nr_of_codes += expected.count;
+            for (s=0; s<nr_of_scanners; s++) {
+                if (!supported[s])
+                    continue;
+                scanners[s].scan(buf + skips[i], DVD_SECTOR_SIZE - skips[i], &codes);
+                if (!same_codes(&expected, &codes)) {
+                    if (!mismatches++)
+                        fprintf(stderr, "%s differs from the naive loop at sector %zu+%u\n",
+                                scanners[s].name, sector, skips[i]);
+                }
+            }
+        }
+    }
+    printf("%zu sectors, %lu start codes, %lu mismatches\n", sectors, nr_of_codes, mismatches);
+
+    /* Time the lookups process_mpeg2() did per sector */
+    double best = 1e9;
+    volatile long sink = 0;
+    int r;
+    for (r=0; r<REPEATS; r++) {
+        double start = now();
+        for (sector=0; sector<sectors; sector++) {
+            const uint8_t* buf = data + sector*DVD_SECTOR_SIZE;
+            sink += old_find_mpeg_header(buf, DVD_SECTOR_SIZE-VIDEO_STREAM_LEN, VIDEO_STREAM_0);
+            sink += old_find_mpeg_header(buf, DVD_SECTOR_SIZE-SEQUENCE_LEN-START_CODE_LEN, SEQUENCE_ID);
+        }
+        double elapsed = now() - start;
+        if (elapsed < best)
+            best = elapsed;
+    }
+    const double mib = (double)sectors * DVD_SECTOR_SIZE / (1 << 20);
+    const double old_best = best;
+    printf("%-8s: %8.1f MiB/s\n", "per byte", mib / old_best);
+    for (s=0; s<nr_of_scanners; s++) {
+        if (!supported[s])
+            continue;
+        best = 1e9;
+        for (r=0; r<REPEATS; r++) {
+            double start = now();
+            for (sector=0; sector<sectors; sector++) {
+                const uint8_t* buf = data + sector*DVD_SECTOR_SIZE;
+                scanners[s].scan(buf, DVD_SECTOR_SIZE, &codes);
+                sink += find_mpeg_header(&codes, 0, DVD_SECTOR_SIZE-VIDEO_STREAM_LEN, VIDEO_STREAM_0);
+                sink += find_mpeg_header(&codes, 0, DVD_SECTOR_SIZE-SEQUENCE_LEN, SEQUENCE_ID);
+            }
+            double elapsed = now() - start;
+            if (elapsed < best)
+                best = elapsed;
+        }
+        printf("%-8s: %8.1f MiB/s (%.1fx)\n", scanners[s].name, mib / best, old_best / best);
+    }
+
+    free(data);
+    return mismatches ? EXIT_FAILURE : EXIT_SUCCESS;
+}
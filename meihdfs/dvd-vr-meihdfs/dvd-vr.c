@@ -83,15 +83,20 @@ Requirements:
 #include <errno.h>
 #include <limits.h>
 #include <utime.h>
+#include <pthread.h>
 
 #ifdef MINGW
 #define HAVE_SYS_PARAM_H
 #include "byteswap.h"
+#include <windows.h>
+#include <io.h>
 #define gmtime_r(x,y) (*y=*gmtime(x))
 #else
 #include <netinet/in.h>
 #endif
 
+#include "start_codes.h"
+
 
 #if !defined(MB_LEN_MAX) || MB_LEN_MAX<16
 /* 1 char could be converted to 2 multibyte chars
@@ -153,6 +158,24 @@ static size_t my_strnlen(const char* s, size_t n)
     return len;
 }
 
+#ifdef MINGW
+/* msvcrt doesn't provide pread, but ReadFile can be told the offset */
+static ssize_t pread(int fd, void* buf, size_t count, off_t offset)
+{
+    OVERLAPPED overlapped = {0};
+    DWORD bytes_read;
+    overlapped.Offset = (DWORD)offset;
+    overlapped.OffsetHigh = (DWORD)((uint64_t)offset >> 32);
+    if (!ReadFile((HANDLE)_get_osfhandle(fd), buf, count, &bytes_read, &overlapped)) {
+        if (GetLastError() == ERROR_HANDLE_EOF)
+            return 0;
+        errno = EIO;
+        return -1;
+    }
+    return bytes_read;
+}
+#endif
+
 /* Mac OS X doesn't provide strndup :( */
 static char* my_strndup(const char *s, size_t n)
 {
@@ -192,6 +215,7 @@ void percent_display(percent_control_t percent_control, unsigned int percent, in
     static int point;
     #define POINTS 20
     #define DEFAULT_PROGRESS_CHAR '.'
+    #define ERROR_PROGRESS_CHAR 'X'
     static char chars[POINTS+1];
 
     switch (percent_control) {
@@ -207,7 +231,8 @@ void percent_display(percent_control_t percent_control, unsigned int percent, in
         int i;
         if (display_char && (display_char != DEFAULT_PROGRESS_CHAR))
             for (i=point; i<=newpoint && i<POINTS; i++)
-                chars[i]=display_char;
+                if (chars[i] != ERROR_PROGRESS_CHAR) /* keep read errors visible */
+                    chars[i]=display_char;
         for (i=0; i<newpoint; i++)
             if (chars[i] == ' ')
                 chars[i] = DEFAULT_PROGRESS_CHAR;
@@ -232,12 +257,10 @@ static int touch(const char* filename, struct tm* tm)
     return utime(filename, &utb);
 }
 
-typedef void (*process_func_t)(uint8_t* buf, unsigned int bs, void* context);
-
 /*
   Copy data between file descriptors while not
   putting more than blocks*block_size in the system cache.
-  Therefore you will probably want to call this function repeatedly.
+  Therefore you will probably want to call these functions repeatedly.
 
   I tested 3 methods for streaming large amounts of data to/from disk.
   All 3 took the same time as the bottleneck is the reading and writing to disk.
@@ -259,83 +282,76 @@ typedef void (*process_func_t)(uint8_t* buf, unsigned int bs, void* context);
         real    0m31.776s
         user    0m0.075s
         sys     0m1.803s
- */
 
-static int stream_data(int src_fd, int dst_fd, uint32_t blocks, uint16_t block_size,
-                       process_func_t process_func, void* process_context)
-{
-#define AUTO
-#define BLOCKS_PER_OP 1
-
-#if defined AUTO
-    uint8_t buf[block_size*BLOCKS_PER_OP];  /* Not page aligned by default */
-#elif defined ALLOC_ALIGN
-    /* There are portability issue with this.
-     * One may need to use MAP_ANONYMOUS rather than MAP_ANON.
-     * Also one may need to use MAP_FILE and operate on /dev/zero instead.
-     *
-     * Also see posix_memalign().
-     * Also see pagealign_alloc in gnulib.
-     */
-    static int8_t* buf;
-    if (!buf) {
-        buf = mmap(NULL,block_size*BLOCKS_PER_OP,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANON,-1,0);
-    }
-    if (buf == MAP_FAILED) {
-        fprintf(stderr, "Error: Failed allocating mmap aligned buf [%s]\n", strerror(errno));
-        exit(EXIT_FAILURE);
-    }
-    if ((size_t)buf & (sysconf(_SC_PAGE_SIZE)-1)) {
-        fprintf(stderr, "Warning: mmap buffer not aligned\n");
-    }
-#endif
+  The AUTO method has since become read_blocks() and write_blocks()
+  below, which the extraction pipeline calls from separate threads
+  on page aligned buffers of up to BLOCKS_PER_OP blocks.
+  Reads are positioned with pread(), so that several programs
+  can be extracted from the same descriptor at once.
+ */
 
+#define BLOCKS_PER_OP 1024 /* Enough for the biggest VOBU */
 
+/*
+  Read blocks into buf. Once a read fails, the rest is read block by
+  block so that everything up to the bad block is kept.
+  *blocks_done tells how many blocks are in buf, also on error.
+ */
+static int read_blocks(int src_fd, off_t offset, uint8_t* buf, uint32_t blocks, uint16_t block_size,
+                       uint32_t* blocks_done)
+{
+    bool block_wise = false;
     unsigned int block;
-    for (block=0; block<blocks; block+=BLOCKS_PER_OP) {
-        int trans_blocks = MIN(blocks-block, BLOCKS_PER_OP);
+    *blocks_done = 0;
+    for (block=0; block<blocks; ) {
+        int trans_blocks = block_wise ? 1 : MIN(blocks-block, BLOCKS_PER_OP);
         int trans_size = trans_blocks * block_size;
 
-        int bytes_read = read(src_fd, buf, trans_size);
-        if (bytes_read != trans_size) {
+        int bytes_read = pread(src_fd, buf+block*block_size, trans_size, offset+(off_t)block*block_size);
+        if (bytes_read < 0 && !block_wise) {
+            block_wise = true;
+            continue;
+        }
+        if (bytes_read > 0) {
+            block += bytes_read / block_size;
+            *blocks_done = block;
+        }
+        if (bytes_read <= 0 || bytes_read % block_size) {
 #ifndef NDEBUG
             if (bytes_read<0) /* otherwise file truncated */
                 fprintf(stderr, "Error reading from SRC [%s]\n", strerror(errno));
 #endif //NDEBUG
             return -1;
         }
-        if (process_func) {
-            int pblock;
-            for (pblock=0; pblock<trans_blocks; pblock++) {
-                process_func(buf+(pblock*block_size), block_size, process_context);
-            }
-        }
-        if (write(dst_fd, buf, trans_size) != trans_size) {
-            fprintf(stderr, "Error writing to DST [%s]\n", strerror(errno));
-            return -2;
-        }
     }
 
 #ifdef POSIX_FADV_DONTNEED
     /* Don't fill cache with SRC.
-    Note be careful to invalidate only what we've written
+    Note be careful to invalidate only what we've read
     so that we don't dump any readahead cache. */
-    uint32_t bytes = blocks * block_size;
-    off_t offset = lseek(src_fd, 0, SEEK_CUR);
-    /* Note src is already guaranteed seekable, but offset may
-     * be 0 for example if /dev/zero is specified for testing. */
-    if (offset >= bytes) {
-        int ret = posix_fadvise(src_fd, offset-bytes, bytes, POSIX_FADV_DONTNEED);
-        if (ret) {
-            fprintf(stderr, "Warning: posix_fadvise failed [%s]\n", strerror(ret));
-        }
+    int ret = posix_fadvise(src_fd, offset, (off_t)blocks * block_size, POSIX_FADV_DONTNEED);
+    if (ret) {
+        fprintf(stderr, "Warning: posix_fadvise failed [%s]\n", strerror(ret));
     }
+#endif //POSIX_FADV_DONTNEED
+
+    return 0;
+}
 
+static int write_blocks(int dst_fd, const uint8_t* buf, uint32_t blocks, uint16_t block_size)
+{
+    int size = blocks * block_size;
+    if (write(dst_fd, buf, size) != size) {
+        fprintf(stderr, "Error writing to DST [%s]\n", strerror(errno));
+        return -2;
+    }
+
+#ifdef POSIX_FADV_DONTNEED
     /* Don't fill cache with DST.
     Note this slows the operation down by 20% when both source
     and dest are on the same hard disk at least. I guess
     this is due to implicit syncing in posix_fadvise()? */
-    offset = lseek(dst_fd, 0, SEEK_CUR);
+    off_t offset = lseek(dst_fd, 0, SEEK_CUR);
     if (offset != (off_t)-1) { /* seekable */
         int ret = posix_fadvise(dst_fd, 0, 0, POSIX_FADV_DONTNEED);
         if (ret) {
@@ -344,7 +360,7 @@ static int stream_data(int src_fd, int dst_fd, uint32_t blocks, uint16_t block_s
     }
 #endif //POSIX_FADV_DONTNEED
 
-   return 0;
+    return 0;
 }
 
 #ifdef MMAP_WRITE
@@ -472,6 +488,7 @@ typedef enum {
 typedef struct {
     int video_attr;
     scrambled_t scrambled;
+    int size_mismatch; /* Sequence headers not fixed up as their size isn't the IFO's */
 } p_program_attr_t;
 p_program_attr_t* ifo_program_attrs;
 
@@ -546,6 +563,12 @@ typedef struct {
     uint8_t vobu_info[3];
 } PACKED vobu_info_t;
 
+static inline uint16_t get_vobu_size(const vobu_info_t* vobu_info)
+{
+    uint16_t vobu_size = *(uint16_t*)(&vobu_info->vobu_info[1]);
+    return ntohs(vobu_size) & 0x03FF;
+}
+
 typedef struct {
     uint16_t zero1;
     uint8_t  nr_of_pgi;
@@ -1024,46 +1047,153 @@ Specifically for widescreen PAL movies my DVD-VR camcorder set:
 #define VIDEO_STREAM_0 0xE0 /* I've only seen E0 on dvd-vr discs (E0-F possible) */
 #define SEQUENCE_LEN 4 /* length of data we need to parse from sequence packet */
 #define SEQUENCE_EXTENSION_LEN 5 /* length of data we need to parse from sequence extension packet */
-#define VIDEO_STREAM_LEN 3 /* length of data we need to parse from video stream packet */
 
-/* Return offset to header or -1 if not found */
-static int find_mpeg_header(const uint8_t* buf, const unsigned int bs, const uint8_t type)
+/* Until the start code scanner below, the header search compared against
+ * NTOHL(header), which is a no-op here, so it never found a header and
+ * these fixups never ran. So they're only done with --fix-headers, and
+ * only to sequence headers whose frame size matches the IFO, as a check
+ * that we parsed the video attributes of the IFO right. */
+static bool fix_mpeg_headers = false;
+
+/*
+ * Sectors are parsed as MPEG-2 program stream packs, hopping from the pack
+ * header (0xBA) over the system header (0xBB) and from PES packet to PES
+ * packet by their lengths. So only the few headers in a sector are looked at
+ * and start codes in the payloads can't be taken for them.
+ * The video elementary stream is searched for sequence headers only in
+ * PES packets with a PTS, i.e. those a picture starts in.
+ */
+
+#define PACK_HEADER_ID 0xBA
+#define SYSTEM_HEADER_ID 0xBB
+#define PES_HEADER_LEN 6 /* start code and packet length */
+#define VIDEO_STREAMS 16 /* 0xE0 - 0xEF */
+#define IS_VIDEO_STREAM(id) (((id) & 0xF0) == VIDEO_STREAM_0)
+
+/* State of the streams of a program, carried from sector to sector */
+typedef struct {
+    scrambled_t scrambled[VIDEO_STREAMS]; /* Of the last PES packet */
+} ps_state_t;
+
+/* Called by parse_mpeg2_pack() for the PES packets of video streams */
+typedef struct {
+    /* When a stream becomes scrambled or unscrambled */
+    void (*scrambling)(const bool scrambled, void* context);
+    /* With the elementary stream data buf[start,end) of a packet a picture starts in */
+    void (*picture)(uint8_t* buf, const unsigned int start, const unsigned int end, void* context);
+} ps_hooks_t;
+
+/* Fixup state of a program being extracted */
+typedef struct {
+    unsigned int program;
+    int          sector; /* for debugging */
+    ps_state_t   ps_state;
+} mpeg2_context_t;
+
+/* reset cached values for each program */
+static void init_mpeg2_context(mpeg2_context_t* context, const unsigned int program)
 {
-    unsigned int offset=0;
-    uint32_t header = 0x00000100 + type;
-    NTOHL(header);
-    while (offset <= bs - sizeof (header)) {
-        if (*(uint32_t*)(buf+offset) == header)
-            return offset;
-        offset++;
-    }
-    return -1;
+    int i;
+    context->program = program;
+    context->sector = 0;
+    for (i=0; i<VIDEO_STREAMS; i++) {
+        context->ps_state.scrambled[i] = SCRAMBLED_UNSET;
+    }
 }
 
-static int sequence_offset;
-static uint8_t sequence_aspect;
+static bool is_mpeg_header(const uint8_t* buf, const uint8_t type)
+{
+    return !buf[0] && !buf[1] && buf[2] == 0x01 && buf[3] == type;
+}
 
-/* reset cached values for each program */
-static void init_mpeg2_cache(void)
+/* Return offset to the elementary stream data of the PES packet
+ * at buf+offset, or -1 if its header doesn't end before end */
+static int parse_pes_header(const uint8_t* buf, unsigned int offset, const unsigned int end,
+                            bool* scrambled, bool* picture)
 {
-    sequence_offset = -1;
-    sequence_aspect = -1;
+    offset += PES_HEADER_LEN;
+    if (offset + 3 <= end && (buf[offset] & 0xC0) == 0x80) { /* MPEG2 */
+        *scrambled = buf[offset] & 0x30;
+        *picture = buf[offset+1] & 0x80;
+        offset += 3 + buf[offset+2];
+    } else {
+        *scrambled = false; /* assuming MPEG1 doesn't support encryption */
+        while (offset < end && buf[offset] == 0xFF) /* stuffing */
+            offset++;
+        if (offset < end && (buf[offset] & 0xC0) == 0x40) /* STD buffer size */
+            offset += 2;
+        if (offset >= end)
+            return -1;
+        *picture = (buf[offset] & 0xE0) == 0x20;
+        if ((buf[offset] & 0xF0) == 0x20) {
+            offset += 5;  /* PTS */
+        } else if ((buf[offset] & 0xF0) == 0x30) {
+            offset += 10; /* PTS and DTS */
+        } else {
+            offset += 1;
+        }
+    }
+    return offset <= end ? (int)offset : -1;
 }
 
-static p_video_attr_t get_sequence_aspect(const uint8_t* buf)
+static void parse_mpeg2_pack(uint8_t* buf, const unsigned int bs, ps_state_t* state,
+                             const ps_hooks_t* hooks, void* context)
 {
-    p_video_attr_t s_video_attr;
-    s_video_attr.width = s_video_attr.height = -1;
-    uint8_t aspect_byte = *(buf + sequence_offset + MPEG_HEADER_LEN + 3);
-    s_video_attr.aspect = aspect_byte >> 4;
-    return s_video_attr;
+    unsigned int offset;
+    if (bs < 14 || !is_mpeg_header(buf, PACK_HEADER_ID))
+        return;
+    if ((buf[4] & 0xC0) == 0x40) { /* MPEG2 */
+        offset = 14 + (buf[13] & 0x07);
+    } else {
+        offset = 12;
+    }
+
+    /* The system header and PES packets all have a 16 bit length after
+       their start code. Anything below the system header ends the pack. */
+    while (offset + PES_HEADER_LEN <= bs &&
+           !buf[offset] && !buf[offset+1] && buf[offset+2] == 0x01 &&
+           buf[offset+3] >= SYSTEM_HEADER_ID) {
+        uint8_t id = buf[offset+3];
+        unsigned int end = offset + PES_HEADER_LEN + ((buf[offset+4] << 8) | buf[offset+5]);
+        if (end > bs)
+            end = bs; /* Packets don't span packs on DVD */
+        if (IS_VIDEO_STREAM(id)) {
+            bool scrambled, picture;
+            int es_offset = parse_pes_header(buf, offset, end, &scrambled, &picture);
+            if (es_offset >= 0) {
+                scrambled_t* last = &state->scrambled[id - VIDEO_STREAM_0];
+                if (*last != (scrambled_t)scrambled) {
+                    *last = scrambled;
+                    hooks->scrambling(scrambled, context);
+                }
+                if (picture && !scrambled) {
+                    hooks->picture(buf, es_offset, end, context);
+                }
+            }
+        }
+        offset = end;
+    }
+}
+
+static bool sequence_size_is(const uint8_t* buf, const unsigned int offset, const p_video_attr_t* video_attr)
+{
+    const uint8_t* size = buf + offset + MPEG_HEADER_LEN;
+    int horiz_size = (size[0] << 4) | (size[1] >> 4);
+    int vert_size = ((size[1] & 0x0F) << 8) | size[2];
+    return horiz_size == video_attr->width && vert_size == video_attr->height;
 }
 
-static void set_sequence_aspect(uint8_t* buf, const unsigned int offset, p_video_attr_t s_video_attr)
+static uint8_t get_sequence_aspect(const uint8_t* buf, const unsigned int offset)
 {
     uint8_t aspect_byte = *(buf + offset + MPEG_HEADER_LEN + 3);
-    aspect_byte = (aspect_byte & 0x0F) | ((uint8_t) s_video_attr.aspect) << 4;
-    *(buf + sequence_offset + MPEG_HEADER_LEN + 3) = aspect_byte;
+    return aspect_byte >> 4;
+}
+
+static void set_sequence_aspect(uint8_t* buf, const unsigned int offset, const uint8_t aspect)
+{
+    uint8_t aspect_byte = *(buf + offset + MPEG_HEADER_LEN + 3);
+    aspect_byte = (aspect_byte & 0x0F) | aspect << 4;
+    *(buf + offset + MPEG_HEADER_LEN + 3) = aspect_byte;
 }
 
 static p_video_attr_t get_sequence_display_extension_sizes(const uint8_t* buf, const unsigned int offset)
@@ -1104,120 +1234,86 @@ static void set_sequence_display_extension_sizes(uint8_t* buf, const unsigned in
     *(display_size+3) |= (vert_disp_size << 3);
 }
 
-static void check_mpeg_encryption(uint8_t* buf, const unsigned int bs, const unsigned int program)
+static void check_mpeg_encryption(const bool scrambled, void* context)
 {
-    /* Note we'll warn below if we've not seen any video stream (E0 doesn't match).
+    const unsigned int program = ((const mpeg2_context_t*)context)->program;
+    /* Note we'll warn below if we've not seen any video stream (no E? PES packets).
      * Note also I've only seen AC-3 audio on 0xBD and it has also been
      * encrypted on discs I've seen.  */
-    if (ifo_program_attrs[program].scrambled != PARTIALLY_SCRAMBLED) {
-        int pes_offset = find_mpeg_header(buf, bs-VIDEO_STREAM_LEN, VIDEO_STREAM_0);
-        if (pes_offset >= 0) {
-            /* extension header is always available for 0xBD and 0xE? types */
-            uint8_t scramble_byte = *(buf + pes_offset + MPEG_HEADER_LEN + 2);
-            bool scrambled;
-            if ((scramble_byte & 0xC0) == 0x80) { /* MPEG2 */
-                scrambled = scramble_byte & 0x30;
-            } else {
-                scrambled = false; /* assuming MPEG1 doesn't support encryption */
-            }
-            if (ifo_program_attrs[program].scrambled != SCRAMBLED_UNSET &&
-                ifo_program_attrs[program].scrambled != scrambled) {
-                ifo_program_attrs[program].scrambled = PARTIALLY_SCRAMBLED;
-            } else {
-                ifo_program_attrs[program].scrambled = scrambled;
-            }
-        }
+    if (ifo_program_attrs[program].scrambled == PARTIALLY_SCRAMBLED) {
+        return;
+    }
+    if (ifo_program_attrs[program].scrambled != SCRAMBLED_UNSET &&
+        ifo_program_attrs[program].scrambled != (scrambled_t)scrambled) {
+        ifo_program_attrs[program].scrambled = PARTIALLY_SCRAMBLED;
+    } else {
+        ifo_program_attrs[program].scrambled = scrambled;
     }
 }
 
-static void fix_mpeg2_aspect(uint8_t* buf, const unsigned int bs, const unsigned int program)
+static void fix_mpeg2_aspect(uint8_t* buf, const unsigned int start, const unsigned int end, void* context)
 {
-    static int sector;
-    bool found_sequence_header = false;
-    const bool look_harder = false; /* Should never need to be set to true as far as I can see */
-
+    const unsigned int program = ((const mpeg2_context_t*)context)->program;
+#ifndef NDEBUG
+    const int sector = ((const mpeg2_context_t*)context)->sector;
+#endif
     p_video_attr_t ifo_video_attr = ifo_video_attrs[ifo_program_attrs[program].video_attr];
-    if (ifo_video_attr.aspect < 2) {
-        sector++;
+    if (!fix_mpeg_headers || ifo_video_attr.aspect < 2 ||
+        ifo_video_attr.width <= 0 || ifo_video_attr.height <= 0) {
         return;
     }
 
-    p_video_attr_t s_video_attr = { .aspect=ifo_video_attr.aspect, .width=-1, .height=-1 };
+    uint8_t* es = buf + start;
+    int es_len = end - start;
+    start_codes_t codes;
+    find_start_codes(es, es_len, &codes);
 
-    if (sequence_offset == -1) {
-        if ((sequence_offset = find_mpeg_header(buf, bs-SEQUENCE_LEN-MPEG_HEADER_LEN, SEQUENCE_ID)) >= 0) {
-            found_sequence_header = true;
-#ifndef NDEBUG
-            fprintf(stdinfo,"Found SH  @ %d+%d\n", sector, sequence_offset);
-#endif
-            sequence_aspect = get_sequence_aspect(buf).aspect;
-            if (sequence_aspect != ifo_video_attr.aspect) {
-                set_sequence_aspect(buf, sequence_offset, s_video_attr);
-            }
-        }
-    } else {
-        if (find_mpeg_header(buf+sequence_offset, MPEG_HEADER_LEN, SEQUENCE_ID)==0) {
-            found_sequence_header = true;
-#ifndef NDEBUG
-            fprintf(stdinfo,"Found SH  @ %d+%d\n", sector, sequence_offset);
-#endif
-            if (sequence_aspect!=ifo_video_attr.aspect)
-                set_sequence_aspect(buf, sequence_offset, s_video_attr);
-        } else if (look_harder) {
-        /* I can't see why the sequence headers would be at arbitrary offsets in each sector,
-         * and I've analyzed about 10 different VROs and they all have the same offsets.
-         * So I think that doing this will only redundantly scan every byte of sectors
-         * without sequence headers. */
-            int curr_offset = find_mpeg_header(buf, bs-SEQUENCE_LEN, SEQUENCE_ID);
-            if (curr_offset >= 0) {
-                found_sequence_header = true;
-                sequence_offset = curr_offset;
+    int sequence_offset = find_mpeg_header(&codes, 0, es_len-SEQUENCE_LEN, SEQUENCE_ID);
+    if (sequence_offset < 0) {
+        return;
+    }
 #ifndef NDEBUG
-                fprintf(stdinfo,"Found SH @ %d+%d\n", sector, sequence_offset);
+    fprintf(stdinfo,"Found SH  @ %d+%d\n", sector, start+sequence_offset);
 #endif
-                set_sequence_aspect(buf, sequence_offset, s_video_attr);
-            } else {
-            }
-        }
+    if (!sequence_size_is(es, sequence_offset, &ifo_video_attr)) {
+        ifo_program_attrs[program].size_mismatch = 1;
+        return;
+    }
+    if (get_sequence_aspect(es, sequence_offset) != ifo_video_attr.aspect) {
+        set_sequence_aspect(es, sequence_offset, ifo_video_attr.aspect);
     }
 
     /* As an optimization, only look for sequence display extension, if there
-     * is a sequence header in this sector. */
-    if (found_sequence_header || look_harder) {
-        if (ifo_video_attr.width <= 0 || ifo_video_attr.height <= 0) {
-            sector++;
-            return;
-        }
-        int extension_offset = look_harder ? 0 : sequence_offset + MPEG_HEADER_LEN + SEQUENCE_LEN;
-        int next_offset;
-        while ((next_offset = find_mpeg_header(buf + extension_offset,
-                                               bs - extension_offset - SEQUENCE_EXTENSION_LEN,
-                                               SEQUENCE_EXTENSION_ID)) >= 0) {
-            extension_offset += next_offset;
-            uint8_t type = *(buf + extension_offset + MPEG_HEADER_LEN);
-            if ((type&0xF0) == 0x20) {
-                p_video_attr_t e_video_attr = get_sequence_display_extension_sizes(buf, extension_offset);
+     * is a sequence header in this packet. */
+    int extension_offset = sequence_offset + MPEG_HEADER_LEN + SEQUENCE_LEN;
+    while ((extension_offset = find_mpeg_header(&codes, extension_offset,
+                                                es_len - SEQUENCE_EXTENSION_LEN,
+                                                SEQUENCE_EXTENSION_ID)) >= 0) {
+        uint8_t type = *(es + extension_offset + MPEG_HEADER_LEN);
+        if ((type&0xF0) == 0x20) {
+            int skip_colour=(type&0x01) ? 3 : 0;
+            if (extension_offset + MPEG_HEADER_LEN + (int)sizeof (type) + skip_colour + 4 > es_len) {
+                break; /* Display size not in this packet */
+            }
+            p_video_attr_t e_video_attr = get_sequence_display_extension_sizes(es, extension_offset);
 #ifndef NDEBUG
-                fprintf(stdinfo, "Found SDE @ %d+%d (%d x %d)\n", sector, extension_offset, e_video_attr.width, e_video_attr.height);
+            fprintf(stdinfo, "Found SDE @ %d+%d (%d x %d)\n", sector, start+extension_offset, e_video_attr.width, e_video_attr.height);
 #endif
-                e_video_attr.width = ifo_video_attr.width;
-                e_video_attr.height = ifo_video_attr.height;
-                set_sequence_display_extension_sizes(buf, extension_offset, e_video_attr);
+            e_video_attr.width = ifo_video_attr.width;
+            e_video_attr.height = ifo_video_attr.height;
+            set_sequence_display_extension_sizes(es, extension_offset, e_video_attr);
 #ifndef NDEBUG
-                e_video_attr = get_sequence_display_extension_sizes(buf, extension_offset);
-                fprintf(stdinfo, "New   SDE @ %d+%d (%d x %d)\n", sector, extension_offset, e_video_attr.width, e_video_attr.height);
+            e_video_attr = get_sequence_display_extension_sizes(es, extension_offset);
+            fprintf(stdinfo, "New   SDE @ %d+%d (%d x %d)\n", sector, start+extension_offset, e_video_attr.width, e_video_attr.height);
 #endif
-                break; /* Should be only 1 of these per sector */
-            } else {
+            break; /* Should be only 1 of these per sector */
+        } else {
 #ifndef NDEBUG
-                fprintf(stdinfo, "Found SE  @ %d+%d (type=%d)\n", sector, extension_offset, (type&0xF0)>>4);
+            fprintf(stdinfo, "Found SE  @ %d+%d (type=%d)\n", sector, start+extension_offset, (type&0xF0)>>4);
 #endif
-            }
-            extension_offset++;
         }
+        extension_offset++;
     }
-
-    sector++;
 }
 
 /* Haven't had a request to do this yet:
@@ -1228,11 +1324,398 @@ static void add_mpeg_nav(uint8_t* buf, const unsigned int bs)
     (void) buf; (void) bs;
 }
 
-void process_mpeg2(uint8_t* buf, const unsigned int bs, void* program)
+static const ps_hooks_t mpeg2_hooks = { check_mpeg_encryption, fix_mpeg2_aspect };
+
+static void process_mpeg2(uint8_t* buf, const unsigned int bs, mpeg2_context_t* context)
 {
-    fix_mpeg2_aspect(buf, bs, *(const unsigned int*)program);
+    parse_mpeg2_pack(buf, bs, &context->ps_state, &mpeg2_hooks, context);
     add_mpeg_nav(buf, bs);
-    check_mpeg_encryption(buf, bs, *(const unsigned int*)program);
+    context->sector++;
+}
+
+/*********************************************************************************
+ * A program is extracted in three stages connected by a ring of buffers.
+ * A reader thread fills them with runs of VOBUs from the VRO,
+ * the main thread fixes up the MPEG data in them and
+ * a writer thread drains them to the VOB.
+ * A stage waits until the next buffer in the ring is ready for it,
+ * so reading runs at most PIPE_BUFFERS runs ahead of writing.
+ *********************************************************************************/
+
+#define PIPE_BUFFERS 4
+
+typedef enum { BUF_FREE, BUF_READ, BUF_FIXED } buf_state_t;
+
+typedef struct {
+    uint8_t*    data;       /* BLOCKS_PER_OP sectors, page aligned */
+    buf_state_t state;
+    int         end_vobu;   /* Runs up to this VOBU */
+    int         bad_vobu;   /* VOBU that failed to read or -1 */
+    uint32_t    blocks;     /* Sectors in data */
+} pipe_buf_t;
+
+typedef struct {
+    pthread_mutex_t    lock;
+    pthread_cond_t     changed;
+    pipe_buf_t         buf[PIPE_BUFFERS];
+    int                vro_fd;
+    int                vob_fd;
+    off_t              vob_offset;
+    const vobu_info_t* vobu_info;
+    int                nr_of_vobu_info;
+    int                write_failed; /* The writer only frees buffers then */
+} pipeline_t;
+
+static void pipe_init(pipeline_t* pl)
+{
+    size_t buf_size = BLOCKS_PER_OP*DVD_SECTOR_SIZE;
+    uint8_t* data = mmap(NULL, PIPE_BUFFERS*buf_size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANON, -1, 0);
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "Error: Failed allocating mmap aligned buf [%s]\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    int i;
+    for (i=0; i<PIPE_BUFFERS; i++) {
+        pl->buf[i].data = data + i*buf_size;
+    }
+    pthread_mutex_init(&pl->lock, NULL);
+    pthread_cond_init(&pl->changed, NULL);
+}
+
+static void pipe_free(pipeline_t* pl)
+{
+    munmap(pl->buf[0].data, PIPE_BUFFERS*BLOCKS_PER_OP*DVD_SECTOR_SIZE);
+    pthread_mutex_destroy(&pl->lock);
+    pthread_cond_destroy(&pl->changed);
+}
+
+/* Wait until the buffer after *seq in the ring is in the given state */
+static pipe_buf_t* pipe_wait(pipeline_t* pl, unsigned int* seq, buf_state_t state)
+{
+    pipe_buf_t* buf = &pl->buf[(*seq)++ % PIPE_BUFFERS];
+    pthread_mutex_lock(&pl->lock);
+    while (buf->state != state) {
+        pthread_cond_wait(&pl->changed, &pl->lock);
+    }
+    pthread_mutex_unlock(&pl->lock);
+    return buf;
+}
+
+/* Hand buf over to the next stage */
+static void pipe_pass(pipeline_t* pl, pipe_buf_t* buf, buf_state_t state)
+{
+    pthread_mutex_lock(&pl->lock);
+    buf->state = state;
+    pthread_cond_broadcast(&pl->changed);
+    pthread_mutex_unlock(&pl->lock);
+}
+
+static void* pipe_reader(void* arg)
+{
+    pipeline_t* pl = arg;
+    const vobu_info_t* vobu_info = pl->vobu_info;
+    off_t vro_offset = pl->vob_offset; /* Where the next read starts */
+    unsigned int seq = 0;
+    int vobus = 0;
+    while (vobus < pl->nr_of_vobu_info) {
+        pipe_buf_t* buf = pipe_wait(pl, &seq, BUF_FREE);
+
+        /* Read this and the following VOBUs with one request */
+        int read_end;
+        uint32_t blocks = get_vobu_size(&vobu_info[vobus]);
+        for (read_end=vobus+1; read_end<pl->nr_of_vobu_info; read_end++) {
+            uint16_t next_size = get_vobu_size(&vobu_info[read_end]);
+            if (blocks + next_size > BLOCKS_PER_OP)
+                break;
+            blocks += next_size;
+        }
+        buf->bad_vobu = -1;
+        if (read_blocks(pl->vro_fd, vro_offset, buf->data, blocks, DVD_SECTOR_SIZE, &buf->blocks) == -1) {
+            /* The VOBUs read completely are kept and
+               the next read starts after the failing one */
+            blocks = 0;
+            for (buf->bad_vobu=vobus; ; buf->bad_vobu++) {
+                blocks += get_vobu_size(&vobu_info[buf->bad_vobu]);
+                if (blocks > buf->blocks)
+                    break;
+            }
+            read_end = buf->bad_vobu+1;
+#ifndef NDEBUG
+            fprintf(stderr, "Warning: Skipping %"PRIdMAX" bytes\n", (intmax_t)(blocks-buf->blocks)*DVD_SECTOR_SIZE);
+            /* Note we mark the whole VOBU as bad not just this skip len */
+#endif//NDEBUG
+        }
+        vro_offset += (off_t)blocks*DVD_SECTOR_SIZE;
+        buf->end_vobu = vobus = read_end;
+        pipe_pass(pl, buf, BUF_READ);
+    }
+    return NULL;
+}
+
+static void* pipe_writer(void* arg)
+{
+    pipeline_t* pl = arg;
+    unsigned int seq = 0;
+    int vobus = 0;
+    while (vobus < pl->nr_of_vobu_info) {
+        pipe_buf_t* buf = pipe_wait(pl, &seq, BUF_FIXED);
+        if (!pl->write_failed &&
+            write_blocks(pl->vob_fd, buf->data, buf->blocks, DVD_SECTOR_SIZE) == -2) {
+            pl->write_failed = 1;
+        }
+        vobus = buf->end_vobu;
+        pipe_pass(pl, buf, BUF_FREE);
+    }
+    return NULL;
+}
+
+static void pipe_start(pipeline_t* pl, pthread_t* reader, pthread_t* writer)
+{
+    int i;
+    for (i=0; i<PIPE_BUFFERS; i++) {
+        pl->buf[i].state = BUF_FREE;
+    }
+    pl->write_failed = 0;
+    int ret = pthread_create(reader, NULL, pipe_reader, pl);
+    if (!ret) {
+        ret = pthread_create(writer, NULL, pipe_writer, pl);
+    }
+    if (ret) {
+        fprintf(stderr, "Error starting extraction threads [%s]\n", strerror(ret));
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*********************************************************************************
+ * Programs are extracted one after another, or with -j by several
+ * workers at once, each with its own pipeline and VOB.
+ *********************************************************************************/
+
+typedef struct {
+    mpeg2_context_t    mpeg2;
+    const vobu_info_t* vobu_info;
+    off_t              vob_offset;
+    uint64_t           sectors;
+    int                nr_of_vobu_info;
+    int                vob_fd;
+    char*              vob_name;  /* NULL when writing to stdout */
+    struct tm          tm;        /* Timestamp for the VOB */
+    int                error;     /* Some VOBUs couldn't be read */
+    int                processed_some_video;
+} extract_job_t;
+
+typedef void (*progress_func_t)(const extract_job_t* job, int vobus, int display_char);
+
+/* Extract the program of job, running the fixup stage on this thread.
+ * progress is called after each VOBU. */
+static int extract_program(pipeline_t* pl, extract_job_t* job, progress_func_t progress)
+{
+    const p_program_attr_t* program_attr = &ifo_program_attrs[job->mpeg2.program];
+    int read_end = 0;   /* VOBUs before this one have been fixed up */
+    int bad_vobu = -1;  /* VOBU of the last read that failed */
+    unsigned int pipe_seq = 0;
+    pthread_t reader, writer;
+    int vobus;
+
+    pl->vob_fd = job->vob_fd;
+    pl->vob_offset = job->vob_offset;
+    pl->vobu_info = job->vobu_info;
+    pl->nr_of_vobu_info = job->nr_of_vobu_info;
+    pipe_start(pl, &reader, &writer);
+    for (vobus=0; vobus<job->nr_of_vobu_info; vobus++) {
+        int display_char;
+        if (vobus >= read_end) {
+            /* Fix up the next run of VOBUs and pass it on to the writer */
+            pipe_buf_t* buf = pipe_wait(pl, &pipe_seq, BUF_READ);
+            uint32_t block;
+            for (block=0; block<buf->blocks; block++) {
+                process_mpeg2(buf->data+block*DVD_SECTOR_SIZE, DVD_SECTOR_SIZE, &job->mpeg2);
+            }
+            read_end = buf->end_vobu;
+            bad_vobu = buf->bad_vobu;
+            pipe_pass(pl, buf, BUF_FIXED);
+        }
+        if (vobus == bad_vobu) {
+            display_char='X';
+            job->error=1;
+        } else if (program_attr->scrambled == SCRAMBLED ||
+                   program_attr->scrambled == PARTIALLY_SCRAMBLED) {
+            display_char='E';
+            job->processed_some_video = 1;
+        } else {
+            display_char=0; /* default */
+            job->processed_some_video = 1;
+        }
+        progress(job, vobus, display_char);
+    }
+    pthread_join(reader, NULL);
+    pthread_join(writer, NULL);
+    if (pl->write_failed) {
+        return -2;
+    }
+    if (job->vob_name) {
+        close(job->vob_fd);
+        touch(job->vob_name, &job->tm);
+    }
+    return 0;
+}
+
+static void program_progress(const extract_job_t* job, int vobus, int display_char)
+{
+    int percent=((vobus+1)*100)/job->nr_of_vobu_info;
+    percent_display(PERCENT_UPDATE, percent, display_char);
+}
+
+/* Programs for the workers, biggest first */
+static struct {
+    pthread_mutex_t lock;
+    extract_job_t** jobs;
+    int             nr_of_jobs;
+    int             next_job;
+    int             vobus_done;   /* Of all programs, for the progress display */
+    int             nr_of_vobus;
+    int             vro_fd;
+    int             write_failed;
+} job_queue;
+
+static void merged_progress(const extract_job_t* job, int vobus, int display_char)
+{
+    (void) job; (void) vobus;
+    pthread_mutex_lock(&job_queue.lock);
+    job_queue.vobus_done++;
+    percent_display(PERCENT_UPDATE, (job_queue.vobus_done*100)/job_queue.nr_of_vobus, display_char);
+    pthread_mutex_unlock(&job_queue.lock);
+}
+
+static void* extract_worker(void* arg)
+{
+    pipeline_t pl;
+    (void) arg;
+    pl.vro_fd = job_queue.vro_fd;
+    pipe_init(&pl);
+    for (;;) {
+        extract_job_t* job = NULL;
+        pthread_mutex_lock(&job_queue.lock);
+        if (job_queue.next_job < job_queue.nr_of_jobs) {
+            job = job_queue.jobs[job_queue.next_job++];
+        }
+        pthread_mutex_unlock(&job_queue.lock);
+        if (!job) {
+            break;
+        }
+        job->vob_fd = open(job->vob_name, O_WRONLY|O_BINARY);
+        if (job->vob_fd == -1) {
+            fprintf(stderr, "Error opening [%s] (%s)\n", job->vob_name, strerror(errno));
+        }
+        if (job->vob_fd == -1 || extract_program(&pl, job, merged_progress) == -2) {
+            pthread_mutex_lock(&job_queue.lock);
+            job_queue.write_failed = 1;
+            pthread_mutex_unlock(&job_queue.lock);
+        }
+    }
+    pipe_free(&pl);
+    return NULL;
+}
+
+static int cmp_job_size(const void* a, const void* b)
+{
+    const extract_job_t* job_a = *(extract_job_t* const*)a;
+    const extract_job_t* job_b = *(extract_job_t* const*)b;
+    return (job_a->sectors < job_b->sectors) - (job_a->sectors > job_b->sectors);
+}
+
+/* Extract all jobs with up to workers threads.
+ * Return true if all VOBUs could be read. */
+static bool extract_parallel(extract_job_t* jobs, int nr_of_jobs, int vro_fd, unsigned long workers)
+{
+    pthread_t* threads = malloc(workers * sizeof(pthread_t));
+    job_queue.jobs = malloc(nr_of_jobs * sizeof(extract_job_t*));
+    if (!threads || !job_queue.jobs) {
+        fprintf(stderr, "Error allocating space for extraction jobs\n");
+        exit(EXIT_FAILURE);
+    }
+    int i;
+    job_queue.nr_of_vobus = 0;
+    for (i=0; i<nr_of_jobs; i++) {
+        job_queue.jobs[i] = &jobs[i];
+        job_queue.nr_of_vobus += jobs[i].nr_of_vobu_info;
+    }
+    qsort(job_queue.jobs, nr_of_jobs, sizeof(extract_job_t*), cmp_job_size);
+    job_queue.nr_of_jobs = nr_of_jobs;
+    job_queue.next_job = 0;
+    job_queue.vobus_done = 0;
+    job_queue.vro_fd = vro_fd;
+    job_queue.write_failed = 0;
+    pthread_mutex_init(&job_queue.lock, NULL);
+
+    if (workers > (unsigned long)nr_of_jobs) {
+        workers = nr_of_jobs;
+    }
+    percent_display(PERCENT_START, 0, 0);
+    unsigned long worker;
+    for (worker=0; worker<workers; worker++) {
+        int ret = pthread_create(&threads[worker], NULL, extract_worker, NULL);
+        if (ret) {
+            fprintf(stderr, "Error starting extraction threads [%s]\n", strerror(ret));
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (worker=0; worker<workers; worker++) {
+        pthread_join(threads[worker], NULL);
+    }
+    if (job_queue.write_failed) {
+        exit(EXIT_FAILURE);
+    }
+
+    bool read_ok = true;
+    for (i=0; i<nr_of_jobs; i++) {
+        if (jobs[i].error) {
+            read_ok = false;
+        }
+    }
+    if (read_ok) {
+        percent_display(PERCENT_END, 0, 0);
+    } else {
+        /* Leave the percent display showing read errors */
+        putc('\n', stderr);
+    }
+
+    pthread_mutex_destroy(&job_queue.lock);
+    free(job_queue.jobs);
+    free(threads);
+    return read_ok;
+}
+
+/* Warn about the encryption state of program, naming it if pgm_num */
+static void report_scrambling(const unsigned int program, const bool processed_some_video, const bool pgm_num)
+{
+    char num[16] = "";
+    if (pgm_num) {
+        (void) snprintf(num, sizeof(num), " %u", program+1);
+    }
+    if (ifo_program_attrs[program].scrambled == SCRAMBLED) {
+        fprintf(stderr, "Warning: program%s is encrypted\n", num);
+    } else if (ifo_program_attrs[program].scrambled == PARTIALLY_SCRAMBLED) {
+        fprintf(stderr, "Warning: program%s is partially encrypted\n", num);
+    } else if (ifo_program_attrs[program].scrambled == SCRAMBLED_UNSET && processed_some_video) {
+        fprintf(stderr, "Warning: didn't detect a video stream%s%s, please report\n",
+                pgm_num ? " in program" : "", num);
+        fprintf(stderr, "  (preferably with a sample vob file)\n");
+    }
+}
+
+/* Warn if --fix-headers left sequence headers of program alone, naming it if pgm_num */
+static void report_size_mismatch(const unsigned int program, const bool pgm_num)
+{
+    if (ifo_program_attrs[program].size_mismatch) {
+        const p_video_attr_t* video_attr = &ifo_video_attrs[ifo_program_attrs[program].video_attr];
+        char num[16] = "";
+        if (pgm_num) {
+            (void) snprintf(num, sizeof(num), " %u", program+1);
+        }
+        fprintf(stderr, "Warning: MPEG headers of program%s not fixed up, as they're not %dx%d\n",
+                num, video_attr->width, video_attr->height);
+    }
 }
 
 /*********************************************************************************
@@ -1240,6 +1723,7 @@ void process_mpeg2(uint8_t* buf, const unsigned int bs, void* program)
  *********************************************************************************/
 
 unsigned long required_program=0; /* process all programs by default */
+unsigned long parallel_jobs=1;    /* programs extracted at once */
 const char* ifo_name=NULL;
 const char* vro_name=NULL;
 
@@ -1264,6 +1748,15 @@ static void usage(char** argv, int error)
                    "                     `[pgm]' means the program number\n"
                    "                     So you can combine i.e.: [ts]-[label]#[pgm]\n"
                    "\n"
+                   "      --fix-headers  Set the aspect ratio in the MPEG sequence headers and\n"
+                   "                     the size in sequence display extensions from the IFO.\n"
+                   "                     Headers with a frame size other than the IFO's\n"
+                   "                     are left as they are.\n"
+                   "\n"
+                   "  -j, --jobs=NUM     Extract NUM programs at once, each to its own vob\n"
+                   "                     file. All the (empty) vob files are created before\n"
+                   "                     extraction starts. Not used when writing to stdout.\n"
+                   "\n"
                    "      --help         Display this help and exit.\n"
                    "      --version      Output version information and exit.\n"
                    ,argv[0]);
@@ -1278,13 +1771,15 @@ static void get_options(int argc, char** argv)
          * without a corresponding short option. */
         {"program", required_argument, NULL, 'p'},
         {"name", required_argument, NULL, 'n'},
+        {"jobs", required_argument, NULL, 'j'},
+        {"fix-headers", no_argument, NULL, 'F'},
         {"help", no_argument, NULL, 'H'},
         {"version", no_argument, NULL, 'V'},
         {NULL, 0, NULL, 0}
     };
 
     int opt;
-    while ((opt = getopt_long(argc, argv, "p:n:", longopts, NULL)) != -1) {
+    while ((opt = getopt_long(argc, argv, "p:n:j:", longopts, NULL)) != -1) {
         switch (opt) {
         case 'p': {
             char* trailing;
@@ -1297,6 +1792,17 @@ static void get_options(int argc, char** argv)
         case 'n':
             base_name = optarg;
             break;
+        case 'j': {
+            char* trailing;
+            parallel_jobs = strtoul(optarg, &trailing, 10);
+            if (*trailing || !parallel_jobs) {
+                usage(argv, EXIT_FAILURE);
+            }
+            break;
+        }
+        case 'F':
+            fix_mpeg_headers = true;
+            break;
         case 'V':
             printf("dvd-vr "VERSION);
             printf("\n\nWritten by Pádraig Brady <P@draigBrady.com>\n");
@@ -1329,6 +1835,7 @@ static void get_options(int argc, char** argv)
 int main(int argc, char** argv)
 {
     setlocale(LC_ALL,"");
+    init_start_codes();
 #ifdef HAVE_ICONV
     sys_charset=get_charset();
 #endif
@@ -1463,6 +1970,19 @@ int main(int argc, char** argv)
     typedef uint32_t vvobi_sa_t;
     vvobi_sa_t* vvobi_sa=(vvobi_sa_t*)(pgi_gi+1);
 	vobu_info_t* vobu_info = NULL;
+    extract_job_t* jobs = NULL; /* Extracted after reading the IFO with -j */
+    int nr_of_jobs = 0;
+    pipeline_t pipeline;        /* Otherwise programs are extracted with this */
+    if (vro_fd != -1 && parallel_jobs > 1 && !STREQ(base_name, "-")) {
+        jobs = malloc(pgi_gi->nr_of_programs * sizeof(extract_job_t));
+        if (!jobs) {
+            fprintf(stderr, "Error allocating space for extraction jobs\n");
+            exit(EXIT_FAILURE);
+        }
+    } else if (vro_fd != -1) {
+        pipeline.vro_fd = vro_fd;
+        pipe_init(&pipeline);
+    }
     for (program=0; program<pgi_gi->nr_of_programs; program++) {
 
         if (required_program && program+1!=required_program) {
@@ -1559,6 +2079,12 @@ int main(int argc, char** argv)
                 vvobi_sa++;
                 continue;
             }
+            if (jobs) {
+                /* Just claim the name here, in program order.
+                   The worker opens it again when it gets to the program. */
+                close(vob_fd);
+                vob_fd = -1;
+            }
         }
 
         if (vob_types>1) {
@@ -1566,6 +2092,7 @@ int main(int argc, char** argv)
         }
         ifo_program_attrs[program].video_attr = vvob->vob_format_id-1;
         ifo_program_attrs[program].scrambled = SCRAMBLED_UNSET;
+        ifo_program_attrs[program].size_mismatch = 0;
 
         NTOHS(vvob->vob_attr);
         int skip=0;
@@ -1595,99 +2122,75 @@ hexdump(vobu_map, sizeof(vobu_map_t));
             exit(EXIT_FAILURE);
         }
         vob_offset *= DVD_SECTOR_SIZE;
-        if (vro_fd!=-1) {
-            if (lseek(vro_fd, vob_offset, SEEK_SET)==(off_t)-1) {
-                fprintf(stderr, "Error seeking within VRO [%s]\n", strerror(errno));
-                exit(EXIT_FAILURE);
-            }
-        }
         vobu_info = (vobu_info_t*) (((uint8_t*)(vobu_map+1)) + vobu_map->nr_of_time_info*sizeof(time_info_t));
         int vobus;
         uint64_t tot=0;
-        int display_char;
-        bool processed_some_video = false;
-        int error=0;
-        if (vro_fd != -1) {
-            percent_display(PERCENT_START, 0, 0);
-            init_mpeg2_cache();
-        }
         for (vobus=0; vobus<vobu_map->nr_of_vobu_info; vobus++) {
-            uint16_t vobu_size = *(uint16_t*)(&vobu_info->vobu_info[1]);
-			vobu_size=ntohs(vobu_size);
-            vobu_size&=0x03FF;
+            uint16_t vobu_size = get_vobu_size(&vobu_info[vobus]);
 #ifndef NDEBUG
 		fprintf(stdinfo, "vobu #%d size: %d\n", vobus, vobu_size);
 #endif
-            if (vro_fd != -1) {
-                off_t curr_offset = lseek(vro_fd, 0, SEEK_CUR);
-                if (curr_offset == (off_t)-1) {
-                    fprintf(stderr, "Error determining VRO offset [%s]\n", strerror(errno));
-                    exit(EXIT_FAILURE);
-                }
-                int ret = stream_data(vro_fd, vob_fd, vobu_size, DVD_SECTOR_SIZE, process_mpeg2, &program);
-                if (ret == -2) { /* write error */
-                    exit(EXIT_FAILURE);
-                } else if (ret == -1) { /* read error */
-                    display_char='X';
-                    error=1;
-                    off_t new_offset = lseek(vro_fd, 0, SEEK_CUR);
-                    if (new_offset == (off_t)-1) {
-                        fprintf(stderr, "Error determining VRO offset [%s]\n", strerror(errno));
-                        exit(EXIT_FAILURE);
-                    }
-                    off_t skip_len = (curr_offset + vobu_size*DVD_SECTOR_SIZE) - new_offset;
-                    if (skip_len) {
-#ifndef NDEBUG
-                        fprintf(stderr, "Warning: Skipping %"PRIdMAX" bytes\n", skip_len);
-                        /* Note we mark the whole VOBU as bad not just this skip len */
-#endif//NDEBUG
-                        if (lseek(vro_fd, skip_len, SEEK_CUR) == (off_t)-1) {
-                            fprintf(stderr, "Error skipping in VRO [%s]\n", strerror(errno));
-                            exit(EXIT_FAILURE);
-                        }
-                    }
-                } else if (ifo_program_attrs[program].scrambled == SCRAMBLED ||
-                           ifo_program_attrs[program].scrambled == PARTIALLY_SCRAMBLED) {
-                    display_char='E';
-                    processed_some_video = true;
-                } else {
-                    display_char=0; /* default */
-                    processed_some_video = true;
-                }
-
-                int percent=((vobus+1)*100)/vobu_map->nr_of_vobu_info;
-                percent_display(PERCENT_UPDATE, percent, display_char);
-            }
             tot+=vobu_size;
-            vobu_info++;
         }
+        bool processed_some_video = false;
         if (vro_fd != -1) {
-            if (!error) {
-                percent_display(PERCENT_END, 0, 0);
-            } else {
-                /* Leave the percent display showing read errors */
-                putc('\n', stderr);
+            extract_job_t serial_job;
+            extract_job_t* job = jobs ? &jobs[nr_of_jobs++] : &serial_job;
+            init_mpeg2_context(&job->mpeg2, program);
+            job->vobu_info = vobu_info;
+            job->nr_of_vobu_info = vobu_map->nr_of_vobu_info;
+            job->vob_offset = vob_offset;
+            job->sectors = tot;
+            job->vob_fd = vob_fd;
+            job->vob_name = NULL;
+            if (vob_fd != fileno(stdout) && !(job->vob_name = strdup(vob_name))) {
+                fprintf(stderr, "Error allocating space for VOB name\n");
+                exit(EXIT_FAILURE);
             }
-            if (vob_fd != fileno(stdout)) {
-                close(vob_fd);
-                touch(vob_name, &tm);
+            job->tm = tm;
+            job->error = 0;
+            job->processed_some_video = 0;
+            if (!jobs) {
+                percent_display(PERCENT_START, 0, 0);
+                if (extract_program(&pipeline, job, program_progress) == -2) {
+                    exit(EXIT_FAILURE);
+                }
+                if (!job->error) {
+                    percent_display(PERCENT_END, 0, 0);
+                } else {
+                    /* Leave the percent display showing read errors */
+                    putc('\n', stderr);
+                }
+                processed_some_video = job->processed_some_video;
+                free(job->vob_name);
             }
         }
 
         fprintf(stdinfo, "size : %'"PRIu64"\n",tot*DVD_SECTOR_SIZE);
 
-        if (ifo_program_attrs[program].scrambled == SCRAMBLED) {
-            fprintf(stderr, "Warning: program is encrypted\n");
-        } else if (ifo_program_attrs[program].scrambled == PARTIALLY_SCRAMBLED) {
-            fprintf(stderr, "Warning: program is partially encrypted\n");
-        } else if (ifo_program_attrs[program].scrambled == SCRAMBLED_UNSET && processed_some_video) {
-            fprintf(stderr, "Warning: didn't detect a video stream, please report\n");
-            fprintf(stderr, "  (preferably with a sample vob file)\n");
+        if (!jobs) {
+            report_scrambling(program, processed_some_video, false);
+            report_size_mismatch(program, false);
         }
 
         vvobi_sa++;
     }
 
+    if (nr_of_jobs) {
+        fflush(stdinfo);
+        extract_parallel(jobs, nr_of_jobs, vro_fd, parallel_jobs);
+        int job;
+        for (job=0; job<nr_of_jobs; job++) {
+            report_scrambling(jobs[job].mpeg2.program, jobs[job].processed_some_video, true);
+            report_size_mismatch(jobs[job].mpeg2.program, true);
+            free(jobs[job].vob_name);
+        }
+    }
+    if (vro_fd != -1 && !jobs) {
+        pipe_free(&pipeline);
+    }
+    free(jobs);
+
     free(ifo_program_attrs);
     free(ifo_video_attrs);
     munmap(rtav_vmgi_ptr, vmg_size);
@@ -0,0 +1,150 @@
+//vim:fileencoding=utf8
+/*
+ start_codes.h  Find the MPEG start codes in a sector of a DVD-VR VRO
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+#ifndef START_CODES_H
+#define START_CODES_H
+
+#include <stdint.h>
+
+/* The start codes (00 00 01 xx) of a sector are found in one pass
+ * and find_mpeg_header() looks them up by type (the xx).
+ * This is the hottest loop in extraction, so on x86 the scan
+ * uses SSE2 or AVX2 when the CPU supports it. */
+
+#if defined(__GNUC__) && (__GNUC__ >= 5 || defined(__clang__)) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_SIMD
+#include <immintrin.h>
+#endif
+
+#define START_CODE_LEN 4
+#define MAX_START_CODES 1024 /* more than fit in a 2048 byte sector */
+
+typedef struct {
+    int      count;
+    uint16_t offset[MAX_START_CODES]; /* ascending */
+    uint8_t  type[MAX_START_CODES];
+} start_codes_t;
+
+static inline void add_start_code(const uint8_t* buf, const unsigned int offset, start_codes_t* codes)
+{
+    if (codes->count < MAX_START_CODES) {
+        codes->offset[codes->count] = offset;
+        codes->type[codes->count++] = buf[offset+3];
+    }
+}
+
+/* Scan buf from offset on */
+static void scan_start_codes(const uint8_t* buf, const unsigned int bs, unsigned int offset, start_codes_t* codes)
+{
+    while (offset + START_CODE_LEN <= bs) {
+        if (buf[offset+2] > 1) {          /* no code can start at any of these 3 */
+            offset += 3;
+        } else if (buf[offset+1]) {       /* nor at these 2 */
+            offset += 2;
+        } else {
+            if (!buf[offset] && buf[offset+2] == 1)
+                add_start_code(buf, offset, codes);
+            offset++;
+        }
+    }
+}
+
+static void find_start_codes_c(const uint8_t* buf, const unsigned int bs, start_codes_t* codes)
+{
+    codes->count = 0;
+    scan_start_codes(buf, bs, 0, codes);
+}
+
+#ifdef HAVE_X86_SIMD
+/* Compare 16 or 32 offsets at once, while the type byte of the last is in buf */
+
+__attribute__((target("sse2")))
+static void find_start_codes_sse2(const uint8_t* buf, const unsigned int bs, start_codes_t* codes)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi8(1);
+    unsigned int offset;
+    codes->count = 0;
+    for (offset=0; offset + 16 + START_CODE_LEN-1 <= bs; offset += 16) {
+        __m128i b0 = _mm_loadu_si128((const __m128i*)(buf+offset));
+        __m128i b1 = _mm_loadu_si128((const __m128i*)(buf+offset+1));
+        __m128i b2 = _mm_loadu_si128((const __m128i*)(buf+offset+2));
+        __m128i hit = _mm_and_si128(_mm_cmpeq_epi8(b2, one),
+                                    _mm_and_si128(_mm_cmpeq_epi8(b0, zero), _mm_cmpeq_epi8(b1, zero)));
+        unsigned int mask = _mm_movemask_epi8(hit);
+        while (mask) {
+            add_start_code(buf, offset + __builtin_ctz(mask), codes);
+            mask &= mask - 1;
+        }
+    }
+    scan_start_codes(buf, bs, offset, codes);
+}
+
+__attribute__((target("avx2")))
+static void find_start_codes_avx2(const uint8_t* buf, const unsigned int bs, start_codes_t* codes)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i one = _mm256_set1_epi8(1);
+    unsigned int offset;
+    codes->count = 0;
+    for (offset=0; offset + 32 + START_CODE_LEN-1 <= bs; offset += 32) {
+        __m256i b0 = _mm256_loadu_si256((const __m256i*)(buf+offset));
+        __m256i b1 = _mm256_loadu_si256((const __m256i*)(buf+offset+1));
+        __m256i b2 = _mm256_loadu_si256((const __m256i*)(buf+offset+2));
+        __m256i hit = _mm256_and_si256(_mm256_cmpeq_epi8(b2, one),
+                                       _mm256_and_si256(_mm256_cmpeq_epi8(b0, zero), _mm256_cmpeq_epi8(b1, zero)));
+        unsigned int mask = _mm256_movemask_epi8(hit);
+        while (mask) {
+            add_start_code(buf, offset + __builtin_ctz(mask), codes);
+            mask &= mask - 1;
+        }
+    }
+    scan_start_codes(buf, bs, offset, codes);
+}
+#endif //HAVE_X86_SIMD
+
+static void (*find_start_codes)(const uint8_t* buf, const unsigned int bs, start_codes_t* codes) = find_start_codes_c;
+
+/* Use the fastest scan the CPU supports */
+static inline void init_start_codes(void)
+{
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        find_start_codes = find_start_codes_avx2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        find_start_codes = find_start_codes_sse2;
+    }
+#endif //HAVE_X86_SIMD
+}
+
+/* Return offset to the first header of type at or after from,
+ * that ends within bs, or -1 if not found */
+static int find_mpeg_header(const start_codes_t* codes, const int from, const int bs, const uint8_t type)
+{
+    int i;
+    for (i=0; i<codes->count && codes->offset[i] + START_CODE_LEN <= bs; i++) {
+        if (codes->offset[i] >= from && codes->type[i] == type)
+            return codes->offset[i];
+    }
+    return -1;
+}
+
+#endif //START_CODES_H
@@ -25,10 +25,14 @@
  */
 
 #define _LARGEFILE64_SOURCE
+#ifdef __linux__
+#define _GNU_SOURCE		// fallocate(), O_DIRECT
+#endif
 #ifdef WIN32
 #define __USE_MINGW_ANSI_STDIO 1
 #endif
 #include <stdio.h>
+#include <stdlib.h>
 #include <errno.h>
 #include <string.h>
 #include <sys/stat.h>
@@ -39,6 +43,18 @@
 #include <time.h>
 #include <fcntl.h>
 #include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
+#ifdef HAVE_IO_URING
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#endif
 #include "meihdfs1.h"
 
 #ifndef O_LARGEFILE
@@ -49,118 +65,1546 @@
 #endif
 #ifdef WIN32
 #define mkdir(x,y) mkdir(x)
+/* MinGW has no pread, but every worker thread has its own descriptor anyway */
+static ssize_t pread64(int fd, void *buf, size_t count, off64_t offset)
+{
+	if (lseek64(fd, offset, SEEK_SET) == (off64_t)-1) return -1;
+	return read(fd, buf, count);
+}
+static ssize_t pwrite64(int fd, const void *buf, size_t count, off64_t offset)
+{
+	if (lseek64(fd, offset, SEEK_SET) == (off64_t)-1) return -1;
+	return write(fd, buf, count);
+}
+#define fdatasync(fd) _commit(fd)
+#endif
+
+#define MAX_THREADS 64
+#define IO_CHUNK (2 * ASIZE)	// Maximum size of a single read/write request
+#define IO_DEPTH 4		// Number of IO_CHUNK buffers in flight per file
+#define ZC_CHUNK 0x4000000	// Maximum size of a single in-kernel copy, for progress display
+#define ZERO_BLOCK 0x10000	// Blocks of zeros in the data are left as holes in the output file
+#define DIRECT_ALIGN_MAX 0x10000	// Largest block size O_DIRECT requests get aligned to
+#define WB_WINDOW 0x800000	// Writeback of output is started every 8MB when bypassing the page cache
+#define JOURNAL_NAME ".extract_meihdfs.journal"
+#define JOURNAL_STEP 0x4000000	// Progress of a file is recorded in the journal every 64MB
+
+typedef struct
+{
+	off64_t src;	// Offset in image
+	off64_t dst;	// Offset in output file
+	off64_t len;
+} EXTENT;
+
+typedef struct
+{
+	EXTENT *ext;
+	int n, cur;		// Number of extents, current extent
+	off64_t pos;	// Position within current extent
+} CHUNKER;
+
+typedef struct
+{
+	int fdf;		// Output file descriptor
+	char *outfile;
+	off64_t size;	// File size
+	time_t mtime;	// Timestamp of file in image
+	off64_t written;	// Bytes of the file written so far
+	off64_t synced;		// Offset up to which the file is recorded as written in the journal
+	int prealloc;	// Space for the whole file has been reserved
+	off64_t wb_start, wb_done;	// Writeback has been started from wb_done up to wb_start
+} EXTFILE;
+
+typedef struct
+{
+	char *file;		// Path relative to output directory
+	int complete;	// File is finished, otherwise size is the offset up to which it was written
+	off64_t size;
+	time_t mtime;	// Timestamp of file in image
+	int seq;		// Position in journal, later records override earlier ones
+} JOURNAL_ENTRY;
+
+typedef struct journal
+{
+	int fd;			// Records are appended with a single write(), so worker threads don't need to lock
+	const char *root;	// Output directory, paths in the journal are relative to it
+	JOURNAL_ENTRY *ent;	// Last record per file of the previous run, sorted by path
+	int count;
+} JOURNAL;
+
+typedef struct
+{
+	off64_t pos, size;
+} BADAREA;
+
+typedef struct badmap
+{
+	BADAREA *area;	// Sorted, non-overlapping unreadable areas of the image
+	int count;
+} BADMAP;
+
+typedef struct
+{
+	int type;		// TYPE_FILE or TYPE_DIRECTORY
+	off64_t size;	// File size, used to schedule biggest files first
+	time_t mtime;	// Timestamp to set after extraction
+	inode inod;		// Copy of file inode, only valid for TYPE_FILE
+	char file[PATH_MAX];
+} EXTJOB;
+
+typedef struct
+{
+	pthread_mutex_t mtx;
+	EXTJOB *jobs;	// Job list built by directory traversal
+	int njobs, maxjobs;
+	int next;		// Next job to be picked up by a worker
+	int files, done, errors;
+	off64_t total, written;
+	time_t last_progress;
+} EXTPOOL;
+
+#define ITABLES_V20	6
+#define ITABLES_V23 9
+#define ITABLES_MAX ITABLES_V23
+
+/* Differences between filesystem versions, chosen once when the header is found.
+ * V2.1 differs from V2.0 only in the magics covered by the _GEN masks and in the
+ * position of its inode tables, which lies within the range searched from ITBL_START.
+ */
+typedef struct
+{
+	int itables;		// Number of inode tables
+	uint32 time_offset;	// Added to times on disk to get UNIX time
+} FSVERSION;
+
+const FSVERSION fs_v20 = {ITABLES_V20, TIME_OFFSET};
+const FSVERSION fs_v23 = {ITABLES_V23, 0};
+
+typedef struct
+{
+	int fdd;		// File descriptor of disk file
+	off64_t start;	// Start address within file
+	const FSVERSION *fs;	// Parameters of filesystem version
+	const char *image;	// Path to image, every worker thread opens its own descriptor
+	EXTPOOL *pool;	// Worker pool for parallel extraction, NULL if extracting inline
+	int no_uring;	// Use reader/writer threads even if io_uring is available
+	int no_zerocopy;	// Filesystem cannot copy_file_range() from image to output
+	int no_reflink;		// Filesystem cannot share blocks between image and output
+	int threads;	// Number of threads for parallel work, 0 if not requested
+	struct backup_index *backup;	// Inode pointers of backup superblocks, built on first use
+	struct meta_cache *meta;	// Cache of metadata blocks used by directory traversal
+	JOURNAL *journal;	// Journal of extracted files, NULL if listing
+	int direct;		// Read file data with O_DIRECT, bypassing the page cache
+	int fdr;		// Image opened with O_DIRECT, shared by all threads
+	int align;		// Alignment of O_DIRECT requests
+	char *dbuf;		// Aligned buffers of this thread for O_DIRECT, reused for all files
+	BADMAP *map;	// Bad areas from ddrescue mapfile, NULL if none given
+} EXTRINST;
+
+#define FILETIME(tim) (tim + pInst->fs->time_offset)
+
+#define SEARCH_STRIDE 0x10000
+#define SEARCH_CHUNK (256 * SEARCH_STRIDE)	// Image is scanned in big sequential reads
+
+int cmp_area(const void *a, const void *b)
+{
+	const BADAREA *aa = a, *ab = b;
+
+	return aa->pos < ab->pos ? -1 : (aa->pos > ab->pos);
+}
+
+/* Loads the areas of a ddrescue mapfile that are not finished ('+'), these either
+ * couldn't be read or haven't been tried yet and are zero-filled in the image.
+ */
+BADMAP *map_load(const char *mapfile)
+{
+	BADMAP *map;
+	BADAREA *area;
+	FILE *fp;
+	char line[256], status;
+	long long pos, size;
+	int i, k, max = 0, hdr = 0;
+
+	if (!(fp = fopen(mapfile, "r")))
+	{
+		fprintf(stderr, "Cannot open mapfile %s: %s\n", mapfile, strerror(errno));
+		return NULL;
+	}
+	if (!(map = calloc(1, sizeof(BADMAP))))
+	{
+		fclose(fp);
+		return NULL;
+	}
+	while (fgets(line, sizeof(line), fp))
+	{
+		if (line[0] == '#') continue;
+		/* First line is the status line: current_pos current_status [current_pass] */
+		if (!hdr++) continue;
+		if (sscanf(line, "%lli %lli %c", &pos, &size, &status) != 3 || status == '+' || size <= 0) continue;
+		if (map->count == max)
+		{
+			max = max ? max * 2 : 256;
+			if (!(area = realloc(map->area, max * sizeof(BADAREA))))
+			{
+				fprintf(stderr, "Out of memory loading mapfile %s\n", mapfile);
+				break;
+			}
+			map->area = area;
+		}
+		map->area[map->count].pos = pos;
+		map->area[map->count++].size = size;
+	}
+	fclose(fp);
+
+	/* Merge adjacent areas, so that a lookup finds the whole unreadable range at once */
+	qsort(map->area, map->count, sizeof(BADAREA), cmp_area);
+	for (i=0, k=0; i<map->count; i++)
+	{
+		if (k && map->area[k-1].pos + map->area[k-1].size >= map->area[i].pos)
+		{
+			if (map->area[i].pos + map->area[i].size > map->area[k-1].pos + map->area[k-1].size)
+				map->area[k-1].size = map->area[i].pos + map->area[i].size - map->area[k-1].pos;
+			continue;
+		}
+		map->area[k++] = map->area[i];
+	}
+	map->count = k;
+	for (i=0, pos=0; i<map->count; i++) pos += map->area[i].size;
+	printf ("Mapfile %s: %d bad areas, %lld bytes\n", mapfile, map->count, pos);
+	return map;
+}
+
+void map_free(BADMAP *map)
+{
+	if (!map) return;
+	free(map->area);
+	free(map);
+}
+
+/* Finds the first bad area that overlaps pos..pos+len and returns the overlapping part */
+int map_bad(BADMAP *map, off64_t pos, off64_t len, off64_t *bad_pos, off64_t *bad_len)
+{
+	int lo = 0, hi, mid;
+	off64_t end;
+
+	if (!map || !map->count || len <= 0) return 0;
+	/* First area that ends after pos */
+	for (hi = map->count; lo < hi; )
+	{
+		mid = (lo + hi) / 2;
+		if (map->area[mid].pos + map->area[mid].size <= pos) lo = mid + 1; else hi = mid;
+	}
+	if (lo == map->count || map->area[lo].pos >= pos + len) return 0;
+	if (bad_pos)
+	{
+		*bad_pos = map->area[lo].pos > pos ? map->area[lo].pos : pos;
+		end = map->area[lo].pos + map->area[lo].size;
+		*bad_len = (end < pos + len ? end : pos + len) - *bad_pos;
+	}
+	return 1;
+}
+
+int search_hdr(EXTRINST *pInst)
+{
+	char *buffer = NULL, *hdr;
+	ssize_t rd = 0, pos;
+	time_t now, last_progress = 0;
+	int fd = pInst->fdd, ver;
+	off64_t end = pInst->map ? lseek64(pInst->fdd, 0, SEEK_END) : 0;
+
+#ifdef O_DIRECT
+	/* Scanning a whole disk through the page cache would evict everything else */
+	if (pInst->direct && pInst->start % pInst->align == 0 && 
+		posix_memalign((void**)&buffer, pInst->align, SEARCH_CHUNK) == 0) fd = pInst->fdr;
+	else
+#endif
+	buffer = malloc(SEARCH_CHUNK);
+	if (!buffer)
+	{
+		fprintf(stderr, "Out of memory searching header\n");
+		return -1;
+	}
+#ifdef POSIX_FADV_SEQUENTIAL
+	posix_fadvise(pInst->fdd, pInst->start, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+	for (; ; pInst->start += SEARCH_CHUNK)
+	{
+		if (map_bad(pInst->map, pInst->start, SEARCH_CHUNK, NULL, NULL))
+		{
+			/* Just read the headers of the search positions that are readable */
+			if (pInst->start >= end) break;
+			for (pos = 0; pos < SEARCH_CHUNK; pos += SEARCH_STRIDE)
+			{
+				memset(buffer + pos, 0, 20);
+				if (!map_bad(pInst->map, pInst->start + pos, 20, NULL, NULL) &&
+					pread64(pInst->fdd, buffer + pos, 20, pInst->start + pos) != 20) break;
+			}
+			if (!(rd = pos)) break;
+		}
+		else if ((rd = pread64(fd, buffer, SEARCH_CHUNK, pInst->start)) <= 0) break;
+		if ((now = time(NULL)) != last_progress)
+		{
+			last_progress = now;
+			printf ("\rSearching MEIHDFS header...%10llX", pInst->start);
+			fflush(stdout);
+		}
+		for (pos = 0; pos + 20 <= rd; pos += SEARCH_STRIDE)
+		{
+			hdr = buffer + pos;
+			if(memcmp(hdr+8, "MEIHDFS-V2.", 11) == 0 || memcmp(hdr+8, "HDFS2.", 6) == 0)
+			{
+				pInst->start += pos;
+				printf ("\rSearching MEIHDFS header...%10llX FOUND!\n", pInst->start);
+				ver = hdr[8]=='M'?hdr[19]-'0':hdr[14]-'0';
+				pInst->fs = ver<3?&fs_v20:&fs_v23;
+				free(buffer);
+				return ver;
+			}
+		}
+	}
+	if (rd < 0) fprintf(stderr, "\nRead error @%10llX: %s\n", pInst->start, strerror(errno));
+	else fprintf(stderr, "\nHeader could not be found!\n");
+	free(buffer);
+	return rd<0?-1:-2;
+}
+
+int list_file(EXTRINST *pInst, inode *inode, char *outfile)
+{
+	time_t ttime;
+	struct tm *btime;
+	off64_t fsize;
+
+	ttime = FILETIME(inode_time1(inode));
+	btime = gmtime(&ttime);
+	fsize = inode_fsize(inode);
+	printf("%4i-%02i-%02i %02i:%02i:%02i %20lld %s\n", btime->tm_year + 1900, 
+		btime->tm_mon+1, btime->tm_mday, btime->tm_hour, 
+		btime->tm_min, btime->tm_sec, fsize, outfile);
+}
+
+int cmp_journal(const void *a, const void *b)
+{
+	const JOURNAL_ENTRY *ja = a, *jb = b;
+	int r = strcmp(ja->file, jb->file);
+
+	return r ? r : ja->seq - jb->seq;
+}
+
+/* Opens the journal in the output directory. When resuming, the records of the previous run
+ * are loaded first and new records get appended, otherwise a new journal is started.
+ * Records are text lines: F <size> <mtime> <file> for finished files and
+ *                         P <offset> <mtime> <file> for the written part of unfinished ones
+ */
+JOURNAL *journal_open(const char *outdir, int resume)
+{
+	JOURNAL *j;
+	JOURNAL_ENTRY *ent;
+	FILE *fp;
+	char path[PATH_MAX], line[PATH_MAX + 64], type;
+	long long size, mtime;
+	int i, k, max = 0, pos;
+
+	if (!(j = calloc(1, sizeof(JOURNAL)))) return NULL;
+	j->root = outdir;
+	snprintf(path, sizeof(path), "%s/%s", outdir, JOURNAL_NAME);
+	if (resume && (fp = fopen(path, "r")))
+	{
+		while (fgets(line, sizeof(line), fp))
+		{
+			line[strcspn(line, "\r\n")] = 0;
+			if (sscanf(line, "%c %lld %lld %n", &type, &size, &mtime, &pos) < 3 || (type != 'F' && type != 'P') || !line[pos])
+				continue;
+			if (j->count == max)
+			{
+				max = max ? max * 2 : 256;
+				if (!(ent = realloc(j->ent, max * sizeof(JOURNAL_ENTRY)))) break;
+				j->ent = ent;
+			}
+			ent = &j->ent[j->count];
+			if (!(ent->file = strdup(line + pos))) break;
+			ent->complete = type == 'F';
+			ent->size = size;
+			ent->mtime = mtime;
+			ent->seq = j->count++;
+		}
+		fclose(fp);
+
+		/* Keep only the last record of every file */
+		qsort(j->ent, j->count, sizeof(JOURNAL_ENTRY), cmp_journal);
+		for (i=0, k=0; i<j->count; i++)
+		{
+			if (i+1 < j->count && strcmp(j->ent[i].file, j->ent[i+1].file) == 0)
+			{
+				free(j->ent[i].file);
+				continue;
+			}
+			j->ent[k++] = j->ent[i];
+		}
+		j->count = k;
+		printf ("Resuming extraction, %d files in journal\n", j->count);
+	}
+	if ((j->fd = open(path, O_WRONLY|O_CREAT|O_APPEND|O_BINARY|(resume?0:O_TRUNC), 0666)) == -1)
+		fprintf (stderr, "Warning: Cannot create journal %s: %s\n", path, strerror(errno));
+	return j;
+}
+
+void journal_close(JOURNAL *j)
+{
+	int i;
+
+	if (!j) return;
+	if (j->fd != -1) close(j->fd);
+	for (i=0; i<j->count; i++) free(j->ent[i].file);
+	free(j->ent);
+	free(j);
+}
+
+/* Path of output file as it is recorded in the journal */
+const char *journal_file(JOURNAL *j, const char *outfile)
+{
+	size_t len = strlen(j->root);
+
+	return strncmp(outfile, j->root, len) == 0 && outfile[len] == '/' ? outfile + len + 1 : outfile;
+}
+
+JOURNAL_ENTRY *journal_find(JOURNAL *j, const char *outfile)
+{
+	JOURNAL_ENTRY key;
+	int lo = 0, hi = j->count - 1, mid, r;
+
+	key.file = (char*)journal_file(j, outfile);
+	while (lo <= hi)
+	{
+		mid = (lo + hi) / 2;
+		if (!(r = strcmp(key.file, j->ent[mid].file))) return &j->ent[mid];
+		if (r < 0) hi = mid - 1; else lo = mid + 1;
+	}
+	return NULL;
+}
+
+void journal_write(JOURNAL *j, char type, off64_t size, time_t mtime, const char *outfile)
+{
+	char line[PATH_MAX + 64];
+	int len;
+
+	if (j->fd == -1) return;
+	len = snprintf(line, sizeof(line), "%c %lld %lld %s\n", type, (long long)size, (long long)mtime, journal_file(j, outfile));
+	if (len > 0 && len < sizeof(line) && write(j->fd, line, len) != len)
+		fprintf (stderr, "Warning: Cannot write journal: %s\n", strerror(errno));
+}
+
+void pool_progress(EXTPOOL *pool, int r)
+{
+	time_t now;
+
+	pthread_mutex_lock(&pool->mtx);
+	pool->written += r;
+	if ((now = time(NULL)) != pool->last_progress)
+	{
+		pool->last_progress = now;
+		printf("\rExtracting file %d/%d [%03d%%]", pool->done, pool->files, 
+			pool->total?(int)((double)pool->written/(double)pool->total*100):100);
+		fflush(stdout);
+	}
+	pthread_mutex_unlock(&pool->mtx);
+}
+
+/* Checks if a buffer is all zeros. Comparing it with itself shifted by 16 bytes lets the
+ * vectorized memcmp() of the C library do the work.
+ */
+int is_zero(const char *buf, size_t len)
+{
+	static const char zero[16];
+
+	if (len <= sizeof(zero)) return memcmp(buf, zero, len) == 0;
+	return memcmp(buf, zero, sizeof(zero)) == 0 && memcmp(buf, buf + sizeof(zero), len - sizeof(zero)) == 0;
+}
+
+/* Reserves the whole file up front, so that it doesn't get fragmented by the chunked writes */
+void prealloc_file(EXTFILE *f)
+{
+#ifdef __linux__
+	if (f->size > 0 && fallocate64(f->fdf, 0, 0, f->size) == 0) f->prealloc = 1;
+#endif
+}
+
+/* Zeros aren't written, they are left as a hole in the file */
+void skip_zero(EXTFILE *f, off64_t offset, off64_t len)
+{
+#if defined(__linux__) && defined(FALLOC_FL_PUNCH_HOLE)
+	/* Preallocated space reads as zeros anyway, giving it back is just nice to have */
+	if (f->prealloc) fallocate64(f->fdf, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE, offset, len);
+#endif
+}
+
+/* End of the ZERO_BLOCK of the file that contains position pos of the chunk */
+off64_t zero_block_end(EXTENT *chunk, off64_t pos)
+{
+	off64_t end = (chunk->dst + pos) / ZERO_BLOCK * ZERO_BLOCK + ZERO_BLOCK - chunk->dst;
+
+	return end < chunk->len ? end : chunk->len;
+}
+
+/* Finds the next part of a chunk buffer that has to be written, starting at *pos.
+ * Blocks of zeros in front of it are skipped. Returns its length, 0 if only zeros are left.
+ */
+off64_t next_data(EXTFILE *f, EXTENT *chunk, const char *buf, off64_t *pos)
+{
+	off64_t start, end;
+
+	for (start = *pos; start < chunk->len && is_zero(buf + start, (end = zero_block_end(chunk, start)) - start); start = end);
+	if (start > *pos) skip_zero(f, chunk->dst + *pos, start - *pos);
+	*pos = start;
+	if (start >= chunk->len) return 0;
+	for (end = zero_block_end(chunk, start); end < chunk->len && !is_zero(buf + end, zero_block_end(chunk, end) - end);
+		end = zero_block_end(chunk, end));
+	return end - start;
+}
+
+/* Called for every written chunk, all of the file below offset synced is written by now */
+void copy_progress(EXTRINST *pInst, EXTFILE *f, EXTENT *chunk, off64_t synced)
+{
+	f->written += chunk->len;
+	if (pInst->pool) pool_progress(pInst->pool, chunk->len);
+	else
+	{
+		printf("\rCopying block %08llX [%03d%%]", (chunk->src - pInst->start) / ASIZE, 
+			(int)((double)f->written/(double)f->size*100));
+		fflush(stdout);
+	}
+	if (pInst->journal && synced - f->synced >= JOURNAL_STEP && fdatasync(f->fdf) == 0)
+	{
+		journal_write(pInst->journal, 'P', synced, f->mtime, f->outfile);
+		f->synced = synced;
+	}
+}
+
+/* Translates the block runs of an inode into extents of the image, adjacent runs are merged */
+int build_extents(EXTRINST *pInst, inode *inode, EXTENT *ext, off64_t fsize)
+{
+	const block_run *run;
+	off64_t src, dst, len;
+	uint32 factor = inode_factor(inode);
+	int j, n;
+
+	for(j = 0, n = 0, dst = 0, run = inode->runs; j < INODE_RUNS && block_run_start(run) && dst < fsize; j++, run++)
+	{
+		if (!(len = (off64_t)block_run_len(run) * factor * BSIZE / 4)) continue;
+		if (len > fsize - dst) len = fsize - dst;
+		src = pInst->start + (off64_t)block_run_start(run) * ASIZE + (off64_t)block_run_offset(run) * BCNT * 4;
+		if (n && ext[n-1].src + ext[n-1].len == src) ext[n-1].len += len;
+		else
+		{
+			ext[n].src = src;
+			ext[n].dst = dst;
+			ext[n++].len = len;
+		}
+		dst += len;
+	}
+	return n;
+}
+
+/* Splits extents into requests of at most IO_CHUNK bytes */
+int next_chunk(CHUNKER *ck, EXTENT *chunk)
+{
+	if (ck->cur >= ck->n) return 0;
+	chunk->src = ck->ext[ck->cur].src + ck->pos;
+	chunk->dst = ck->ext[ck->cur].dst + ck->pos;
+	if ((chunk->len = ck->ext[ck->cur].len - ck->pos) > IO_CHUNK) chunk->len = IO_CHUNK;
+	if ((ck->pos += chunk->len) >= ck->ext[ck->cur].len)
+	{
+		ck->cur++;
+		ck->pos = 0;
+	}
+	return 1;
+}
+
+/* Output offset of the next chunk, or end of the extents if there are no more */
+off64_t chunk_offset(CHUNKER *ck)
+{
+	if (ck->cur < ck->n) return ck->ext[ck->cur].dst + ck->pos;
+	return ck->n ? ck->ext[ck->n-1].dst + ck->ext[ck->n-1].len : 0;
+}
+
+#ifdef HAVE_IO_URING
+typedef struct
+{
+	int fd;
+	unsigned *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ptr, *cq_ptr;
+	size_t sq_sz, cq_sz, sqes_sz;
+} URING;
+
+void uring_exit(URING *u)
+{
+	munmap(u->sqes, u->sqes_sz);
+	if (u->cq_ptr != u->sq_ptr) munmap(u->cq_ptr, u->cq_sz);
+	munmap(u->sq_ptr, u->sq_sz);
+	close(u->fd);
+}
+
+int uring_init(URING *u, unsigned entries)
+{
+	struct io_uring_params p;
+
+	memset(&p, 0, sizeof(p));
+	memset(u, 0, sizeof(*u));
+	if ((u->fd = syscall(__NR_io_uring_setup, entries, &p)) < 0) return -1;
+	u->sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	u->cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		if (u->cq_sz > u->sq_sz) u->sq_sz = u->cq_sz;
+		u->cq_sz = u->sq_sz;
+	}
+	u->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+	u->sq_ptr = mmap(NULL, u->sq_sz, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	if (u->sq_ptr == MAP_FAILED)
+	{
+		close(u->fd);
+		return -1;
+	}
+	u->cq_ptr = (p.features & IORING_FEAT_SINGLE_MMAP) ? u->sq_ptr :
+		mmap(NULL, u->cq_sz, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+	if (u->cq_ptr == MAP_FAILED)
+	{
+		munmap(u->sq_ptr, u->sq_sz);
+		close(u->fd);
+		return -1;
+	}
+	u->sqes = mmap(NULL, u->sqes_sz, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, u->fd, IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED)
+	{
+		if (u->cq_ptr != u->sq_ptr) munmap(u->cq_ptr, u->cq_sz);
+		munmap(u->sq_ptr, u->sq_sz);
+		close(u->fd);
+		return -1;
+	}
+	u->sq_tail = (unsigned*)((char*)u->sq_ptr + p.sq_off.tail);
+	u->sq_mask = (unsigned*)((char*)u->sq_ptr + p.sq_off.ring_mask);
+	u->sq_array = (unsigned*)((char*)u->sq_ptr + p.sq_off.array);
+	u->cq_head = (unsigned*)((char*)u->cq_ptr + p.cq_off.head);
+	u->cq_tail = (unsigned*)((char*)u->cq_ptr + p.cq_off.tail);
+	u->cq_mask = (unsigned*)((char*)u->cq_ptr + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe*)((char*)u->cq_ptr + p.cq_off.cqes);
+	return 0;
+}
+
+void uring_prep(URING *u, int opcode, int fd, struct iovec *iov, off64_t offset, int idx, int fixed)
+{
+	unsigned tail = *u->sq_tail, i = tail & *u->sq_mask;
+	struct io_uring_sqe *sqe = &u->sqes[i];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = opcode;
+	sqe->fd = fd;
+	sqe->off = offset;
+	sqe->user_data = idx;
+	if (fixed)
+	{
+		/* READ_FIXED / WRITE_FIXED take the buffer directly, it has to be within the registered one */
+		sqe->addr = (unsigned long)iov->iov_base;
+		sqe->len = iov->iov_len;
+		sqe->buf_index = idx;
+	}
+	else
+	{
+		sqe->addr = (unsigned long)iov;
+		sqe->len = 1;
+	}
+	u->sq_array[i] = i;
+	__atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+#define SLOT_FREE	0
+#define SLOT_READ	1
+#define SLOT_WRITE	2
+
+/* Keeps up to IO_DEPTH reads and writes in flight. Returns 1 if io_uring is not usable. */
+int copy_uring(EXTRINST *pInst, EXTFILE *f, EXTENT *ext, int n)
+{
+	URING u;
+	struct
+	{
+		EXTENT chunk;
+		off64_t done;	// Bytes of current read or write that are finished
+		off64_t end;	// End of the data currently written
+		int state;
+		struct iovec iov;
+	} slot[IO_DEPTH];
+	struct iovec reg[IO_DEPTH];
+	CHUNKER ck = {ext, n, 0, 0};
+	char *buffers;
+	int i, k, fixed, more = 1, pending = 0, inflight = 0, ret = 0;
+	off64_t synced, len;
+
+	if (uring_init(&u, IO_DEPTH * 2) < 0) return 1;
+	if (!(buffers = malloc(IO_DEPTH * IO_CHUNK)))
+	{
+		uring_exit(&u);
+		return 1;
+	}
+	for (i=0; i<IO_DEPTH; i++)
+	{
+		reg[i].iov_base = buffers + i * IO_CHUNK;
+		reg[i].iov_len = IO_CHUNK;
+		slot[i].state = SLOT_FREE;
+	}
+	/* Registering fails if RLIMIT_MEMLOCK is too low, then just use normal vectored I/O */
+	fixed = syscall(__NR_io_uring_register, u.fd, IORING_REGISTER_BUFFERS, reg, IO_DEPTH) == 0;
+
+	while (inflight || (more && !ret))
+	{
+		struct io_uring_cqe *cqe;
+		unsigned head;
+
+		for (i=0; i<IO_DEPTH && more && !ret; i++)
+		{
+			if (slot[i].state != SLOT_FREE) continue;
+			if (!(more = next_chunk(&ck, &slot[i].chunk))) break;
+			slot[i].state = SLOT_READ;
+			slot[i].done = 0;
+			slot[i].iov.iov_base = reg[i].iov_base;
+			slot[i].iov.iov_len = slot[i].chunk.len;
+			uring_prep(&u, fixed?IORING_OP_READ_FIXED:IORING_OP_READV, pInst->fdd, &slot[i].iov, slot[i].chunk.src, i, fixed);
+			pending++;
+			inflight++;
+		}
+		if (!inflight) break;
+		if (syscall(__NR_io_uring_enter, u.fd, pending, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0)
+		{
+			if (errno == EINTR) continue;
+			/* Nothing can be reaped anymore, so in-flight buffers must not be freed */
+			fprintf(stderr, "io_uring failure while copying %s: %s\n", f->outfile, strerror(errno));
+			uring_exit(&u);
+			return -1;
+		}
+		pending = 0;
+
+		for (head = *u.cq_head; head != __atomic_load_n(u.cq_tail, __ATOMIC_ACQUIRE); head++)
+		{
+			cqe = &u.cqes[head & *u.cq_mask];
+			i = cqe->user_data;
+			inflight--;
+			if (cqe->res <= 0)
+			{
+				if (slot[i].state == SLOT_READ)
+					fprintf(stderr, "Error reading image @%10llX for %s: %s\n", slot[i].chunk.src + slot[i].done, 
+						f->outfile, cqe->res?strerror(-cqe->res):"Unexpected end of file");
+				else
+					fprintf(stderr, "Error writing file %s: %s\n", f->outfile, strerror(-cqe->res));
+				slot[i].state = SLOT_FREE;
+				ret = -1;
+				continue;
+			}
+			if ((slot[i].done += cqe->res) == slot[i].chunk.len && slot[i].state == SLOT_READ)
+			{
+				slot[i].state = SLOT_WRITE;
+				slot[i].done = slot[i].end = 0;
+			}
+			if (ret)
+			{
+				slot[i].state = SLOT_FREE;
+				continue;
+			}
+			if (slot[i].state == SLOT_WRITE && slot[i].done == slot[i].end)
+			{
+				if (!(len = next_data(f, &slot[i].chunk, reg[i].iov_base, &slot[i].done)))
+				{
+					/* Writes complete out of order, everything below the oldest chunk in flight is written */
+					slot[i].state = SLOT_FREE;
+					for (k=0, synced=chunk_offset(&ck); k<IO_DEPTH; k++)
+						if (slot[k].state != SLOT_FREE && slot[k].chunk.dst < synced) synced = slot[k].chunk.dst;
+					copy_progress(pInst, f, &slot[i].chunk, synced);
+					continue;
+				}
+				slot[i].end = slot[i].done + len;
+			}
+			/* Start write of next data in completed read or continue a short read/write */
+			slot[i].iov.iov_base = (char*)reg[i].iov_base + slot[i].done;
+			slot[i].iov.iov_len = (slot[i].state == SLOT_READ ? slot[i].chunk.len : slot[i].end) - slot[i].done;
+			if (slot[i].state == SLOT_READ)
+				uring_prep(&u, fixed?IORING_OP_READ_FIXED:IORING_OP_READV, pInst->fdd, &slot[i].iov, 
+					slot[i].chunk.src + slot[i].done, i, fixed);
+			else
+				uring_prep(&u, fixed?IORING_OP_WRITE_FIXED:IORING_OP_WRITEV, f->fdf, &slot[i].iov, 
+					slot[i].chunk.dst + slot[i].done, i, fixed);
+			pending++;
+			inflight++;
+		}
+		__atomic_store_n(u.cq_head, head, __ATOMIC_RELEASE);
+	}
+	uring_exit(&u);
+	free(buffers);
+	return ret;
+}
+#endif
+
+typedef struct
+{
+	EXTRINST *pInst;
+	pthread_mutex_t mtx;
+	pthread_cond_t cond;
+	CHUNKER ck;
+	char *buffers;
+	size_t stride;	// Distance between buffers
+	EXTENT chunk[IO_DEPTH];
+	off64_t skip[IO_DEPTH];	// Start of chunk data within buffer
+	int nbuf, head, count;	// Ring of filled buffers, head is the oldest one
+	int eof, error, abort;
+	char *outfile;
+} IOQUEUE;
+
+/* Reads a chunk into buf, *skip is set to the offset of the chunk data in buf */
+int read_chunk(EXTRINST *pInst, char *buf, EXTENT *chunk, off64_t *skip, const char *outfile)
+{
+	off64_t start = chunk->src, end = chunk->src + chunk->len, done, bad_pos, bad_len;
+	int fd = pInst->fdd;
+	ssize_t r;
+
+	if (map_bad(pInst->map, start, chunk->len, &bad_pos, &bad_len))
+	{
+		/* Bad areas are zero-filled without touching the device, the rest is read as usual */
+		for (*skip = 0; start < end; start += done)
+		{
+			if (start == bad_pos)
+			{
+				memset(buf + (start - chunk->src), 0, (done = bad_len));
+				if (!map_bad(pInst->map, start + done, end - start - done, &bad_pos, &bad_len)) bad_pos = end;
+				continue;
+			}
+			for (done = 0; done < bad_pos - start; done += r)
+			{
+				if ((r = pread64(pInst->fdd, buf + (start - chunk->src) + done, bad_pos - start - done, start + done)) <= 0)
+				{
+					fprintf(stderr, "Error reading image @%10llX for %s: %s\n", start + done, outfile, 
+						r?strerror(errno):"Unexpected end of file");
+					return -1;
+				}
+			}
+		}
+		return 0;
+	}
+	if (pInst->direct)
+	{
+		/* The aligned request covering the chunk is read, a short read can only happen at the end of the image */
+		fd = pInst->fdr;
+		start = start / pInst->align * pInst->align;
+		end = (end + pInst->align - 1) / pInst->align * pInst->align;
+	}
+	*skip = chunk->src - start;
+	for (done = 0; start + done < chunk->src + chunk->len; done += r)
+	{
+		if ((r = pread64(fd, buf + done, end - start - done, start + done)) <= 0)
+		{
+			fprintf(stderr, "Error reading image @%10llX for %s: %s\n", start + done, outfile, 
+				r?strerror(errno):"Unexpected end of file");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+void *io_reader(void *arg)
+{
+	IOQUEUE *q = arg;
+	EXTENT chunk;
+	int tail = 0, error = 0, abort;
+
+	while (!error && next_chunk(&q->ck, &chunk))
+	{
+		pthread_mutex_lock(&q->mtx);
+		while (q->count == q->nbuf && !q->abort) pthread_cond_wait(&q->cond, &q->mtx);
+		abort = q->abort;
+		pthread_mutex_unlock(&q->mtx);
+		if (abort) break;
+
+		if ((error = read_chunk(q->pInst, q->buffers + tail * q->stride, &chunk, &q->skip[tail], q->outfile) < 0)) break;
+
+		pthread_mutex_lock(&q->mtx);
+		q->chunk[tail] = chunk;
+		q->count++;
+		pthread_cond_signal(&q->cond);
+		pthread_mutex_unlock(&q->mtx);
+		tail = (tail + 1) % q->nbuf;
+	}
+	pthread_mutex_lock(&q->mtx);
+	q->error = error;
+	q->eof = 1;
+	pthread_cond_signal(&q->cond);
+	pthread_mutex_unlock(&q->mtx);
+	return NULL;
+}
+
+#ifdef O_DIRECT
+/* Opens the image a second time for reading file data past the page cache. Requests are
+ * aligned to the physical block size of the device, or at least to its logical one.
+ */
+int open_direct(EXTRINST *pInst)
+{
+	int lbs = 0;
+	unsigned int pbs = 0;
+	struct stat st;
+
+	if ((pInst->fdr = open(pInst->image, O_RDONLY|O_LARGEFILE|O_BINARY|O_DIRECT)) == -1) return -1;
+#ifdef BLKSSZGET
+	if (ioctl(pInst->fdr, BLKSSZGET, &lbs) < 0) lbs = 0;
+#endif
+#ifdef BLKPBSZGET
+	if (ioctl(pInst->fdr, BLKPBSZGET, &pbs) < 0) pbs = 0;
+#endif
+	/* Image files need to be aligned to the block size of the filesystem they are on */
+	if (lbs <= 0) lbs = fstat(pInst->fdr, &st) == 0 && st.st_blksize > 0 ? st.st_blksize : 4096;
+	pInst->align = pbs > lbs && pbs <= DIRECT_ALIGN_MAX ? pbs : lbs;
+	if (pInst->align > DIRECT_ALIGN_MAX || (pInst->align & (pInst->align - 1)))
+	{
+		close(pInst->fdr);
+		errno = EINVAL;
+		return -1;
+	}
+	printf ("Reading file data with O_DIRECT, block size %d/%u\n", lbs, pbs?pbs:lbs);
+	return 0;
+}
+
+/* Starts writeback of the output written since the last call and waits for the part before,
+ * so that the written data doesn't pile up in the page cache either.
+ */
+void write_behind(EXTFILE *f, off64_t end)
+{
+#ifdef SYNC_FILE_RANGE_WRITE
+	if (end - f->wb_start < WB_WINDOW) return;
+	if (f->wb_start > f->wb_done)
+	{
+		sync_file_range(f->fdf, f->wb_done, f->wb_start - f->wb_done, 
+			SYNC_FILE_RANGE_WAIT_BEFORE|SYNC_FILE_RANGE_WRITE|SYNC_FILE_RANGE_WAIT_AFTER);
+		posix_fadvise64(f->fdf, f->wb_done, f->wb_start - f->wb_done, POSIX_FADV_DONTNEED);
+	}
+	sync_file_range(f->fdf, f->wb_start, end - f->wb_start, SYNC_FILE_RANGE_WRITE);
+	f->wb_done = f->wb_start;
+	f->wb_start = end;
+#endif
+}
+#endif
+
+/* Portable pipeline: a reader thread fills a bounded queue of buffers, the calling thread writes them out */
+int copy_threaded(EXTRINST *pInst, EXTFILE *f, EXTENT *ext, int n, int chunks)
+{
+	IOQUEUE q = {0};
+	pthread_t reader;
+	EXTENT *chunk;
+	char *buf;
+	off64_t pos, len, done;
+	ssize_t r;
+	size_t need = IO_CHUNK;
+	int i, ret = 0, threaded = 0;
+
+	q.pInst = pInst;
+	q.outfile = f->outfile;
+	q.ck.ext = ext;
+	q.ck.n = n;
+	q.nbuf = chunks < IO_DEPTH ? chunks : IO_DEPTH;
+	q.stride = IO_CHUNK;
+#ifdef O_DIRECT
+	if (pInst->direct)
+	{
+		/* Room for alignment at both ends of a chunk */
+		q.stride = IO_CHUNK + 2 * pInst->align;
+		if (!pInst->dbuf && posix_memalign((void**)&pInst->dbuf, pInst->align, IO_DEPTH * q.stride)) pInst->dbuf = NULL;
+		q.buffers = pInst->dbuf;
+	}
+	else
+#endif
+	{
+		/* A single chunk is all the data of the extents, which may be less than IO_CHUNK */
+		if (chunks == 1) for (i=0, need=0; i<n; i++) need += ext[i].len;
+		q.buffers = malloc(q.nbuf * need);
+	}
+	if (!q.buffers)
+	{
+		fprintf(stderr, "Out of memory copying %s\n", f->outfile);
+		return -1;
+	}
+	pthread_mutex_init(&q.mtx, NULL);
+	pthread_cond_init(&q.cond, NULL);
+
+	/* A single chunk fits the queue, so there is no need for an extra thread */
+	if (chunks == 1) io_reader(&q);
+	else if (!(threaded = !pthread_create(&reader, NULL, io_reader, &q)))
+	{
+		fprintf(stderr, "Cannot create reader thread for %s\n", f->outfile);
+		ret = -1;
+		q.eof = 1;
+	}
+
+	while (!ret)
+	{
+		pthread_mutex_lock(&q.mtx);
+		while (!q.count && !q.eof) pthread_cond_wait(&q.cond, &q.mtx);
+		pthread_mutex_unlock(&q.mtx);
+		if (!q.count) break;
+
+		chunk = &q.chunk[q.head];
+		buf = q.buffers + q.head * q.stride + q.skip[q.head];
+		for (pos = 0; !ret && (len = next_data(f, chunk, buf, &pos)); pos += len)
+		{
+			for (done = 0; done < len; done += r)
+			{
+				if ((r = pwrite64(f->fdf, buf + pos + done, len - done, chunk->dst + pos + done)) <= 0)
+				{
+					fprintf(stderr, "Error writing file %s: %s\n", f->outfile, strerror(errno));
+					ret = -1;
+					break;
+				}
+			}
+		}
+		if (!ret) copy_progress(pInst, f, chunk, chunk->dst + chunk->len);
+#ifdef O_DIRECT
+		if (!ret && pInst->direct) write_behind(f, chunk->dst + chunk->len);
+#endif
+
+		pthread_mutex_lock(&q.mtx);
+		q.head = (q.head + 1) % q.nbuf;
+		q.count--;
+		if (ret) q.abort = 1;
+		pthread_cond_signal(&q.cond);
+		pthread_mutex_unlock(&q.mtx);
+	}
+	if (threaded) pthread_join(reader, NULL);
+	if (q.error) ret = -1;
+	pthread_cond_destroy(&q.cond);
+	pthread_mutex_destroy(&q.mtx);
+	if (q.buffers != pInst->dbuf) free(q.buffers);
+	return ret;
+}
+
+#if defined(__linux__) && defined(__NR_copy_file_range)
+/* Copies extents inside the kernel, sharing the blocks via reflink where source and destination
+   are aligned to the filesystem block size. Returns 1 if the filesystem can't do it, then the
+   extents starting at *done are adjusted to the part that still needs to be copied. */
+int copy_zerocopy(EXTRINST *pInst, EXTFILE *f, EXTENT *ext, int n, int *done)
+{
+	struct stat st;
+	EXTENT chunk;
+	off64_t bs;
+	loff_t src, dst;
+	ssize_t r;
+	int i;
+
+	if (fstat(f->fdf, &st) < 0 || st.st_blksize <= 0) bs = 4096; else bs = st.st_blksize;
+	for (i=0, *done=0; i<n; i++, *done=i)
+	{
+#ifdef FICLONERANGE
+		if (!pInst->no_reflink && ext[i].src % bs == 0 && ext[i].dst % bs == 0 && ext[i].len >= bs)
+		{
+			struct file_clone_range fcr;
+
+			fcr.src_fd = pInst->fdd;
+			fcr.src_offset = ext[i].src;
+			fcr.src_length = ext[i].len / bs * bs;
+			fcr.dest_offset = ext[i].dst;
+			if (ioctl(f->fdf, FICLONERANGE, &fcr) == 0)
+			{
+				chunk = ext[i];
+				chunk.len = fcr.src_length;
+				copy_progress(pInst, f, &chunk, chunk.dst + chunk.len);
+				ext[i].src += chunk.len;
+				ext[i].dst += chunk.len;
+				ext[i].len -= chunk.len;
+			}
+			else pInst->no_reflink = 1;
+		}
+#endif
+		for (src = ext[i].src, dst = ext[i].dst; ext[i].len > 0; )
+		{
+			if ((r = syscall(__NR_copy_file_range, pInst->fdd, &src, f->fdf, &dst, 
+				ext[i].len > ZC_CHUNK ? ZC_CHUNK : ext[i].len, 0)) <= 0)
+			{
+				if (r < 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP))
+				{
+					pInst->no_zerocopy = 1;
+					return 1;
+				}
+				fprintf(stderr, "Error copying image @%10llX to %s: %s\n", ext[i].src, f->outfile, 
+					r?strerror(errno):"Unexpected end of file");
+				return -1;
+			}
+			chunk = ext[i];
+			chunk.len = r;
+			copy_progress(pInst, f, &chunk, chunk.dst + chunk.len);
+			ext[i].src += r;
+			ext[i].dst += r;
+			ext[i].len -= r;
+		}
+	}
+	return 0;
+}
 #endif
 
-typedef struct
+int copy_extents(EXTRINST *pInst, EXTFILE *f, EXTENT *ext, int n)
 {
-	int fdd;		// File descriptor of disk file
-	off64_t start;	// Start address within file
-	int ver;		// Filesystem version
-} EXTRINST;
+	int i, chunks, bad;
 
-#define FILETIME(tim) (tim + (pInst->ver<3?TIME_OFFSET:0))
+	/* Only the reader thread knows how to skip bad areas */
+	for (i=0, bad=0; i<n && !bad; i++) bad = map_bad(pInst->map, ext[i].src, ext[i].len, NULL, NULL);
 
-int search_hdr(EXTRINST *pInst)
+#if defined(__linux__) && defined(__NR_copy_file_range)
+	if (!pInst->no_zerocopy && !pInst->direct && !bad)
+	{
+		int ret = copy_zerocopy(pInst, f, ext, n, &i);
+
+		/* Continue with buffered copy where the kernel gave up */
+		if (ret <= 0) return ret;
+		ext += i;
+		n -= i;
+	}
+#endif
+	for (i=0, chunks=0; i<n; i++) chunks += (ext[i].len + IO_CHUNK - 1) / IO_CHUNK;
+	if (!chunks) return 0;
+#ifdef HAVE_IO_URING
+	if (chunks > 1 && !pInst->no_uring && !pInst->direct && !bad)
+	{
+		int ret = copy_uring(pInst, f, ext, n);
+
+		if (ret <= 0) return ret;
+	}
+#endif
+	return copy_threaded(pInst, f, ext, n, chunks);
+}
+
+/* Drops the part of the extents in front of the given output offset */
+int skip_extents(EXTENT *ext, int n, off64_t offset)
 {
-	char buffer[512];
+	int i, k;
+	off64_t skip;
 
-	for (; lseek64(pInst->fdd, pInst->start, SEEK_SET)!=(off64_t)-1; pInst->start+=0x10000)
+	for (i=0, k=0; i<n; i++)
 	{
-		if(read(pInst->fdd, buffer, sizeof(buffer))!=sizeof(buffer))
+		if (ext[i].dst + ext[i].len <= offset) continue;
+		ext[k] = ext[i];
+		if ((skip = offset - ext[k].dst) > 0)
 		{
-			fprintf(stderr, "Read error @%10llX: %s\n", pInst->start, strerror(errno));
-			return -1;
+			ext[k].src += skip;
+			ext[k].dst += skip;
+			ext[k].len -= skip;
 		}
-		printf ("\rSearching MEIHDFS header...%10llX", pInst->start);
-		fflush(stdout);
-		if(memcmp(buffer+8, "MEIHDFS-V2.", 11) == 0 || memcmp(buffer+8, "HDFS2.", 6) == 0)
+		k++;
+	}
+	return k;
+}
+
+/* Writes the byte ranges of the output file that come from bad areas of the image to <file>.bad */
+void bad_report(EXTRINST *pInst, EXTFILE *f, EXTENT *ext, int n)
+{
+	char report[PATH_MAX];
+	FILE *fp = NULL;
+	off64_t pos, bad_pos, bad_len, total = 0;
+	int i;
+
+	snprintf(report, sizeof(report), "%s.bad", f->outfile);
+	for (i=0; i<n; i++)
+	{
+		for (pos = ext[i].src; map_bad(pInst->map, pos, ext[i].src + ext[i].len - pos, &bad_pos, &bad_len); pos = bad_pos + bad_len)
 		{
-			printf (" FOUND!\n");
-			return (pInst->ver = buffer[8]=='M'?buffer[19]-'0':buffer[14]-'0');
+			if (!fp)
+			{
+				if (!(fp = fopen(report, "w")))
+				{
+					fprintf(stderr, "Cannot create bad area report %s: %s\n", report, strerror(errno));
+					return;
+				}
+				fprintf(fp, "# Parts of %s read from bad areas of the image, they are zero-filled\n", f->outfile);
+				fprintf(fp, "#     pos        size  image_pos\n");
+			}
+			fprintf(fp, "0x%08llX  0x%08llX  0x%010llX\n", ext[i].dst + (bad_pos - ext[i].src), bad_len, bad_pos);
+			total += bad_len;
 		}
 	}
-	fprintf(stderr, "\nHeader could not be found!\n");
-	return -2;
+	if (fp)
+	{
+		fclose(fp);
+		fprintf(stderr, "%s%s: %lld bytes from bad areas of the image, see %s\n", pInst->pool?"\r":"\n", f->outfile, total, report);
+	}
+	else if (pInst->map) unlink(report);
 }
 
-int list_file(EXTRINST *pInst, inode *inode, char *outfile)
+/* Size of an existing file or -1, stat() fails on big files in 32bit builds */
+off64_t file_size(const char *file)
 {
-	time_t ttime;
-	struct tm *btime;
-	off64_t fsize;
+	int fd;
+	off64_t size;
 
-	ttime = FILETIME(inode->time1);
-	btime = gmtime(&ttime);
-	fsize = ((off64_t)inode->hsize << 32) + inode->size;	// Or are the higher bits of size elsewhere?
-	printf("%4i-%02i-%02i %02i:%02i:%02i %20lld %s\n", btime->tm_year + 1900, 
-		btime->tm_mon+1, btime->tm_mday, btime->tm_hour, 
-		btime->tm_min, btime->tm_sec, fsize, outfile);
+	if ((fd = open(file, O_RDONLY|O_BINARY|O_LARGEFILE)) == -1) return -1;
+	size = lseek64(fd, 0, SEEK_END);
+	close(fd);
+	return size;
 }
 
 int dump_file(EXTRINST *pInst, inode *inode, char *outfile)
 {
-	int fdf;
+	int n, ret;
 	time_t ttime;
 	struct tm *btime;
-	off64_t fsize, origfsize, written;
-	int r, j, size;
-	char buffer[ASIZE];
+	EXTFILE f = {-1};
+	EXTENT ext[INODE_RUNS];
+	JOURNAL_ENTRY *je = NULL;
+	off64_t resume = 0, size;
 
-	if ((fdf = open(outfile, O_WRONLY|O_CREAT|O_TRUNC|O_BINARY|O_LARGEFILE, 0666)) == -1)
+	ttime = FILETIME(inode_time1(inode));
+	f.outfile = outfile;
+	f.mtime = ttime;
+	f.size = inode_fsize(inode);
+
+	/* Previously extracted file is only trusted if it still is at least as big as recorded */
+	if (pInst->journal && (je = journal_find(pInst->journal, outfile)) && je->mtime == ttime && 
+		(size = file_size(outfile)) >= 0)
+	{
+		if (je->complete && je->size == f.size && size == f.size)
+		{
+			if (pInst->pool) pthread_mutex_lock(&pInst->pool->mtx);
+			printf("%sSkipping %s, already extracted\n", pInst->pool?"\r":"", outfile);
+			if (pInst->pool)
+			{
+				pInst->pool->written += f.size;
+				pthread_mutex_unlock(&pInst->pool->mtx);
+			}
+			return 0;
+		}
+		if (!je->complete && je->size < f.size && je->size <= size) resume = je->size;
+	}
+
+	if ((f.fdf = open(outfile, O_WRONLY|O_CREAT|O_BINARY|O_LARGEFILE|(resume?0:O_TRUNC), 0666)) == -1)
 	{
 		fprintf (stderr, "Cannot create file %s: %s\n", outfile, strerror(errno));
 		return -1;
 	}
 	
-	ttime = FILETIME(inode->time1);
+	if (pInst->pool) pthread_mutex_lock(&pInst->pool->mtx);
 	btime = gmtime(&ttime);
-	fsize = origfsize = ((off64_t)inode->hsize << 32) + inode->size;	// Or are the higher bits of size elsewhere?
-	printf("%4i-%02i-%02i %02i:%02i:%02i %6lld%s %s\n", btime->tm_year + 1900, 
+	printf("%s%4i-%02i-%02i %02i:%02i:%02i %6lld%s %s\n", pInst->pool?"\r":"", btime->tm_year + 1900, 
 		btime->tm_mon+1, btime->tm_mday, btime->tm_hour, 
-		btime->tm_min, btime->tm_sec, fsize<1024?fsize:(fsize<1024*1024?fsize/1024:fsize/1024/1024),
-		fsize<1024?" ":(fsize<1024*1024?"k":"M"), outfile);
-	for(j = 0, written=0;j < INODE_RUNS && inode->runs[j].start; j++)
+		btime->tm_min, btime->tm_sec, f.size<1024?f.size:(f.size<1024*1024?f.size/1024:f.size/1024/1024),
+		f.size<1024?" ":(f.size<1024*1024?"k":"M"), outfile);
+	if (resume) printf("Resuming at offset %lld\n", resume);
+	if (pInst->pool)
+	{
+		pInst->pool->written += resume;
+		pthread_mutex_unlock(&pInst->pool->mtx);
+	}
+
+	n = build_extents(pInst, inode, ext, f.size);
+	bad_report(pInst, &f, ext, n);
+	if (resume)
+	{
+		/* Anything after the recorded offset may be incomplete, zero chunks aren't written again */
+		ftruncate64(f.fdf, resume);
+		n = skip_extents(ext, n, resume);
+		f.written = f.synced = resume;
+	}
+	prealloc_file(&f);
+	ret = copy_extents(pInst, &f, ext, n);
+	/* Zero chunks at the end of the file have been skipped */
+	if (ret == 0 && ftruncate64(f.fdf, f.size) < 0)
+	{
+		fprintf (stderr, "Cannot truncate file %s: %s\n", outfile, strerror(errno));
+		ret = -1;
+	}
+	if (pInst->journal && ret == 0 && fdatasync(f.fdf) == 0)
+		journal_write(pInst->journal, 'F', f.size, f.mtime, outfile);
+	close(f.fdf);
+	if (!pInst->pool) printf ("\r%-79s\r", " ");
+	return ret;
+}
+
+int queue_job(EXTPOOL *pool, int type, inode *inod, char *file, time_t mtime)
+{
+	EXTJOB *job;
+
+	if (pool->njobs == pool->maxjobs)
 	{
-		if (lseek64(pInst->fdd, pInst->start + (off64_t)inode->runs[j].start * ASIZE + (off64_t)inode->runs[j].offset * BCNT * 4, SEEK_SET) == (off64_t)-1)
+		int maxjobs = pool->maxjobs?pool->maxjobs*2:256;
+
+		if (!(job = realloc(pool->jobs, maxjobs * sizeof(EXTJOB))))
 		{
-			fprintf (stderr, "Seek error: %s\n", strerror(errno));
-			close(fdf);
+			fprintf (stderr, "Out of memory queueing %s\n", file);
 			return -1;
 		}
-		for (size = inode->runs[j].len * inode->factor; size>0 && fsize>0; size -= BCNT * 4, written+=r)
+		pool->jobs = job;
+		pool->maxjobs = maxjobs;
+	}
+	job = &pool->jobs[pool->njobs++];
+	job->type = type;
+	job->mtime = mtime;
+	job->size = 0;
+	if (type == TYPE_FILE)
+	{
+		job->inod = *inod;
+		job->size = inode_fsize(inod);
+		pool->total += job->size;
+		pool->files++;
+	}
+	strcpy(job->file, file);
+	return 0;
+}
+
+int cmp_job(const void *a, const void *b)
+{
+	const EXTJOB *ja = a, *jb = b;
+
+	/* Biggest files first, so that the largest recording doesn't end up running alone at the end */
+	if (ja->size != jb->size) return ja->size < jb->size ? 1 : -1;
+	return 0;
+}
+
+void *extract_worker(void *arg)
+{
+	EXTRINST inst = *(EXTRINST*)arg;
+	EXTPOOL *pool = inst.pool;
+	EXTJOB *job;
+	struct utimbuf utb={0};
+	int ret;
+
+	inst.dbuf = NULL;
+
+	if ((inst.fdd = open(inst.image, O_RDONLY|O_LARGEFILE|O_BINARY)) == -1)
+	{
+		fprintf(stderr, "Error opening image %s:%s\n", inst.image, strerror(errno));
+		pthread_mutex_lock(&pool->mtx);
+		pool->errors++;
+		pthread_mutex_unlock(&pool->mtx);
+		return NULL;
+	}
+	for (;;)
+	{
+		pthread_mutex_lock(&pool->mtx);
+		while (pool->next < pool->njobs && pool->jobs[pool->next].type != TYPE_FILE) pool->next++;
+		job = pool->next < pool->njobs ? &pool->jobs[pool->next++] : NULL;
+		pthread_mutex_unlock(&pool->mtx);
+		if (!job) break;
+
+		ret = dump_file(&inst, &job->inod, job->file);
+		utb.actime = utb.modtime = job->mtime;
+		utime(job->file, &utb);
+
+		pthread_mutex_lock(&pool->mtx);
+		pool->done++;
+		if (ret<0) pool->errors++;
+		pthread_mutex_unlock(&pool->mtx);
+	}
+	free(inst.dbuf);
+	close(inst.fdd);
+	return NULL;
+}
+
+int run_pool(EXTRINST *pInst)
+{
+	EXTPOOL *pool = pInst->pool;
+	pthread_t tid[MAX_THREADS];
+	struct utimbuf utb={0};
+	int i, started, threads = pInst->threads;
+
+	qsort(pool->jobs, pool->njobs, sizeof(EXTJOB), cmp_job);
+	if (threads > pool->files) threads = pool->files;
+
+	for (i=0, started=0; i<threads; i++)
+	{
+		if (pthread_create(&tid[started], NULL, extract_worker, pInst) == 0) started++;
+		else fprintf(stderr, "Cannot create worker thread %d\n", i);
+	}
+	if (!started && pool->files)
+	{
+		fprintf(stderr, "No worker threads could be started.\n");
+		return -1;
+	}
+	for (i=0; i<started; i++) pthread_join(tid[i], NULL);
+	printf ("\r%-79s\r", " ");
+
+	/* Directory timestamps can only be set after all files in there have been written */
+	for (i=0; i<pool->njobs; i++)
+	{
+		if (pool->jobs[i].type != TYPE_DIRECTORY) continue;
+		utb.actime = utb.modtime = pool->jobs[i].mtime;
+		utime(pool->jobs[i].file, &utb);
+	}
+	printf ("Extracted %d/%d files using %d threads, %d errors\n", pool->done - pool->errors, 
+		pool->files, started, pool->errors);
+	return pool->errors?-1:0;
+}
+
+#define META_BLOCKS	4096	// Capacity of metadata cache in ISIZE blocks
+#define META_HASH	8192	// Number of hash buckets, power of 2
+#define META_MERGE	64		// Maximum number of ISIZE blocks read at once
+#define META_GAP	8		// Unneeded blocks that may be read to merge two requests
+
+typedef struct
+{
+	off64_t offset;		// Offset of block in image, -1 if unused
+	int prev, next;		// LRU list, head is most recently used
+	int hnext;			// Next block in hash bucket
+	char data[ISIZE];
+} META_BLOCK;
+
+typedef struct meta_cache
+{
+	META_BLOCK *blocks;
+	int hash[META_HASH];
+	int used, head, tail;
+} META_CACHE;
+
+#define META_BUCKET(offset) ((int)((offset) / ISIZE) & (META_HASH - 1))
+
+META_CACHE *meta_init(void)
+{
+	META_CACHE *mc;
+	int i;
+
+	if (!(mc = calloc(1, sizeof(META_CACHE))) || !(mc->blocks = malloc(META_BLOCKS * sizeof(META_BLOCK))))
+	{
+		free(mc);
+		return NULL;
+	}
+	for (i=0; i<META_HASH; i++) mc->hash[i] = -1;
+	mc->head = mc->tail = -1;
+	return mc;
+}
+
+void meta_free(META_CACHE *mc)
+{
+	if (!mc) return;
+	free(mc->blocks);
+	free(mc);
+}
+
+void meta_unlink(META_CACHE *mc, int i)
+{
+	if (mc->blocks[i].prev >= 0) mc->blocks[mc->blocks[i].prev].next = mc->blocks[i].next; else mc->head = mc->blocks[i].next;
+	if (mc->blocks[i].next >= 0) mc->blocks[mc->blocks[i].next].prev = mc->blocks[i].prev; else mc->tail = mc->blocks[i].prev;
+}
+
+void meta_touch(META_CACHE *mc, int i)
+{
+	mc->blocks[i].prev = -1;
+	mc->blocks[i].next = mc->head;
+	if (mc->head >= 0) mc->blocks[mc->head].prev = i; else mc->tail = i;
+	mc->head = i;
+}
+
+int meta_lookup(META_CACHE *mc, off64_t offset)
+{
+	int i;
+
+	for (i = mc->hash[META_BUCKET(offset)]; i >= 0 && mc->blocks[i].offset != offset; i = mc->blocks[i].hnext);
+	return i;
+}
+
+void meta_insert(META_CACHE *mc, off64_t offset, char *data)
+{
+	int i, *pi;
+
+	if ((i = meta_lookup(mc, offset)) >= 0) meta_unlink(mc, i);
+	else
+	{
+		if (mc->used < META_BLOCKS) i = mc->used++;
+		else
+		{
+			/* Evict least recently used block */
+			i = mc->tail;
+			meta_unlink(mc, i);
+			for (pi = &mc->hash[META_BUCKET(mc->blocks[i].offset)]; *pi != i; pi = &mc->blocks[*pi].hnext);
+			*pi = mc->blocks[i].hnext;
+		}
+		mc->blocks[i].offset = offset;
+		mc->blocks[i].hnext = mc->hash[META_BUCKET(offset)];
+		mc->hash[META_BUCKET(offset)] = i;
+	}
+	memcpy(mc->blocks[i].data, data, ISIZE);
+	meta_touch(mc, i);
+}
+
+/* Reads one ISIZE metadata block, returns number of bytes read like read() */
+ssize_t meta_read(EXTRINST *pInst, off64_t offset, void *buffer)
+{
+	ssize_t rd;
+	int i;
+
+	if (pInst->meta && (i = meta_lookup(pInst->meta, offset)) >= 0)
+	{
+		memcpy(buffer, pInst->meta->blocks[i].data, ISIZE);
+		meta_unlink(pInst->meta, i);
+		meta_touch(pInst->meta, i);
+		return ISIZE;
+	}
+	if (map_bad(pInst->map, offset, ISIZE, NULL, NULL))
+	{
+		errno = EIO;
+		return -1;
+	}
+	if ((rd = pread64(pInst->fdd, buffer, ISIZE, offset)) == ISIZE && pInst->meta)
+		meta_insert(pInst->meta, offset, buffer);
+	return rd;
+}
+
+/* Returns one ISIZE metadata block in place in the cache, it stays valid until the
+ * next block is read. NULL on read error or if there is no cache.
+ */
+const void *meta_view(EXTRINST *pInst, off64_t offset)
+{
+	char buffer[ISIZE];
+	int i;
+
+	if (!pInst->meta) return NULL;
+	if ((i = meta_lookup(pInst->meta, offset)) >= 0)
+	{
+		meta_unlink(pInst->meta, i);
+		meta_touch(pInst->meta, i);
+	}
+	else if (meta_read(pInst, offset, buffer) == ISIZE) i = pInst->meta->head;	// Inserted in front
+	else return NULL;
+	return pInst->meta->blocks[i].data;
+}
+
+int cmp_offset(const void *a, const void *b)
+{
+	off64_t oa = *(const off64_t*)a, ob = *(const off64_t*)b;
+
+	return oa < ob ? -1 : (oa > ob);
+}
+
+/* Sorts the given block offsets and reads the ones not yet cached in large merged requests.
+ * Read errors are ignored here, they are reported when the block is actually needed.
+ */
+void meta_prefetch(EXTRINST *pInst, off64_t *offsets, int n)
+{
+	char *buffer;
+	int i, j, k;
+	off64_t span;
+
+	if (!pInst->meta || n < 2 || !(buffer = malloc(META_MERGE * ISIZE))) return;
+	qsort(offsets, n, sizeof(off64_t), cmp_offset);
+	for (i=0; i<n; i=j)
+	{
+		if (meta_lookup(pInst->meta, offsets[i]) >= 0)
 		{
-			r = (size > BCNT * 4) ? (BCNT * BSIZE) : ((size * BSIZE) / 4);
-			printf("\rCopying run %02i starting at block %08X with len %08X [%03d%%]", j, inode->runs[j].start, 
-				inode->runs[j].len, (int)((double)written/(double)origfsize*100));
-			fflush(stdout);
-			if(read(pInst->fdd, buffer, r) < 0)
-			{
-				fprintf(stderr, "Error reading block %i: %s\n", inode->runs[j].start, strerror(errno));
-				close(fdf);
-				return -1;
-			}
-			if (fsize<r) r=fsize;
-			fsize-=r;
-			if(write(fdf, buffer, r)!=r)
-			{
-			    fprintf(stderr, "Error writing file %s: %s\n",outfile, strerror(errno));
-				close(fdf);
-				return -1;
-			}
+			j = i + 1;
+			continue;
 		}
+		for (j=i+1; j<n && offsets[j] - offsets[j-1] <= (META_GAP + 1) * ISIZE &&
+			offsets[j] - offsets[i] < META_MERGE * ISIZE; j++);
+		span = offsets[j-1] + ISIZE - offsets[i];
+		if (map_bad(pInst->map, offsets[i], span, NULL, NULL) || pread64(pInst->fdd, buffer, span, offsets[i]) != span) continue;
+		for (k=i; k<j; k++)
+			if (k==i || offsets[k] != offsets[k-1])
+				meta_insert(pInst->meta, offsets[k], buffer + (offsets[k] - offsets[i]));
 	}
-	close(fdf);
-	printf ("\r%-79s\r", " ");
-	return 0;
+	free(buffer);
 }
 
 #define INODE_OFFSET(tbl,idx) \
-	(((off64_t)tbl[idx/ITBL_SZ].entries[idx%ITBL_SZ].hoffset<<32)+tbl[idx/ITBL_SZ].entries[idx%ITBL_SZ].offset)
-#define ITABLES_V20	6
-#define ITABLES_V23 9
-#define ITABLES_MAX ITABLES_V23
+	(((off64_t)itbl_entry_hoffset(&tbl[(idx)/ITBL_SZ].entries[(idx)%ITBL_SZ])<<32)+itbl_entry_offset(&tbl[(idx)/ITBL_SZ].entries[(idx)%ITBL_SZ]))
 
-int read_itbl(int fdd, off64_t start, itbl *itble, int itables)
+int read_itbl(int fdd, BADMAP *map, off64_t start, itbl *itble, int itables)
 {
 	/* I don't know yet how they can be found, normally they are at these offsets, but not always: */
 	//off64_t itbl_offsets[] = {0, 0x1000, 0x2000, 0xF000, 0x10000, 0x11000};
@@ -177,23 +1621,31 @@ int read_itbl(int fdd, off64_t start, itbl *itble, int itables)
 	/* Try to find inode tables by pattern matching, as I don't know how they are referenced yet :( */	
 	for (i=0, cnt=0; i<0x20000; i+=ISIZE)
 	{
-		if (read(fdd, &itble[cnt], sizeof(itble[0])) != sizeof(itble[0]))
+		/* Bad blocks are zero-filled like in a ddrescue image, without touching the device */
+		if (map_bad(map, start + ITBL_START + i, sizeof(itble[0]), NULL, NULL))
+		{
+			memset(&itble[cnt], 0, sizeof(itble[0]));
+			if (lseek64(fdd, sizeof(itble[0]), SEEK_CUR) == (off64_t)-1) return -1;
+		}
+		else if (read(fdd, &itble[cnt], sizeof(itble[0])) != sizeof(itble[0]))
 		{
 			fprintf (stderr, "Cannot read Inode directory @%10llX: %s\n", 
 				start + ITBL_START + i, strerror(errno));
 			return -1;
 		}
-		if ((cnt>0 && cnt!=3) || (itble[cnt].generation>0 && itble[cnt].generation<=0xFFFF && itble[cnt].i0 && !itble[cnt].i1 && !itble[cnt].i2))
+		if ((cnt>0 && cnt!=3) || (itbl_generation(&itble[cnt])>0 && itbl_generation(&itble[cnt])<=0xFFFF &&
+			itbl_i0(&itble[cnt]) && !itbl_i1(&itble[cnt]) && !itbl_i2(&itble[cnt])))
 		{
 			/* Header match, now validate if there are valid entries */
 			int bValid, j;
 
-			if (itble[cnt].generation)
+			if (itbl_generation(&itble[cnt]))
 			{
 				for (j=0,bValid=0; j<ITBL_SZ; j++)
 				{
 					if (memcmp(&itble[cnt].entries[j], &itbl_zro, sizeof(itbl_zro)) == 0) continue;
-					bValid = itble[cnt].entries[j].offset && itble[cnt].entries[j].i2==1 && itble[cnt].entries[j].i3==1;
+					bValid = itbl_entry_offset(&itble[cnt].entries[j]) && itbl_entry_i2(&itble[cnt].entries[j])==1 &&
+						itbl_entry_i3(&itble[cnt].entries[j])==1;
 				}
 			} else bValid = 1;
 			if (bValid)
@@ -209,6 +1661,183 @@ int read_itbl(int fdd, off64_t start, itbl *itble, int itables)
 	return 0;
 }
 
+typedef struct
+{
+	off64_t offset;		// In ISIZE units relative to start of first superblock
+	uint32 generation;	// Generation of the inode table the pointer was found in
+} BACKUP_INODE;
+
+typedef struct backup_index
+{
+	int replicas;		// Number of backup superblocks on the image
+	int *count;			// Number of alternative pointers per inode
+	BACKUP_INODE *cand;	// Alternative pointers of inode id start at cand[id * replicas]
+} BACKUP_INDEX;
+
+typedef struct
+{
+	EXTRINST *pInst;
+	itbl *tables;	// itables tables of every replica
+	int *valid;		// Replica could be read
+	int itables, replicas, next;
+	pthread_mutex_t mtx;
+} BACKUP_SCAN;
+
+void *scan_replicas(void *arg)
+{
+	BACKUP_SCAN *scan = arg;
+	int fdd, j;
+
+	if (scan->pInst->threads > 1) fdd = open(scan->pInst->image, O_RDONLY|O_LARGEFILE|O_BINARY);
+	else fdd = scan->pInst->fdd;
+	if (fdd == -1)
+	{
+		fprintf(stderr, "Error opening image %s:%s\n", scan->pInst->image, strerror(errno));
+		return NULL;
+	}
+	for (;;)
+	{
+		pthread_mutex_lock(&scan->mtx);
+		j = scan->next++;
+		pthread_mutex_unlock(&scan->mtx);
+		if (j >= scan->replicas) break;
+		scan->valid[j] = read_itbl(fdd, scan->pInst->map, scan->pInst->start + (j+1)*(off64_t)GSIZE*(off64_t)ASIZE, 
+			&scan->tables[j * scan->itables], scan->itables) >= 0;
+	}
+	if (fdd != scan->pInst->fdd) close(fdd);
+	return NULL;
+}
+
+/* Reads the inode tables of all backup superblocks once and collects the inode pointers
+ * that differ from the primary inode table, most recent generation first.
+ */
+BACKUP_INDEX *build_backup_index(EXTRINST *pInst, itbl *itble, int itables)
+{
+	BACKUP_SCAN scan = {0};
+	BACKUP_INDEX *idx;
+	BACKUP_INODE *cand;
+	pthread_t tid[MAX_THREADS];
+	off64_t size, offset;
+	int i, j, k, started = 0;
+
+	scan.pInst = pInst;
+	scan.itables = itables;
+	if ((size = lseek64(pInst->fdd, 0, SEEK_END)) > pInst->start)
+		scan.replicas = (size - pInst->start - 1) / ((off64_t)GSIZE*ASIZE);
+	if (!(idx = calloc(1, sizeof(BACKUP_INDEX))) ||
+		!(idx->count = calloc(itables * ITBL_SZ, sizeof(int))) ||
+		!(scan.valid = calloc(scan.replicas + 1, sizeof(int))) ||
+		!(scan.tables = calloc(scan.replicas * itables + 1, sizeof(itbl))) ||
+		!(idx->cand = calloc(itables * ITBL_SZ * (scan.replicas + 1), sizeof(BACKUP_INODE))))
+	{
+		fprintf(stderr, "Out of memory building backup inode table index\n");
+		if (idx) free(idx->count);
+		free(idx);
+		free(scan.valid);
+		free(scan.tables);
+		return NULL;
+	}
+	idx->replicas = scan.replicas;
+	printf("Reading inode tables of %d backup superblocks\n", scan.replicas);
+
+	pthread_mutex_init(&scan.mtx, NULL);
+	if (pInst->threads > 1)
+	{
+		for (i=0; i<pInst->threads && i<scan.replicas; i++)
+			if (pthread_create(&tid[started], NULL, scan_replicas, &scan) == 0) started++;
+		for (i=0; i<started; i++) pthread_join(tid[i], NULL);
+	}
+	if (!started) scan_replicas(&scan);
+	pthread_mutex_destroy(&scan.mtx);
+
+	for (i=0; i<itables * ITBL_SZ; i++)
+	{
+		cand = &idx->cand[i * idx->replicas];
+		for (j=0; j<idx->replicas; j++)
+		{
+			itbl *tbl = &scan.tables[j * itables];
+
+			if (!scan.valid[j] || !(offset = INODE_OFFSET(tbl, i)) || offset == INODE_OFFSET(itble, i)) continue;
+			for (k=0; k<idx->count[i] && cand[k].offset != offset; k++);
+			if (k<idx->count[i])
+			{
+				if (itbl_generation(&tbl[i/ITBL_SZ]) > cand[k].generation) cand[k].generation = itbl_generation(&tbl[i/ITBL_SZ]);
+				continue;
+			}
+			/* Insert sorted by generation */
+			for (k=idx->count[i]++; k>0 && cand[k-1].generation < itbl_generation(&tbl[i/ITBL_SZ]); k--) cand[k] = cand[k-1];
+			cand[k].offset = offset;
+			cand[k].generation = itbl_generation(&tbl[i/ITBL_SZ]);
+		}
+	}
+	free(scan.valid);
+	free(scan.tables);
+	return idx;
+}
+
+void free_backup_index(BACKUP_INDEX *idx)
+{
+	if (!idx) return;
+	free(idx->count);
+	free(idx->cand);
+	free(idx);
+}
+
+/* Looks up an intact copy of an incomplete file inode in the backup inode tables */
+int find_backup_inode(EXTRINST *pInst, itbl *itble, int itables, uint32 inode_id, char *buffer)
+{
+	BACKUP_INODE *cand;
+	char candbuf[ISIZE];
+	inode *inod = (inode*)candbuf;
+	int k;
+
+	if (!pInst->backup && !(pInst->backup = build_backup_index(pInst, itble, itables))) return -1;
+	cand = &pInst->backup->cand[inode_id * pInst->backup->replicas];
+	for (k=0; k<pInst->backup->count[inode_id]; k++)
+	{
+		if (meta_read(pInst, pInst->start + cand[k].offset * ISIZE, candbuf) == sizeof(candbuf) &&
+			(inode_magic(inod) & INODE_MAGIC_MASK) == INODE_MAGIC_GEN && block_run_start(&inod->runs[0]))
+		{
+			memcpy(buffer, candbuf, sizeof(candbuf));
+			return 0;
+		}
+	}
+	return -1;
+}
+
+/* Fetches all pages of a directory and the inodes they refer to before the directory is walked */
+void prefetch_dir(EXTRINST *pInst, off64_t dir_offset, itbl *itble, int itables, directory *dir)
+{
+	off64_t *offsets;
+	const dir_page *page;
+	uint32 item_len = directory_item_len(dir), id;
+	int i, j, n, page_len;
+
+	if (!pInst->meta || item_len > META_BLOCKS ||
+		!(offsets = malloc((item_len + 1) * DIR_ENTRIES_OTHER * sizeof(off64_t)))) return;
+	for (j=1, n=0; j<item_len; j++) offsets[n++] = dir_offset + j * ISIZE;
+	meta_prefetch(pInst, offsets, n);
+
+	/* Pages are only looked at in the cache, nothing else is read meanwhile */
+	page = (const dir_page*)&dir->d7;
+	for (j=0, n=0, page_len=DIR_ENTRIES_FIRST; j<item_len; j++)
+	{
+		if (j)
+		{
+			if (!(page = meta_view(pInst, dir_offset + j * ISIZE))) break;
+			page_len=DIR_ENTRIES_OTHER;
+		}
+		for (i=0; i<page_len; i++)
+		{
+			id = dir_entry_inode_id(&page->entries[i]);
+			if (!id || id == (uint32)-1 || id >= itables*ITBL_SZ) continue;
+			offsets[n++] = pInst->start + INODE_OFFSET(itble,id) * ISIZE;
+		}
+	}
+	meta_prefetch(pInst, offsets, n);
+	free(offsets);
+}
+
 int dump_dir(EXTRINST *pInst, off64_t dir_offset, itbl *itble, int itables, directory *dir, char *outdir, int list)
 {
 	int i, j, page_len;
@@ -218,16 +1847,18 @@ int dump_dir(EXTRINST *pInst, off64_t dir_offset, itbl *itble, int itables, dire
 	off64_t offset;
 	ssize_t rd=-1;
 	struct utimbuf utb={0};
+	uint32 item_len = directory_item_len(dir), id;
+	const dir_entry *ent;
     dir_page *page, lpage;
 
+    prefetch_dir(pInst, dir_offset, itble, itables, dir);
     page = (dir_page*)&dir->d7;
-    for (j=0, page_len=DIR_ENTRIES_FIRST; j<dir->item_len; j++)
+    for (j=0, page_len=DIR_ENTRIES_FIRST; j<item_len; j++)
     {
         if (j)
         {
-            /* Seek to next directory entry */
-    		if (lseek64(pInst->fdd, (offset = dir_offset + j * ISIZE), SEEK_SET) == (off64_t)-1 ||
-    			(rd=read(pInst->fdd, &lpage, sizeof(lpage))) != sizeof(lpage))
+            /* Read next directory page */
+    		if ((rd=meta_read(pInst, (offset = dir_offset + j * ISIZE), &lpage)) != sizeof(lpage))
     		{
     			fprintf (stderr, "Cannot read directory page %d @%10llX [rd=%d]: %s\n", 
     				j, offset, rd, strerror(errno));
@@ -238,70 +1869,68 @@ int dump_dir(EXTRINST *pInst, off64_t dir_offset, itbl *itble, int itables, dire
 
     	for (i=0; i<page_len; i++)
 	    {
+    		ent = &page->entries[i];
+    		id = dir_entry_inode_id(ent);
+
     		/* Skip deleted entries */
-    		if (!page->entries[i].inode_id || page->entries[i].inode_id == -1) continue;
+    		if (!id || id == (uint32)-1) continue;
 
     		/* Seek to given INODE */
-			if (page->entries[i].inode_id > itables*ITBL_SZ)
+			if (id >= itables*ITBL_SZ)
 			{
-				fprintf(stderr, "Inode %d (#%d @%10llX (pg %d)) exceeds size of available inode tables.\n", page->entries[i].inode_id, i, dir_offset + j * ISIZE, j);
+				fprintf(stderr, "Inode %d (#%d @%10llX (pg %d)) exceeds size of available inode tables.\n", id, i, dir_offset + j * ISIZE, j);
 				return -1;
 			}
-    		if (lseek64(pInst->fdd, (offset = pInst->start + INODE_OFFSET(itble,page->entries[i].inode_id) * ISIZE),
-    			 SEEK_SET) == (off64_t)-1 ||
-    			(rd=read(pInst->fdd, buffer, sizeof(buffer))) != sizeof(buffer))
+    		if ((rd=meta_read(pInst, (offset = pInst->start + INODE_OFFSET(itble,id) * ISIZE),
+    			buffer)) != sizeof(buffer))
     		{
     			fprintf (stderr, "Dir entry %d: Cannot read INODE %d @%10llX [rd=%d]: %s\n", 
-    				i, page->entries[i].inode_id, offset, rd, strerror(errno));
+    				i, id, offset, rd, strerror(errno));
     			return -1;
     		}
 
-    		sprintf(file, "%s/%.*s", outdir, page->entries[i].len, page->entries[i].filename);
+    		sprintf(file, "%s/%.*s", outdir, dir_entry_len(ent), ent->filename);
 
     		/* Dump inode to filesystem */
-    		switch (page->entries[i].type)
+    		switch (dir_entry_type(ent))
     		{
     		case TYPE_FILE:
     			inod = (inode*)buffer;
-    			if ((inod->magic & INODE_MAGIC_MASK) != INODE_MAGIC_GEN)
+    			if ((inode_magic(inod) & INODE_MAGIC_MASK) != INODE_MAGIC_GEN)
     			{
     				fprintf (stderr, "Dir entry %d: INODE %d is not a file inode (magic=%08X)\n", 
-    					i, page->entries[i].inode_id, inod->magic);
+    					i, id, inode_magic(inod));
     				return -1;
     			}
-    			if ((inod->hsize>0 || inod->size>0) && !inod->runs[0].start)
+    			if (inode_fsize(inod) && !block_run_start(&inod->runs[0]))
     			{
-    				itbl itbl1[ITABLES_MAX]={0};
-    				int j;
-
 	    			// This is an incomplete inode search backup inode tables if there are other inode ptrs in there
-    				for (j=1; read_itbl(pInst->fdd, pInst->start + j*(off64_t)GSIZE*(off64_t)ASIZE, itbl1, itables)>=0; j++)
-    				{
-    					if ((offset = INODE_OFFSET(itbl1,page->entries[i].inode_id)) != INODE_OFFSET(itble,page->entries[i].inode_id))
-    					{
-    						if (lseek64(pInst->fdd, (offset = pInst->start + offset * ISIZE), SEEK_SET) != (off64_t)-1 &&
-    							read(pInst->fdd, buffer, sizeof(buffer)) == sizeof(buffer) && inod->runs[0].start)
-	    						break;
-    					}
-    				}
+    				if (find_backup_inode(pInst, itble, itables, id, buffer) < 0)
+    					fprintf (stderr, "Dir entry %d: No intact copy of incomplete INODE %d found\n", i, id);
+    			}
+    			utb.actime=utb.modtime=FILETIME(inode_time1(inod));
+    			if (list) list_file(pInst, inod, file);
+    			else if (pInst->pool)
+    			{
+    				if (queue_job(pInst->pool, TYPE_FILE, inod, file, utb.modtime)<0) return -1;
     			}
-    			if (!list) dump_file(pInst, inod, file); else list_file(pInst, inod, file);
-    			utb.actime=utb.modtime=FILETIME(inod->time1);
+    			else dump_file(pInst, inod, file);
     			break;
     		case TYPE_DIRECTORY:
     			idir = (directory*)buffer;
-    			if ((idir->magic & DIRECTORY_MAGIC_MASK) != DIRECTORY_MAGIC_GEN)
+    			if ((directory_magic(idir) & DIRECTORY_MAGIC_MASK) != DIRECTORY_MAGIC_GEN)
     			{
-    				fprintf (stderr, "Dir entry %d: INODE %d is not a directory (magic=%08X)\n", i, dir->entries[i].inode_id, idir->magic);
+    				fprintf (stderr, "Dir entry %d: INODE %d is not a directory (magic=%08X)\n", i, id, directory_magic(idir));
     				return -1;
     			}
     			mkdir(file,0775);
     			dump_dir(pInst, offset, itble, itables, idir, file, list);
-    			utb.actime=utb.modtime=FILETIME(idir->time1);
+    			utb.actime=utb.modtime=FILETIME(directory_time1(idir));
+    			if (pInst->pool && queue_job(pInst->pool, TYPE_DIRECTORY, NULL, file, utb.modtime)<0) return -1;
     			break;
     		}
-    		utime(file, &utb);
-			if (page->entries[i].len>sizeof(page->entries[i].filename))
+    		if (!pInst->pool) utime(file, &utb);
+			if (dir_entry_len(ent)>sizeof(ent->filename))
 			{
 				fprintf (stderr, "Info: filename length exceeds directory entry size, ending directory traversal.\n");
 				break;
@@ -317,20 +1946,43 @@ int main(int argc, char **argv)
 	off64_t offset;
 	itbl itbl[ITABLES_MAX]={0};
 	directory root;
-	int ret, itables, as=1;
+	EXTPOOL pool={0};
+	int ret, itables, as, resume = 0;
 
 	printf ("extract_meihdfs V1.7 - (c) leecher@dose.0wnz.at, 2016\n\n");
-	if (argc<2)
+	for (as=1; as<argc && argv[as][0]=='-'; as++)
 	{
-		printf ("Usage: %s [-s<Start>] <Image> <Output dir>\n\n", argv[0]);
-		printf ("\t-s\tOptional hex offset where to start searching header\n\ti.e.: -s0xA4000000 \n");
-		return -1;
+		if (sscanf(argv[as], "-s0x%llx", &inst.start) > 0)
+			printf ("Using user supplied start offset %08X\n", inst.start);
+		else if (sscanf(argv[as], "-j%d", &inst.threads) > 0 && inst.threads > 0 && inst.threads <= MAX_THREADS)
+			printf ("Extracting with %d parallel threads\n", inst.threads);
+		else if (strcmp(argv[as], "-t") == 0)
+			inst.no_uring = 1;
+		else if (strcmp(argv[as], "--resume") == 0)
+			resume = 1;
+#ifdef O_DIRECT
+		else if (strcmp(argv[as], "-d") == 0)
+			inst.direct = 1;
+#endif
+		else if (strncmp(argv[as], "-m", 2) == 0 && argv[as][2])
+		{
+			map_free(inst.map);
+			if (!(inst.map = map_load(argv[as] + 2))) return -1;
+		}
+		else break;
 	}
-
-	if (sscanf(argv[as], "-s0x%llx", &inst.start) > 0)
+	if (as>=argc || argv[as][0]=='-')
 	{
-		as++;
-		printf ("Using user supplied start offset %08X\n", inst.start);
+		printf ("Usage: %s [-s<Start>] [-j<Threads>] [-t] [-d] [-m<Mapfile>] [--resume] <Image> <Output dir>\n\n", argv[0]);
+		printf ("\t-s\tOptional hex offset where to start searching header\n\ti.e.: -s0xA4000000 \n");
+		printf ("\t-j\tExtract files with the given number of parallel threads (1-%d)\n\ti.e.: -j4\n", MAX_THREADS);
+		printf ("\t-t\tUse reader/writer threads for copying instead of io_uring\n");
+#ifdef O_DIRECT
+		printf ("\t-d\tRead file data with O_DIRECT, bypassing the page cache\n");
+#endif
+		printf ("\t-m\tddrescue mapfile of the image, bad areas are not read and get reported per file\n\ti.e.: -mrescue.map\n");
+		printf ("\t--resume\tContinue an interrupted extraction, skip files that are already complete\n");
+		return -1;
 	}
 
 	inst.fdd = open(argv[as], O_RDONLY|O_LARGEFILE|O_BINARY);
@@ -339,32 +1991,61 @@ int main(int argc, char **argv)
 		fprintf(stderr, "Error opening image %s:%s\n", argv[as], strerror(errno));
 		return -1;
 	}
+#ifdef O_DIRECT
+	inst.image = argv[as];
+	if (inst.direct && open_direct(&inst)<0)
+	{
+		fprintf (stderr, "Warning: Cannot open image with O_DIRECT, using page cache: %s\n", strerror(errno));
+		inst.direct = 0;
+	}
+#endif
 
 	/* Search header, read INODE directories */
-	if (search_hdr(&inst)<0 || read_itbl(inst.fdd, inst.start, itbl, (itables=inst.ver<3?ITABLES_V20:ITABLES_V23))<0)
+	if (search_hdr(&inst)<0 || read_itbl(inst.fdd, inst.map, inst.start, itbl, (itables=inst.fs->itables))<0)
 	{
 		close(inst.fdd);
 		return -1;
 	}
 
 	/* Seek to INODE 0 (root directory) and read it */
-	if (lseek64(inst.fdd, (offset = inst.start + INODE_OFFSET(itbl,0) * ISIZE), SEEK_SET) == (off64_t)-1 ||
-		read(inst.fdd, &root, sizeof(root)) != sizeof(root))
+	if (!(inst.meta = meta_init()))
+		fprintf (stderr, "Warning: Not enough memory for metadata cache.\n");
+	if (meta_read(&inst, (offset = inst.start + INODE_OFFSET(itbl,0) * ISIZE), &root) != sizeof(root))
 	{
 		fprintf (stderr, "Cannot read root directory @%10llX: %s\n", offset, strerror(errno));
 		close(inst.fdd);
 		return -1;
 	}
 
-	if (root.magic != ROOTDIR_MAGIC)
+	if (directory_magic(&root) != ROOTDIR_MAGIC)
 	{
-		fprintf (stderr, "Rootdirectory @%10llX doesn't have valid rootdir magic (magic = %08X).\n", offset, root.magic);
+		fprintf (stderr, "Rootdirectory @%10llX doesn't have valid rootdir magic (magic = %08X).\n", offset, directory_magic(&root));
 		close(inst.fdd);
 		return -1;
 	}
 
-	as++;
+	inst.image = argv[as++];
+	if (argc>as && !(inst.journal = journal_open(argv[as], resume)))
+		fprintf (stderr, "Warning: Not enough memory for journal.\n");
+	if (inst.threads>1 && argc>as)
+	{
+		pthread_mutex_init(&pool.mtx, NULL);
+		inst.pool = &pool;
+	}
 	ret = dump_dir(&inst, offset, itbl, itables, &root, argc>as?argv[as]:".", argc<=as);
+	if (inst.pool)
+	{
+		/* Like the inline extraction, files found before a traversal error still get extracted */
+		if (run_pool(&inst)<0) ret = -1;
+		pthread_mutex_destroy(&pool.mtx);
+		free(pool.jobs);
+	}
+	journal_close(inst.journal);
+	free_backup_index(inst.backup);
+	meta_free(inst.meta);
+	free(inst.dbuf);
+	map_free(inst.map);
+	if (inst.direct) close(inst.fdr);
 	close(inst.fdd);
 	return ret;
 }
@@ -152,3 +152,70 @@ typedef struct directory {
 } directory;
 
 #pragma pack()
+
+/*
+ * The structures above are only views on the blocks as they were read from disk,
+ * they must match its layout exactly.
+ */
+#define LAYOUT_CHECK(name, cond) typedef char layout_##name[(cond)?1:-1]
+
+LAYOUT_CHECK(block_run, sizeof(block_run) == 12);
+LAYOUT_CHECK(inode, sizeof(inode) == ISIZE);
+LAYOUT_CHECK(inode_runs, offsetof(inode, runs) == 0x100);
+LAYOUT_CHECK(itbl, sizeof(itbl) == ISIZE);
+LAYOUT_CHECK(dir_entry, sizeof(dir_entry) == 32);
+LAYOUT_CHECK(dir_page, sizeof(dir_page) == ISIZE);
+LAYOUT_CHECK(directory, sizeof(directory) == ISIZE);
+LAYOUT_CHECK(directory_d7, offsetof(directory, d7) == offsetof(inode, runs));
+
+/*
+ * Values on disk are little endian, so fields are read through these accessors,
+ * i.e. inode_magic(inod). On little endian hosts they are plain loads.
+ */
+static inline uint16 le16(const void *p)
+{
+	const unsigned char *b = p;
+	return b[0] | b[1] << 8;
+}
+
+static inline uint32 le32(const void *p)
+{
+	const unsigned char *b = p;
+	return b[0] | b[1] << 8 | b[2] << 16 | (uint32)b[3] << 24;
+}
+
+#define FIELD16(type, field) static inline uint16 type##_##field(const type *p) { return le16(&p->field); }
+#define FIELD32(type, field) static inline uint32 type##_##field(const type *p) { return le32(&p->field); }
+
+FIELD32(block_run, start)
+FIELD32(block_run, offset)
+FIELD32(block_run, len)
+
+FIELD32(inode, factor)
+FIELD32(inode, size)
+FIELD32(inode, hsize)
+FIELD32(inode, magic)
+FIELD32(inode, time1)
+
+FIELD32(itbl_entry, offset)
+FIELD32(itbl_entry, hoffset)
+FIELD16(itbl_entry, i2)
+FIELD16(itbl_entry, i3)
+
+FIELD32(itbl, generation)
+FIELD32(itbl, i0)
+FIELD32(itbl, i1)
+FIELD32(itbl, i2)
+
+FIELD32(dir_entry, inode_id)
+FIELD16(dir_entry, type)
+FIELD16(dir_entry, len)
+
+FIELD32(directory, item_len)
+FIELD32(directory, magic)
+FIELD32(directory, time1)
+
+static inline uint64_t inode_fsize(const inode *p)	// Or are the higher bits of size elsewhere?
+{
+	return ((uint64_t)inode_hsize(p) << 32) + inode_size(p);
+}
@@ -36,6 +36,7 @@ typedef uint16_t partition_num_t;
 typedef struct udf_s udf_t; 
 typedef struct udf_file_s udf_file_t;
 typedef struct udf_dirent_s udf_dirent_t;
+typedef struct udf_index_s udf_index_t;
 
 /**
    Imagine the below a \#define'd value rather than distinct values of
@@ -76,6 +77,107 @@ extern "C" {
     Caller must free result - use udf_close for that.
   */
   udf_t *udf_open (const char *psz_path);
+
+  /*!
+    Like udf_open, but file data is read with O_DIRECT past the page
+    cache in aligned requests of the tool's own size. Falls back to
+    udf_open if the image can't be opened that way.
+  */
+  udf_t *udf_open_direct (const char *psz_path);
+
+  /*!
+    Like udf_open, but the areas of the image that aren't marked as
+    finished in the ddrescue mapfile psz_mapfile are never read, they
+    are returned zero-filled. Reads with O_DIRECT if b_direct is set.
+  */
+  udf_t *udf_open_mapfile (const char *psz_path, const char *psz_mapfile,
+			   bool b_direct);
+
+  /*!
+    Like udf_open_mapfile, but the filesystem is taken from the position
+    saved in p_index instead of searching the image. psz_mapfile may be
+    NULL.
+  */
+  udf_t *udf_open_index (const char *psz_path, const udf_index_t *p_index,
+			 const char *psz_mapfile, bool b_direct);
+
+  /*!
+    For images whose File Set Descriptor or root directory is damaged:
+    opens psz_path without them and sweeps the whole image with
+    i_threads threads for file entries. The partition start is taken
+    from their tags. *pp_lba is set to the sorted blocks of the file
+    entries found, *pi_count to their number; free *pp_lba when done.
+  */
+  udf_t *udf_open_sweep (const char *psz_path, const char *psz_mapfile,
+			 bool b_direct, int i_threads,
+			 /*out*/ lba_t **pp_lba, /*out*/ int *pi_count);
+
+  /*!
+    Returns a dirent called psz_name for the file entry at block i_lba
+    of the image, NULL if there is none. A directory can be read with
+    udf_readdir.
+
+    Caller must free result - use udf_dirent_free for that.
+  */
+  udf_dirent_t *udf_get_fe_dirent (udf_t *p_udf, lba_t i_lba, const char *psz_name);
+
+  /*!
+    Starts an empty index of the tree of p_udf, see udf_index_add.
+  */
+  udf_index_t *udf_index_new (const udf_t *p_udf);
+
+  /*!
+    Adds p_udf_dirent to p_index. psz_dir is the path of the directory
+    it is listed in, or its own path if it is a directory.
+  */
+  bool udf_index_add (udf_index_t *p_index, udf_dirent_t *p_udf_dirent,
+		      const char *psz_dir);
+
+  /*!
+    Writes p_index to <psz_path>.udfidx (for drives <drive name>.udfidx
+    in the current directory).
+  */
+  bool udf_index_save (udf_index_t *p_index, const char *psz_path);
+
+  /*!
+    Maps the index saved for psz_path. NULL is returned if there is
+    none, it has another version or it doesn't fit the image.
+  */
+  udf_index_t *udf_index_load (const char *psz_path);
+
+  /*!
+    Number of entries in p_index, in the order they were added.
+  */
+  int udf_index_count (const udf_index_t *p_index);
+
+  /*!
+    Returns a dirent for entry i of p_index, file data is read through
+    p_udf without reading any metadata. *ppsz_dir is set to the path
+    the entry was added with.
+
+    Caller must free result - use udf_dirent_free for that.
+  */
+  udf_dirent_t *udf_index_dirent (const udf_index_t *p_index, int i,
+				  udf_t *p_udf, const char **ppsz_dir);
+
+  /*!
+    Position of the filesystem p_index was made from.
+  */
+  void udf_index_position (const udf_index_t *p_index, 
+			   /*out*/ uint32_t *pi_part_start,
+			   /*out*/ uint32_t *pi_fsd_offset);
+
+  /*!
+    Unmaps or frees p_index.
+  */
+  void udf_index_free (udf_index_t *p_index);
+
+  /*!
+    Opens the image of p_udf again with its own descriptor, so that
+    another thread can read file data through it. Close it before
+    p_udf.
+  */
+  udf_t *udf_clone (const udf_t *p_udf, const char *psz_path);
   
   /*!
     Get the root in p_udf. 
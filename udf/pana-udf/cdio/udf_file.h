@@ -90,6 +90,22 @@ extern "C" {
   ssize_t udf_read_block(udf_dirent_t *p_udf_dirent, 
 			 void * buf, size_t count);
 
+  /**
+    Reads up to count bytes of the file from the current position on,
+    across extent boundaries. Returns the number of bytes read, 0 at
+    the end of the file.
+  */
+  ssize_t udf_read_file(udf_dirent_t *p_udf_dirent, void *buf, size_t count);
+
+  /**
+    Finds the first part of the file range i_offset..i_offset+i_len
+    that lies in a bad area of the mapfile the image was opened with.
+    Returns false if there is none.
+  */
+  bool udf_get_bad_range(udf_dirent_t *p_udf_dirent, uint64_t i_offset,
+			 uint64_t i_len, /*out*/ uint64_t *pi_bad_offset,
+			 /*out*/ uint64_t *pi_bad_len);
+
   /**
     Advances p_udf_direct to the the next directory entry in the
     pointed to by p_udf_dir. It also returns this as the value.  NULL
@@ -100,6 +116,12 @@ extern "C" {
   */
   udf_dirent_t *udf_readdir(udf_dirent_t *p_udf_dirent);
   
+  /**
+    Returns a copy of the current entry of p_udf_dirent that stays
+    valid when udf_readdir moves on. File data is read through p_udf.
+  */
+  udf_dirent_t *udf_dup_dirent(const udf_dirent_t *p_udf_dirent, udf_t *p_udf);
+
   /**
     free free resources associated with p_udf_dirent.
   */
@@ -17,6 +17,10 @@
   along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#define _LARGEFILE64_SOURCE
+#ifdef __linux__
+#define _GNU_SOURCE  /* fallocate(), sync_file_range() */
+#endif
 #ifdef WIN32
 #define __USE_MINGW_ANSI_STDIO 1
 #endif
@@ -31,8 +35,19 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <time.h>
+#include <pthread.h>
 
 #define CEILING(x, y) ((x+(y-1))/y)
+#define JOURNAL_NAME ".udf_dump.journal"
+#define JOURNAL_STEP 0x4000000 /* Progress of a file is recorded every 64MB */
+#define HOLE_MIN 0x10000       /* Smallest run of zero blocks given back to the filesystem */
+#define WB_WINDOW 0x800000     /* Writeback of output is started every 8MB with --direct */
+#define DUMP_CHUNK 0x400000    /* File data is copied in chunks of 4MB */
+#define CHUNK_ALIGN 0x10000    /* Lets --direct read chunks straight into the buffer */
+#define MAX_THREADS 64
+#define MAX_PATTERNS 64
+#define SWEEP_THREADS 4        /* Threads sweeping for file entries if -j isn't given */
 
 #ifndef O_LARGEFILE
 #define O_LARGEFILE 0
@@ -42,55 +57,600 @@
 #endif
 #ifdef WIN32
 #define mkdir(x,y) mkdir(x)
+#define fdatasync(fd) _commit(fd)
 #endif
 
 #include "udf_private.h"
+
+/* Journal of extracted files, so that an interrupted extraction can be resumed.
+   Records are text lines: F <size> <mtime> <file> for finished files and
+                           P <offset> <mtime> <file> for the written part of unfinished ones */
+typedef struct
+{
+  char     *psz_file;  /* Path relative to output directory */
+  bool      b_complete;
+  uint64_t  i_size;
+  time_t    mtime;
+  int       i_seq;     /* Later records of a file override earlier ones */
+} journal_entry_t;
+
+static struct
+{
+  int              fd;
+  const char      *psz_root;
+  journal_entry_t *p_ent;  /* Last record per file of previous run, sorted by path */
+  int              i_count;
+} journal = { -1 };
+
+static int
+cmp_journal(const void *a, const void *b)
+{
+  const journal_entry_t *ja = a, *jb = b;
+  int r = strcmp(ja->psz_file, jb->psz_file);
+
+  return r ? r : ja->i_seq - jb->i_seq;
+}
+
+static void
+journal_open(const char *psz_dest, bool b_resume)
+{
+  char psz_path[PATH_MAX], line[PATH_MAX + 64], type;
+  long long size, mtime;
+  journal_entry_t *p_ent;
+  FILE *fp;
+  int i, k, i_max = 0, pos;
+
+  journal.psz_root = psz_dest;
+  snprintf(psz_path, sizeof(psz_path), "%s/%s", psz_dest, JOURNAL_NAME);
+  if (b_resume && (fp = fopen(psz_path, "r"))) {
+    while (fgets(line, sizeof(line), fp)) {
+      line[strcspn(line, "\r\n")] = 0;
+      if (sscanf(line, "%c %lld %lld %n", &type, &size, &mtime, &pos) < 3
+          || (type != 'F' && type != 'P') || !line[pos])
+        continue;
+      if (journal.i_count == i_max) {
+        i_max = i_max ? i_max * 2 : 256;
+        if (!(p_ent = realloc(journal.p_ent, i_max * sizeof(journal_entry_t))))
+          break;
+        journal.p_ent = p_ent;
+      }
+      p_ent = &journal.p_ent[journal.i_count];
+      if (!(p_ent->psz_file = strdup(line + pos))) break;
+      p_ent->b_complete = type == 'F';
+      p_ent->i_size = size;
+      p_ent->mtime = mtime;
+      p_ent->i_seq = journal.i_count++;
+    }
+    fclose(fp);
+
+    qsort(journal.p_ent, journal.i_count, sizeof(journal_entry_t), cmp_journal);
+    for (i = 0, k = 0; i < journal.i_count; i++) {
+      if (i + 1 < journal.i_count
+          && strcmp(journal.p_ent[i].psz_file, journal.p_ent[i+1].psz_file) == 0) {
+        free(journal.p_ent[i].psz_file);
+        continue;
+      }
+      journal.p_ent[k++] = journal.p_ent[i];
+    }
+    journal.i_count = k;
+    printf("Resuming extraction, %d files in journal\n", journal.i_count);
+  }
+  if ((journal.fd = open(psz_path, O_WRONLY|O_CREAT|O_APPEND|O_BINARY|(b_resume?0:O_TRUNC), 0666)) == -1)
+    fprintf(stderr, "Warning: Cannot create journal %s: %s\n", psz_path, strerror(errno));
+}
+
+static void
+journal_close(void)
+{
+  int i;
+
+  if (journal.fd != -1) close(journal.fd);
+  for (i = 0; i < journal.i_count; i++) free(journal.p_ent[i].psz_file);
+  free(journal.p_ent);
+}
+
+/* Path of output file as it is recorded in the journal */
+static const char *
+journal_file(const char *psz_outfile)
+{
+  size_t len = strlen(journal.psz_root);
+
+  if (strncmp(psz_outfile, journal.psz_root, len) != 0) return psz_outfile;
+  for (psz_outfile += len; *psz_outfile == '/'; psz_outfile++);
+  return psz_outfile;
+}
+
 static int
-dump_file(char *psz_outdir, udf_dirent_t *p_udf_dirent)
+cmp_file(const void *a, const void *b)
+{
+  return strcmp(((const journal_entry_t *)a)->psz_file, ((const journal_entry_t *)b)->psz_file);
+}
+
+static journal_entry_t *
+journal_find(const char *psz_outfile)
+{
+  journal_entry_t key;
+
+  if (!journal.i_count) return NULL;
+  key.psz_file = (char *)journal_file(psz_outfile);
+  return bsearch(&key, journal.p_ent, journal.i_count, sizeof(journal_entry_t), cmp_file);
+}
+
+static void
+journal_write(char type, uint64_t i_size, time_t mtime, const char *psz_outfile)
+{
+  char line[PATH_MAX + 64];
+  int len;
+
+  if (journal.fd == -1) return;
+  len = snprintf(line, sizeof(line), "%c %llu %lld %s\n", type, (unsigned long long)i_size, 
+                 (long long)mtime, journal_file(psz_outfile));
+  if (len > 0 && len < sizeof(line) && write(journal.fd, line, len) != len)
+    fprintf(stderr, "Warning: Cannot write journal: %s\n", strerror(errno));
+}
+
+/* Size of an existing file or -1, stat() fails on big files in 32bit builds */
+static off64_t
+file_size(const char *psz_file)
+{
+  int fd;
+  off64_t size;
+
+  if ((fd = open(psz_file, O_RDONLY|O_BINARY|O_LARGEFILE)) == -1) return -1;
+  size = lseek64(fd, 0, SEEK_END);
+  close(fd);
+  return size;
+}
+
+/* Checks if a buffer is all zeros, comparing it with itself shifted by 16 bytes
+   lets the vectorized memcmp() of the C library do the work */
+static bool
+is_zero(const char *buf, size_t len)
+{
+  static const char zero[16];
+
+  if (len <= sizeof(zero)) return memcmp(buf, zero, len) == 0;
+  return memcmp(buf, zero, sizeof(zero)) == 0
+    && memcmp(buf, buf + sizeof(zero), len - sizeof(zero)) == 0;
+}
+
+/* Gives back preallocated space of a run of zero blocks, it reads as zeros anyway */
+static void
+punch_hole(int fdf, bool b_prealloc, uint64_t i_offset, uint64_t i_len)
+{
+#if defined(__linux__) && defined(FALLOC_FL_PUNCH_HOLE)
+  if (b_prealloc && i_len >= HOLE_MIN)
+    fallocate64(fdf, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE, i_offset, i_len);
+#endif
+}
+
+static bool b_direct = false;
+
+/* Starts writeback of the output written since the last call and waits for
+   the part before, so that written data doesn't pile up in the page cache */
+static void
+write_behind(int fdf, uint64_t *pi_wb_done, uint64_t *pi_wb_start, uint64_t i_end)
+{
+#if defined(__linux__) && defined(SYNC_FILE_RANGE_WRITE)
+  if (!b_direct || i_end - *pi_wb_start < WB_WINDOW) return;
+  if (*pi_wb_start > *pi_wb_done) {
+    sync_file_range(fdf, *pi_wb_done, *pi_wb_start - *pi_wb_done,
+                    SYNC_FILE_RANGE_WAIT_BEFORE|SYNC_FILE_RANGE_WRITE|SYNC_FILE_RANGE_WAIT_AFTER);
+    posix_fadvise64(fdf, *pi_wb_done, *pi_wb_start - *pi_wb_done, POSIX_FADV_DONTNEED);
+  }
+  sync_file_range(fdf, *pi_wb_start, i_end - *pi_wb_start, SYNC_FILE_RANGE_WRITE);
+  *pi_wb_done = *pi_wb_start;
+  *pi_wb_start = i_end;
+#endif
+}
+
+static const char *psz_mapfile = NULL;
+
+/* --include/--exclude patterns, matched against paths relative to the root.
+   A directory that matches stands for everything below it. */
+static const char *psz_include[MAX_PATTERNS], *psz_exclude[MAX_PATTERNS];
+static int i_include = 0, i_exclude = 0;
+
+/* Shell style match of * ? and [...], where * also matches across / */
+static bool
+glob_match(const char *psz_pat, const char *psz)
+{
+  const char *p;
+  bool b_neg, b_hit;
+
+  for (; *psz_pat; psz_pat++, psz++) {
+    switch (*psz_pat) {
+    case '*':
+      while (*psz_pat == '*') psz_pat++;
+      if (!*psz_pat) return true;
+      for (; *psz; psz++)
+        if (glob_match(psz_pat, psz)) return true;
+      return false;
+    case '?':
+      if (!*psz) return false;
+      break;
+    case '[':
+      if (!*psz) return false;
+      p = psz_pat + 1;
+      if ((b_neg = *p == '!' || *p == '^')) p++;
+      for (b_hit = false; *p && (*p != ']' || p == psz_pat + 1 + b_neg); p++) {
+        if (p[1] == '-' && p[2] && p[2] != ']') {
+          if (*psz >= *p && *psz <= p[2]) b_hit = true;
+          p += 2;
+        } else if (*p == *psz) b_hit = true;
+      }
+      if (!*p) return *psz == '[' && glob_match(psz_pat + 1, psz + 1); /* No class, literal [ */
+      if (b_hit == b_neg) return false;
+      psz_pat = p;
+      break;
+    default:
+      if (*psz_pat != *psz) return false;
+    }
+  }
+  return !*psz;
+}
+
+/* Whether psz_path or one of the directories it is in matches one of the patterns */
+static bool
+match_path(const char **ppsz_pat, int i_pat, const char *psz_path)
+{
+  char sz_path[PATH_MAX];
+  char *p;
+  int i;
+
+  snprintf(sz_path, sizeof(sz_path), "%s", psz_path);
+  for (p = sz_path; ; p++) {
+    if (*p == '/' || !*p) {
+      char c = *p;
+
+      *p = 0;
+      for (i = 0; i < i_pat; i++)
+        if (*sz_path && glob_match(ppsz_pat[i], sz_path)) return true;
+      if (!(*p = c)) return false;
+    }
+  }
+}
+
+static bool
+file_wanted(const char *psz_dir, const char *psz_fname)
+{
+  char sz_path[PATH_MAX];
+
+  snprintf(sz_path, sizeof(sz_path), "%s%s", psz_dir, psz_fname);
+  return (!i_include || match_path(psz_include, i_include, sz_path))
+    && !match_path(psz_exclude, i_exclude, sz_path);
+}
+
+/* Whether anything below psz_dir (with trailing /) can be wanted, so that it has to be read */
+static bool
+dir_wanted(const char *psz_dir)
+{
+  size_t i_len;
+  int i;
+
+  if (match_path(psz_exclude, i_exclude, psz_dir)) return false;
+  if (!i_include || match_path(psz_include, i_include, psz_dir)) return true;
+  for (i = 0; i < i_include; i++) {
+    /* Compare up to the first wildcard of the pattern */
+    i_len = strcspn(psz_include[i], "*?[");
+    if (strncmp(psz_include[i], psz_dir, i_len < strlen(psz_dir) ? i_len : strlen(psz_dir)) == 0)
+      return true;
+  }
+  return false;
+}
+
+/* Creates psz_dir (with trailing /) below psz_dest along with the directories it is in */
+static void
+make_dirs(const char *psz_dest, const char *psz_dir)
+{
+  char sz_path[PATH_MAX];
+  char *p;
+
+  snprintf(sz_path, sizeof(sz_path), "%s/%s", psz_dest, psz_dir);
+  for (p = sz_path + strlen(psz_dest) + 1; *p; p++) {
+    if (*p == '/') {
+      *p = 0;
+      mkdir(sz_path, 0777);
+      *p = '/';
+    }
+  }
+}
+
+/* Files found by the directory walk, extracted by a pool of worker threads with -j */
+typedef struct
+{
+  udf_dirent_t *p_udf_dirent; /* Snapshot of the directory entry */
+  char         *psz_outdir;
+  uint64_t      i_size;
+} dump_job_t;
+
+static struct
+{
+  pthread_mutex_t mtx;
+  dump_job_t *p_jobs;
+  int i_jobs, i_max, i_next;
+  int i_done, i_errors;
+  uint64_t i_total, i_written;
+  time_t last_progress;
+  const char *psz_image;
+  udf_t *p_udf;
+} pool;
+static int i_threads = 0;
+
+/* Index being built during the directory walk with --index */
+static udf_index_t *p_index_new = NULL;
+
+static void
+pool_progress(uint64_t i_len)
+{
+  time_t now;
+
+  pthread_mutex_lock(&pool.mtx);
+  pool.i_written += i_len;
+  if ((now = time(NULL)) != pool.last_progress) {
+    pool.last_progress = now;
+    printf("\rExtracting file %d/%d [%03d%%]", pool.i_done, pool.i_jobs,
+           pool.i_total ? (int)((long double)pool.i_written / pool.i_total * 100) : 100);
+    fflush(stdout);
+  }
+  pthread_mutex_unlock(&pool.mtx);
+}
+
+static char *
+alloc_chunk(void)
+{
+  char *p_chunk = NULL;
+
+#ifdef O_DIRECT
+  if (posix_memalign((void **)&p_chunk, CHUNK_ALIGN, DUMP_CHUNK)) p_chunk = NULL;
+#else
+  p_chunk = malloc(DUMP_CHUNK);
+#endif
+  if (!p_chunk) fprintf(stderr, "Out of memory allocating copy buffer\n");
+  return p_chunk;
+}
+
+/* Writes the byte ranges of the file that lie in bad areas of the image to <file>.bad */
+static void
+bad_report(const char *psz_outfile, udf_dirent_t *p_udf_dirent, uint64_t i_file_length)
+{
+  char psz_report[PATH_MAX];
+  FILE *fp = NULL;
+  uint64_t i_pos, i_bad, i_bad_len, i_total = 0;
+
+  snprintf(psz_report, sizeof(psz_report), "%s.bad", psz_outfile);
+  for (i_pos = 0; udf_get_bad_range(p_udf_dirent, i_pos, i_file_length - i_pos, &i_bad, &i_bad_len);
+       i_pos = i_bad + i_bad_len) {
+    if (!fp) {
+      if (!(fp = fopen(psz_report, "w"))) {
+        fprintf(stderr, "Cannot create bad area report %s: %s\n", psz_report, strerror(errno));
+        return;
+      }
+      fprintf(fp, "# Parts of %s read from bad areas of the image, they are zero-filled\n", psz_outfile);
+      fprintf(fp, "#     pos        size\n");
+    }
+    fprintf(fp, "0x%08llX  0x%08llX\n", i_bad, i_bad_len);
+    i_total += i_bad_len;
+  }
+  if (fp) {
+    fclose(fp);
+    fprintf(stderr, "%s: %llu bytes from bad areas of the image, see %s\n", 
+            psz_outfile, i_total, psz_report);
+  }
+  else if (psz_mapfile) unlink(psz_report);
+}
+
+static int
+dump_file(char *psz_outdir, udf_dirent_t *p_udf_dirent, char *p_chunk)
 {
   char psz_outfile[PATH_MAX];
   const char *psz_local_fname = udf_get_filename(p_udf_dirent);
   int fdf;
   uint64_t i_file_length = udf_get_file_length(p_udf_dirent);
-  uint64_t i, i_blocks = CEILING(i_file_length, UDF_BLOCKSIZE), i_remain;
-  ssize_t i_read = 0;
+  uint64_t i_resume = 0, i_synced, i_offset, i_zero, i_wb_done, i_wb_start, i_wpos;
+  bool b_prealloc = false;
+  time_t mtime = udf_get_modification_time(p_udf_dirent);
+  journal_entry_t *p_ent;
+  off64_t i_size;
+  ssize_t i_read = 0, i_start, i_end;
   unsigned int perc, last_perc=-1;
 
   sprintf(psz_outfile, "%s/%s", psz_outdir, psz_local_fname);
   if (udf_is_dir(p_udf_dirent))
     return mkdir(psz_outfile, 0777);
 
-  if ((fdf = open(psz_outfile, O_WRONLY|O_CREAT|O_TRUNC|O_BINARY|O_LARGEFILE, 0666)) == -1) {
+  /* Previously extracted file is only trusted if it still is at least as big as recorded */
+  if ((p_ent = journal_find(psz_outfile)) && p_ent->mtime == mtime
+      && (i_size = file_size(psz_outfile)) >= 0) {
+    if (p_ent->b_complete && p_ent->i_size == i_file_length && i_size == i_file_length) {
+      printf("Skipping %s, already extracted\n", psz_outfile);
+      return 0;
+    }
+    /* Resume at a block boundary, the block reads of the file are positioned by i_position */
+    if (!p_ent->b_complete && p_ent->i_size < i_file_length && p_ent->i_size <= i_size)
+      i_resume = p_ent->i_size / UDF_BLOCKSIZE * UDF_BLOCKSIZE;
+  }
+
+  if ((fdf = open(psz_outfile, O_WRONLY|O_CREAT|O_BINARY|O_LARGEFILE|(i_resume?0:O_TRUNC), 0666)) == -1) {
     fprintf (stderr, "Cannot create file %s: %s\n", psz_outfile, strerror(errno));
     return -1;
   }
+  if (i_resume) {
+    /* Anything after the recorded offset may be incomplete, zero blocks aren't written again */
+    if (ftruncate64(fdf, i_resume) < 0 || lseek64(fdf, i_resume, SEEK_SET) == (off64_t)-1) {
+      fprintf (stderr, "Cannot seek in file %s: %s\n", psz_outfile, strerror(errno));
+      close(fdf);
+      return -1;
+    }
+    printf("Resuming at offset %llu\n", i_resume);
+    p_udf_dirent->i_position = i_resume;
+  }
+  bad_report(psz_outfile, p_udf_dirent, i_file_length);
+  i_synced = i_zero = i_wb_done = i_wb_start = i_resume;
+#ifdef __linux__
+  /* Reserve the whole file up front, so that it doesn't get fragmented by the block writes */
+  b_prealloc = i_file_length > 0 && fallocate64(fdf, 0, 0, i_file_length) == 0;
+#endif
 
-  for (i = 0, i_remain=i_file_length; i < i_blocks ; i++, i_remain-=i_read) {
-    char buf[UDF_BLOCKSIZE] = {0};
-    i_read = udf_read_block(p_udf_dirent, buf, 1);
+  for (i_offset = i_resume, i_wpos = i_resume; i_offset < i_file_length; i_offset += i_read) {
+    i_read = udf_read_file(p_udf_dirent, p_chunk, 
+                           i_file_length - i_offset < DUMP_CHUNK ? i_file_length - i_offset : DUMP_CHUNK);
 
-    if ((perc=(int)(((long double)i/(long double)i_blocks)*100))!=last_perc)
+    if (i_threads)
+      pool_progress(i_read > 0 ? i_read : 0);
+    else if ((perc=(int)(((long double)i_offset/(long double)i_file_length)*100))!=last_perc) {
       printf ("\rWriting file...%d%%", (last_perc=perc));
-    fflush(stdout);
-    if ( i_read < 0 ) {
+      fflush(stdout);
+    }
+    if ( i_read <= 0 ) {
       fprintf(stderr, "Error reading UDF file %s at block %llu\n",
-              psz_local_fname, i);
+              psz_local_fname, i_offset / UDF_BLOCKSIZE);
       close(fdf);
       return -2;
     }
 
-    if (i_remain<UDF_BLOCKSIZE && i_read>=i_remain) i_read=i_remain;
-    if (write (fdf, buf, i_read) != i_read) {
-      perror("Error writing data");
-      close(fdf);
-      return -3;
+    /* Blocks of zeros are not written, they are left as holes */
+    for (i_start = 0; i_start < i_read; i_start = i_end) {
+      i_end = i_start + UDF_BLOCKSIZE < i_read ? i_start + UDF_BLOCKSIZE : i_read;
+      if (is_zero(p_chunk + i_start, i_end - i_start)) continue;
+      while (i_end < i_read && !is_zero(p_chunk + i_end, 
+                                        i_end + UDF_BLOCKSIZE < i_read ? UDF_BLOCKSIZE : i_read - i_end))
+        i_end = i_end + UDF_BLOCKSIZE < i_read ? i_end + UDF_BLOCKSIZE : i_read;
+      punch_hole(fdf, b_prealloc, i_zero, i_offset + i_start - i_zero);
+      if (i_wpos != i_offset + i_start 
+          && lseek64(fdf, i_offset + i_start, SEEK_SET) == (off64_t)-1) {
+        perror("Error seeking output file");
+        close(fdf);
+        return -3;
+      }
+      if (write (fdf, p_chunk + i_start, i_end - i_start) != i_end - i_start) {
+        perror("Error writing data");
+        close(fdf);
+        return -3;
+      }
+      i_zero = i_wpos = i_offset + i_end;
     }
+    if (journal.fd != -1 && i_offset + i_read - i_synced >= JOURNAL_STEP
+        && fdatasync(fdf) == 0) {
+      i_synced = i_offset + i_read;
+      journal_write('P', i_synced, mtime, psz_outfile);
+    }
+    write_behind(fdf, &i_wb_done, &i_wb_start, i_offset + i_read);
+  }
+  punch_hole(fdf, b_prealloc, i_zero, i_file_length - i_zero);
+  /* Zero blocks at the end of the file have been skipped */
+  if (ftruncate64(fdf, i_file_length) < 0) {
+    fprintf (stderr, "Cannot truncate file %s: %s\n", psz_outfile, strerror(errno));
+    close(fdf);
+    return -3;
   }
+  if (journal.fd != -1 && fdatasync(fdf) == 0)
+    journal_write('F', i_file_length, mtime, psz_outfile);
   close(fdf);
-  printf("\r%79s\r", " ");
+  if (!i_threads) printf("\r%79s\r", " ");
+  return 0;
+}
+
+static int
+queue_job(char *psz_outdir, udf_dirent_t *p_udf_dirent)
+{
+  dump_job_t *p_job;
+
+  if (pool.i_jobs == pool.i_max) {
+    int i_max = pool.i_max ? pool.i_max * 2 : 256;
+
+    if (!(p_job = realloc(pool.p_jobs, i_max * sizeof(dump_job_t)))) {
+      fprintf(stderr, "Out of memory queueing %s\n", udf_get_filename(p_udf_dirent));
+      return -1;
+    }
+    pool.p_jobs = p_job;
+    pool.i_max = i_max;
+  }
+  p_job = &pool.p_jobs[pool.i_jobs];
+  if (!(p_job->p_udf_dirent = udf_dup_dirent(p_udf_dirent, pool.p_udf))
+      || !(p_job->psz_outdir = strdup(psz_outdir))) {
+    udf_dirent_free(p_job->p_udf_dirent);
+    fprintf(stderr, "Out of memory queueing %s\n", udf_get_filename(p_udf_dirent));
+    return -1;
+  }
+  p_job->i_size = udf_get_file_length(p_udf_dirent);
+  pool.i_total += p_job->i_size;
+  pool.i_jobs++;
+  return 0;
+}
+
+static int
+cmp_job(const void *a, const void *b)
+{
+  const dump_job_t *p_a = a, *p_b = b;
+
+  /* Biggest files first, so that the largest recording doesn't end up running alone at the end */
+  if (p_a->i_size != p_b->i_size) return p_a->i_size < p_b->i_size ? 1 : -1;
   return 0;
 }
 
+/* Every worker reads through its own descriptor, each job has its own extent cursor */
+static void *
+dump_worker(void *arg)
+{
+  udf_t *p_udf = udf_clone(pool.p_udf, pool.psz_image);
+  char *p_chunk = alloc_chunk();
+  dump_job_t *p_job;
+  int ret;
+
+  if (!p_udf || !p_chunk) {
+    if (!p_udf) fprintf(stderr, "Error opening image %s: %s\n", pool.psz_image, strerror(errno));
+    if (p_udf) udf_close(p_udf);
+    free(p_chunk);
+    return NULL;
+  }
+  for (;;) {
+    pthread_mutex_lock(&pool.mtx);
+    p_job = pool.i_next < pool.i_jobs ? &pool.p_jobs[pool.i_next++] : NULL;
+    pthread_mutex_unlock(&pool.mtx);
+    if (!p_job) break;
+
+    p_job->p_udf_dirent->p_udf = p_udf;
+    ret = dump_file(p_job->psz_outdir, p_job->p_udf_dirent, p_chunk);
+
+    pthread_mutex_lock(&pool.mtx);
+    pool.i_done++;
+    if (ret < 0) pool.i_errors++;
+    pthread_mutex_unlock(&pool.mtx);
+  }
+  free(p_chunk);
+  udf_close(p_udf);
+  return NULL;
+}
+
+static int
+run_pool(void)
+{
+  pthread_t tid[MAX_THREADS];
+  int i, i_started, i_count = i_threads < pool.i_jobs ? i_threads : pool.i_jobs;
+
+  qsort(pool.p_jobs, pool.i_jobs, sizeof(dump_job_t), cmp_job);
+  for (i = 0, i_started = 0; i < i_count; i++) {
+    if (pthread_create(&tid[i_started], NULL, dump_worker, NULL) == 0) i_started++;
+    else fprintf(stderr, "Cannot create worker thread %d\n", i);
+  }
+  if (!i_started && pool.i_jobs) {
+    fprintf(stderr, "No worker threads could be started.\n");
+    return -1;
+  }
+  for (i = 0; i < i_started; i++) pthread_join(tid[i], NULL);
+  printf("\r%-79s\r", " ");
+  /* Jobs that no worker got to count as failed */
+  printf("Extracted %d/%d files using %d threads, %d errors\n", pool.i_done - pool.i_errors,
+         pool.i_jobs, i_started, pool.i_errors + pool.i_jobs - pool.i_done);
+  for (i = 0; i < pool.i_jobs; i++) {
+    udf_dirent_free(pool.p_jobs[i].p_udf_dirent);
+    free(pool.p_jobs[i].psz_outdir);
+  }
+  free(pool.p_jobs);
+  return pool.i_errors || pool.i_done < pool.i_jobs ? -1 : 0;
+}
+
 static void 
 print_file_info(const udf_dirent_t *p_udf_dirent, const char* psz_dirname)
 {
@@ -107,62 +667,343 @@ print_file_info(const udf_dirent_t *p_udf_dirent, const char* psz_dirname)
 }
 
 static udf_dirent_t *
-list_files(udf_t *p_udf, udf_dirent_t *p_udf_dirent, const char *psz_path, const char *psz_dest)
+list_files(udf_t *p_udf, udf_dirent_t *p_udf_dirent, const char *psz_path, const char *psz_dest,
+           char *p_chunk)
 {
   char sz_path[PATH_MAX], sz_newpath[PATH_MAX];
 
   if (!p_udf_dirent) return NULL;
   
   print_file_info(p_udf_dirent, psz_path);
+  if (p_index_new && !udf_index_add(p_index_new, p_udf_dirent, psz_path)) {
+    fprintf(stderr, "Out of memory indexing %s, no index is saved\n", psz_path);
+    udf_index_free(p_index_new);
+    p_index_new = NULL;
+  }
 
   while (udf_readdir(p_udf_dirent)) {
 
     if (psz_dest) snprintf(sz_path, sizeof(sz_path), "%s/%s", psz_dest, psz_path?psz_path:"/");
     if (udf_is_dir(p_udf_dirent)) {     
-      udf_dirent_t *p_udf_dirent2 = udf_opendir(p_udf_dirent);
+      udf_dirent_t *p_udf_dirent2;
       if (psz_dest) mkdir(sz_path, 0777);
-      if (p_udf_dirent2) {
-        snprintf(sz_newpath, sizeof(sz_newpath), "%s%s/", psz_path, udf_get_filename(p_udf_dirent));
-        list_files(p_udf, p_udf_dirent2, sz_newpath, psz_dest);
-      }
-    } else {
+      snprintf(sz_newpath, sizeof(sz_newpath), "%s%s/", psz_path, udf_get_filename(p_udf_dirent));
+      if (dir_wanted(sz_newpath) && (p_udf_dirent2 = udf_opendir(p_udf_dirent)))
+        list_files(p_udf, p_udf_dirent2, sz_newpath, psz_dest, p_chunk);
+    } else if (file_wanted(psz_path, udf_get_filename(p_udf_dirent))) {
       print_file_info(p_udf_dirent, psz_path);
-      if (psz_dest) dump_file(sz_path, p_udf_dirent);
+      if (p_index_new && !udf_index_add(p_index_new, p_udf_dirent, psz_path)) {
+        fprintf(stderr, "Out of memory indexing %s, no index is saved\n", udf_get_filename(p_udf_dirent));
+        udf_index_free(p_index_new);
+        p_index_new = NULL;
+      }
+      if (psz_dest && i_threads) queue_job(sz_path, p_udf_dirent);
+      else if (psz_dest) dump_file(sz_path, p_udf_dirent, p_chunk);
     }
   }
   return p_udf_dirent;
 }
 
+/* Same as list_files, but the tree comes from the index instead of the image */
+static void
+list_index(udf_t *p_udf, const udf_index_t *p_index, const char *psz_dest, char *p_chunk)
+{
+  char sz_path[PATH_MAX];
+  const char *psz_dir;
+  udf_dirent_t *p_udf_dirent;
+  int i;
+
+  for (i = 0; i < udf_index_count(p_index); i++) {
+    if (!(p_udf_dirent = udf_index_dirent(p_index, i, p_udf, &psz_dir))) {
+      fprintf(stderr, "Out of memory reading index entry %d\n", i);
+      continue;
+    }
+    if (udf_is_dir(p_udf_dirent) ? !dir_wanted(psz_dir)
+        : !file_wanted(psz_dir, udf_get_filename(p_udf_dirent))) {
+      udf_dirent_free(p_udf_dirent);
+      continue;
+    }
+    print_file_info(p_udf_dirent, psz_dir);
+    if (psz_dest) {
+      snprintf(sz_path, sizeof(sz_path), "%s/%s", psz_dest, psz_dir);
+      if (udf_is_dir(p_udf_dirent)) mkdir(sz_path, 0777);
+      else if (i_threads) queue_job(sz_path, p_udf_dirent);
+      else dump_file(sz_path, p_udf_dirent, p_chunk);
+    }
+    udf_dirent_free(p_udf_dirent);
+  }
+}
+
+/* Extracts files and directories given by --include without wildcards,
+   by looking up their paths instead of walking the whole tree */
+static void
+list_named(udf_t *p_udf, udf_dirent_t *p_udf_root, const char *psz_dest, char *p_chunk)
+{
+  char sz_dir[PATH_MAX], sz_path[PATH_MAX];
+  const char *psz_name, *psz_slash;
+  udf_dirent_t *p_udf_dirent;
+  int i;
+
+  for (i = 0; i < i_include; i++) {
+    psz_name = psz_include[i];
+    if (!(p_udf_dirent = udf_fopen(p_udf_root, psz_name))) {
+      fprintf(stderr, "%s not found\n", psz_include[i]);
+      continue;
+    }
+    if (udf_is_dir(p_udf_dirent)) {
+      snprintf(sz_dir, sizeof(sz_dir), "%s%s", psz_name, *psz_name ? "/" : "");
+      if (dir_wanted(sz_dir)) {
+        if (psz_dest) make_dirs(psz_dest, sz_dir);
+        /* Reading the directory to its end frees it */
+        list_files(p_udf, p_udf_dirent, sz_dir, psz_dest, p_chunk);
+        continue;
+      }
+    } else {
+      psz_slash = strrchr(psz_name, '/');
+      snprintf(sz_dir, sizeof(sz_dir), "%.*s", psz_slash ? (int)(psz_slash - psz_name + 1) : 0, psz_name);
+      if (file_wanted(sz_dir, udf_get_filename(p_udf_dirent))) {
+        print_file_info(p_udf_dirent, sz_dir);
+        if (psz_dest) {
+          make_dirs(psz_dest, sz_dir);
+          snprintf(sz_path, sizeof(sz_path), "%s/%s", psz_dest, sz_dir);
+          if (i_threads) queue_job(sz_path, p_udf_dirent);
+          else dump_file(sz_path, p_udf_dirent, p_chunk);
+        }
+      }
+    }
+    udf_dirent_free(p_udf_dirent);
+  }
+}
+
+typedef struct
+{
+  udf_dirent_t       *p_udf_dirent;
+  const udf_extent_t *p_extents;
+  int                 i_extents;
+  uint64_t            i_size;
+  lba_t               i_lba;      /* Of the file entry */
+} orphan_t;
+
+/* Biggest first, file entries with the same data next to each other */
+static int
+cmp_orphan(const void *a, const void *b)
+{
+  const orphan_t *p_a = a, *p_b = b;
+  int i;
+
+  if (p_a->i_size != p_b->i_size) return p_a->i_size < p_b->i_size ? 1 : -1;
+  if (p_a->i_extents != p_b->i_extents) return p_a->i_extents - p_b->i_extents;
+  for (i = 0; i < p_a->i_extents; i++) {
+    if (p_a->p_extents[i].i_lba != p_b->p_extents[i].i_lba)
+      return p_a->p_extents[i].i_lba < p_b->p_extents[i].i_lba ? -1 : 1;
+    if (p_a->p_extents[i].i_len != p_b->p_extents[i].i_len)
+      return p_a->p_extents[i].i_len < p_b->p_extents[i].i_len ? -1 : 1;
+  }
+  return p_a->i_lba < p_b->i_lba ? -1 : (p_a->i_lba > p_b->i_lba);
+}
+
+static int
+cmp_block(const void *a, const void *b)
+{
+  const lba_t *p_a = a, *p_b = b;
+
+  return *p_a < *p_b ? -1 : (*p_a > *p_b);
+}
+
+/*
+  Extracts what the sweep of --orphans found. A directory that no other
+  one that was found lists becomes DIR_<block> with all its contents
+  under their names. A file that no directory lists becomes
+  FILE_<block>.DAT, once for every distinct size and extent layout, as
+  stale copies of a file entry point to the same data.
+*/
+static void
+list_orphans(udf_t *p_udf, const lba_t *p_lba, int i_count, const char *psz_dest, char *p_chunk)
+{
+  char sz_name[32], sz_path[PATH_MAX];
+  bool *p_listed = calloc(i_count, sizeof(bool));
+  orphan_t *p_orphans = calloc(i_count, sizeof(orphan_t));
+  udf_dirent_t *p_udf_dirent;
+  lba_t i_child, *p_found;
+  int i, i_orphans = 0;
+
+  if (!p_listed || !p_orphans) {
+    fprintf(stderr, "Out of memory sorting %d file entries\n", i_count);
+    free(p_listed);
+    free(p_orphans);
+    return;
+  }
+  for (i = 0; i < i_count; i++) {
+    if (!(p_udf_dirent = udf_get_fe_dirent(p_udf, p_lba[i], "")) || !udf_is_dir(p_udf_dirent)) {
+      udf_dirent_free(p_udf_dirent);
+      continue;
+    }
+    while (udf_readdir(p_udf_dirent)) {
+      i_child = p_udf->i_part_start + udf_fid_lba(p_udf_dirent->fid);
+      if (!p_udf_dirent->b_parent
+          && (p_found = bsearch(&i_child, p_lba, i_count, sizeof(lba_t), cmp_block)))
+        p_listed[p_found - p_lba] = true;
+    }
+  }
+
+  for (i = 0; i < i_count; i++) {
+    if (p_listed[i]) continue;
+    snprintf(sz_name, sizeof(sz_name), "DIR_%u", (unsigned)p_lba[i]);
+    if (!(p_udf_dirent = udf_get_fe_dirent(p_udf, p_lba[i], sz_name))) continue;
+    if (udf_is_dir(p_udf_dirent)) {
+      strcat(sz_name, "/");
+      if (dir_wanted(sz_name)) {
+        if (psz_dest) make_dirs(psz_dest, sz_name);
+        list_files(p_udf, p_udf_dirent, sz_name, psz_dest, p_chunk);
+      } else
+        udf_dirent_free(p_udf_dirent);
+    } else {
+      snprintf(sz_name, sizeof(sz_name), "FILE_%u.DAT", (unsigned)p_lba[i]);
+      udf_dirent_free(p_udf_dirent);
+      if (!file_wanted("", sz_name)
+          || !(p_udf_dirent = udf_get_fe_dirent(p_udf, p_lba[i], sz_name))) continue;
+      p_orphans[i_orphans].p_udf_dirent = p_udf_dirent;
+      p_orphans[i_orphans].i_size = udf_get_file_length(p_udf_dirent);
+      p_orphans[i_orphans].i_lba = p_lba[i];
+      if ((p_orphans[i_orphans].i_extents = 
+           udf_get_extents(p_udf_dirent, &p_orphans[i_orphans].p_extents)) < 0)
+        p_orphans[i_orphans].i_extents = 0;
+      i_orphans++;
+    }
+  }
+
+  qsort(p_orphans, i_orphans, sizeof(orphan_t), cmp_orphan);
+  if (psz_dest) snprintf(sz_path, sizeof(sz_path), "%s/", psz_dest);
+  for (i = 0; i < i_orphans; i++) {
+    p_udf_dirent = p_orphans[i].p_udf_dirent;
+    if (i && p_orphans[i].i_size == p_orphans[i-1].i_size
+        && p_orphans[i].i_extents == p_orphans[i-1].i_extents
+        && !memcmp(p_orphans[i].p_extents, p_orphans[i-1].p_extents,
+                   p_orphans[i].i_extents * sizeof(udf_extent_t))) {
+      printf("%s has the same data as %s\n", udf_get_filename(p_udf_dirent),
+             udf_get_filename(p_orphans[i-1].p_udf_dirent));
+      continue;
+    }
+    print_file_info(p_udf_dirent, "");
+    if (psz_dest && i_threads) queue_job(sz_path, p_udf_dirent);
+    else if (psz_dest) dump_file(sz_path, p_udf_dirent, p_chunk);
+  }
+  for (i = 0; i < i_orphans; i++) udf_dirent_free(p_orphans[i].p_udf_dirent);
+  free(p_orphans);
+  free(p_listed);
+}
+
 int
 main(int argc, const char *argv[])
 {
   udf_t *p_udf;
+  udf_index_t *p_index = NULL;
+  lba_t *p_orphans = NULL;
+  bool b_resume = false, b_index = false, b_orphans = false, b_named;
+  char *p_chunk = NULL;
+  int as = 1, ret = 0, i, i_orphans = 0;
 
   printf ("udf_dump V1.0 - (c) leecher@dose.0wnz.at, 2015\n\n");
-  if (argc < 2) 
+  for (; as < argc && argv[as][0] == '-'; as++) {
+    if (strcmp(argv[as], "--resume") == 0) b_resume = true;
+    else if (strcmp(argv[as], "--direct") == 0) b_direct = true;
+    else if (strcmp(argv[as], "--index") == 0) b_index = true;
+    else if (strcmp(argv[as], "--orphans") == 0) b_orphans = true;
+    else if (strcmp(argv[as], "--mapfile") == 0 && as + 1 < argc) psz_mapfile = argv[++as];
+    else if (strcmp(argv[as], "--include") == 0 && as + 1 < argc && i_include < MAX_PATTERNS) {
+      as++;
+      psz_include[i_include++] = argv[as][strspn(argv[as], "/")] ? argv[as] + strspn(argv[as], "/") : "*";
+    }
+    else if (strcmp(argv[as], "--exclude") == 0 && as + 1 < argc && i_exclude < MAX_PATTERNS) {
+      as++;
+      psz_exclude[i_exclude++] = argv[as][strspn(argv[as], "/")] ? argv[as] + strspn(argv[as], "/") : "*";
+    }
+    else if (strncmp(argv[as], "-j", 2) == 0 && argv[as][2]) {
+      i_threads = atoi(argv[as] + 2);
+      if (i_threads < 1) i_threads = 1;
+      if (i_threads > MAX_THREADS) i_threads = MAX_THREADS;
+    }
+    else break;
+  }
+  if (argc - as < 1 || argv[as][0] == '-') 
   {
-    printf ("Usage: %s <UDF image> [Dest dir]\n", argv[0]);
+    printf ("Usage: %s [-j<Threads>] [--resume] [--direct] [--index] [--orphans] [--mapfile <Mapfile>] [--include <Pattern>] [--exclude <Pattern>] <UDF image> [Dest dir]\n", argv[0]);
+    printf ("\t-j\tExtract files in parallel with this many threads, i.e.: -j4\n");
+    printf ("\t--resume\tContinue an interrupted extraction, skip files that are already complete\n");
+    printf ("\t--direct\tRead with O_DIRECT, bypassing the page cache\n");
+    printf ("\t--index\tUse the tree saved by an earlier run instead of reading the metadata, save it if there is none\n");
+    printf ("\t--orphans\tFor a damaged filesystem: sweep the image for file entries and extract what they describe\n");
+    printf ("\t--mapfile\tddrescue mapfile of the image, bad areas are not read and get reported per file\n");
+    printf ("\t--include\tOnly extract files and directories matching the pattern, i.e.: --include 'DVD_RTAV/*.IFO'\n");
+    printf ("\t--exclude\tDon't extract files and directories matching the pattern\n");
     return 1;
   }
 
-  p_udf = udf_open (argv[1]);
+  if (b_orphans)
+    p_udf = udf_open_sweep (argv[as], psz_mapfile, b_direct, i_threads ? i_threads : SWEEP_THREADS,
+                            &p_orphans, &i_orphans);
+  else if (b_index && (p_index = udf_index_load (argv[as])))
+    p_udf = udf_open_index (argv[as], p_index, psz_mapfile, b_direct);
+  else if (psz_mapfile)
+    p_udf = udf_open_mapfile (argv[as], psz_mapfile, b_direct);
+  else
+    p_udf = b_direct ? udf_open_direct (argv[as]) : udf_open (argv[as]);
   
   if (NULL == p_udf) {
-    fprintf(stderr, "Sorry, couldn't open %s as something using UDF\n", 
-	    argv[1]);
+    fprintf(stderr, "Sorry, couldn't open %s as something using UDF%s\n", 
+	    argv[as], b_orphans ? "" : ", try --orphans");
     return 1;
   } else {
-    udf_dirent_t *p_udf_root = udf_get_root(p_udf);
-    if (NULL == p_udf_root) {
-      fprintf(stderr, "Sorry, couldn't find / in %s\n", 
-	      argv[1]);
+    udf_dirent_t *p_udf_root = p_index || p_orphans ? NULL : udf_get_root(p_udf);
+    if (NULL == p_udf_root && !p_index && !p_orphans) {
+      fprintf(stderr, "Sorry, couldn't find / in %s, try --orphans\n", 
+	      argv[as]);
       return 1;
     }
+    if (b_index && p_orphans)
+      printf("No index is saved for a sweep\n");
+    else if (b_index && !p_index && (i_include || i_exclude))
+      printf("No index is saved for part of the tree\n");
+    else if (b_index && !p_index && !(p_index_new = udf_index_new(p_udf)))
+      fprintf(stderr, "Out of memory, no index is saved\n");
     
-    list_files(p_udf, p_udf_root, "", argc>2?argv[2]:NULL);
+    if (argc > as + 1) {
+      journal_open(argv[as + 1], b_resume);
+      if (i_threads) {
+        pthread_mutex_init(&pool.mtx, NULL);
+        pool.psz_image = argv[as];
+        pool.p_udf = p_udf;
+      } else if (!(p_chunk = alloc_chunk()))
+        return 1;
+    }
+    /* Paths without wildcards are looked up, which reads only the directories on their way */
+    for (i = 0, b_named = i_include > 0; i < i_include; i++)
+      if (psz_include[i][strcspn(psz_include[i], "*?[")]) b_named = false;
+    if (p_orphans)
+      list_orphans(p_udf, p_orphans, i_orphans, argc>as+1?argv[as+1]:NULL, p_chunk);
+    else if (p_index)
+      list_index(p_udf, p_index, argc>as+1?argv[as+1]:NULL, p_chunk);
+    else if (b_named) {
+      list_named(p_udf, p_udf_root, argc>as+1?argv[as+1]:NULL, p_chunk);
+      udf_dirent_free(p_udf_root);
+    }
+    else
+      list_files(p_udf, p_udf_root, "", argc>as+1?argv[as+1]:NULL, p_chunk);
+    if (p_index_new) {
+      udf_index_save(p_index_new, argv[as]);
+      udf_index_free(p_index_new);
+    }
+    if (argc > as + 1 && i_threads) {
+      ret = run_pool();
+      pthread_mutex_destroy(&pool.mtx);
+    }
+    journal_close();
+    free(p_chunk);
+    udf_index_free(p_index);
+    free(p_orphans);
   }
   
   udf_close(p_udf);
-  return 0;
+  return ret ? 1 : 0;
 }
 
@@ -30,6 +30,7 @@
 #endif
 
 #include <stdio.h>  /* Remove when adding cdio/logging.h */
+#include <stdlib.h>
 
 /* Useful defines */
 
@@ -107,109 +108,182 @@ udf_is_dir(const udf_dirent_t *p_udf_dirent)
 }
 
 /*
- * Translate a file offset into a logical block and then into a physical
- * block.
+ * Decodes the allocation descriptors into a table of extents with the
+ * file offset each one starts at, so that lookups don't have to walk
+ * them from the first one. Built on first use, udf_readdir drops it.
  */
-static lba_t
-offset_to_lba(const udf_dirent_t *p_udf_dirent, off_t i_offset, 
-	      /*out*/ lba_t *pi_lba, /*out*/ uint32_t *pi_max_size)
+static bool
+build_extents(udf_dirent_t *p_udf_dirent)
 {
   udf_t *p_udf = p_udf_dirent->p_udf;
   const udf_file_entry_t *p_udf_fe = (udf_file_entry_t *) 
     p_udf_dirent->fe;
   const udf_icbtag_t *p_icb_tag = &p_udf_fe->icb_tag;
   const uint16_t strat_type= uint16_from_le(p_icb_tag->strat_type);
+  const uint32_t i_alloc_descs = uint32_from_le(p_udf_fe->i_alloc_descs);
+  uint16_t addr_ilk;
+  int ad_offset, ad_size, ad_num;
+  uint32_t icblen;
+  lba_t lsector;
+  uint64_t i_offset = 0;
+  udf_extent_t *p_extent;
   
   switch (strat_type) {
   case 4096:
     printf("Cannot deal with strategy4096 yet!\n");
-    return CDIO_INVALID_LBA;
-    break;
+    return false;
   case ICBTAG_STRATEGY_TYPE_4:
-    {
-      uint32_t icblen = 0;
-      lba_t lsector;
-      int ad_offset, ad_num = 0;
-      uint16_t addr_ilk = uint16_from_le(p_icb_tag->flags&ICBTAG_FLAG_AD_MASK);
-      
-      switch (addr_ilk) {
-      case ICBTAG_FLAG_AD_SHORT: 
-	{
-	  udf_short_ad_t *p_icb;
-	  /*
-	   * The allocation descriptor field is filled with short_ad's.
-	   * If the offset is beyond the current extent, look for the
-	   * next extent.
-	   */
-	  do {
-	    i_offset -= icblen;
-	    ad_offset = sizeof(udf_short_ad_t) * ad_num;
-	    if (ad_offset > uint32_from_le(p_udf_fe->i_alloc_descs)) {
-	      printf("File offset out of bounds\n");
-	      return CDIO_INVALID_LBA;
-	    }
-	    p_icb = (udf_short_ad_t *) 
-	      GETICB( uint32_from_le(p_udf_fe->i_extended_attr) 
-		      + ad_offset );
-	    icblen = p_icb->len;
-	    ad_num++;
-	  } while(i_offset >= icblen);
-	  
-	  lsector = (i_offset / UDF_BLOCKSIZE) + p_icb->pos;
-	  
-	  *pi_max_size = p_icb->len;
-	}
-	break;
-      case ICBTAG_FLAG_AD_LONG: 
-	{
-	  /*
-	   * The allocation descriptor field is filled with long_ad's
-	   * If the i_offset is beyond the current extent, look for the
-	   * next extent.
-	   */
-	  udf_long_ad_t *p_icb;
-	  do {
-	    i_offset -= icblen;
-	    ad_offset = sizeof(udf_long_ad_t) * ad_num;
-	    if (ad_offset > uint32_from_le(p_udf_fe->i_alloc_descs)) {
-	      printf("File offset out of bounds\n");
-	      return CDIO_INVALID_LBA;
-	    }
-	    p_icb = (udf_long_ad_t *) 
-	      GETICB( uint32_from_le(p_udf_fe->i_extended_attr)
-		      + ad_offset );
-	    icblen = p_icb->len;
-	    ad_num++;
-	  } while(i_offset >= icblen);
-	
-	  lsector = (i_offset / UDF_BLOCKSIZE) +
-	    uint32_from_le(((udf_long_ad_t *)(p_icb))->loc.lba);
-	  
-	  *pi_max_size = p_icb->len;
-	}
-	break;
-      case ICBTAG_FLAG_AD_IN_ICB:
-	/*
-	 * This type means that the file *data* is stored in the
-	 * allocation descriptor field of the file entry.
-	 */
-	*pi_max_size = 0;
-	printf("Don't know how to data in ICB handle yet\n");
-	
-      case ICBTAG_FLAG_AD_EXTENDED:
-	printf("Don't know how to handle extended addresses yet\n");
-      default:
-	printf("Unsupported allocation descriptor %d\n", addr_ilk);
-	return CDIO_INVALID_LBA;
-      }
-      
-      *pi_lba = lsector + p_udf->i_part_start;
-      return *pi_lba;
-    }
+    break;
   default:
     printf("Unknown strategy type %d\n", strat_type);
-    return DRIVER_OP_ERROR;
+    return false;
+  }
+
+  addr_ilk = uint16_from_le(p_icb_tag->flags&ICBTAG_FLAG_AD_MASK);
+  switch (addr_ilk) {
+  case ICBTAG_FLAG_AD_SHORT: 
+    ad_size = sizeof(udf_short_ad_t);
+    break;
+  case ICBTAG_FLAG_AD_LONG: 
+    ad_size = sizeof(udf_long_ad_t);
+    break;
+  case ICBTAG_FLAG_AD_IN_ICB:
+    /*
+     * This type means that the file *data* is stored in the
+     * allocation descriptor field of the file entry.
+     */
+    printf("Don't know how to data in ICB handle yet\n");
+    
+  case ICBTAG_FLAG_AD_EXTENDED:
+    printf("Don't know how to handle extended addresses yet\n");
+  default:
+    printf("Unsupported allocation descriptor %d\n", addr_ilk);
+    return false;
+  }
+
+  p_udf_dirent->i_extents = 0;
+  for (ad_num = 0; (ad_offset = ad_size * ad_num) + ad_size <= i_alloc_descs; ad_num++) {
+    if (addr_ilk == ICBTAG_FLAG_AD_SHORT) {
+      udf_short_ad_t *p_icb = (udf_short_ad_t *) 
+	GETICB( uint32_from_le(p_udf_fe->i_extended_attr) + ad_offset );
+      icblen = p_icb->len;
+      lsector = p_icb->pos;
+    } else {
+      udf_long_ad_t *p_icb = (udf_long_ad_t *) 
+	GETICB( uint32_from_le(p_udf_fe->i_extended_attr) + ad_offset );
+      icblen = p_icb->len;
+      lsector = uint32_from_le(p_icb->loc.lba);
+    }
+    if (!icblen) continue;
+
+    if (p_udf_dirent->i_extents == p_udf_dirent->i_extents_alloc) {
+      int i_alloc = p_udf_dirent->i_extents_alloc ? 
+	p_udf_dirent->i_extents_alloc * 2 : 16;
+      if (!(p_extent = realloc(p_udf_dirent->p_extents, i_alloc * sizeof(udf_extent_t))))
+	return false;
+      p_udf_dirent->p_extents = p_extent;
+      p_udf_dirent->i_extents_alloc = i_alloc;
+    }
+    p_extent = &p_udf_dirent->p_extents[p_udf_dirent->i_extents++];
+    p_extent->i_offset = i_offset;
+    p_extent->i_len = icblen;
+    p_extent->i_lba = lsector + p_udf->i_part_start;
+    i_offset += icblen;
   }
+  p_udf_dirent->i_extent_cur = 0;
+  p_udf_dirent->b_extents = true;
+  return true;
+}
+
+/* Decodes the extents of p_udf_dirent if needed, returns their number or -1 */
+int
+udf_get_extents(udf_dirent_t *p_udf_dirent, const udf_extent_t **pp_extents)
+{
+  if (!p_udf_dirent->b_extents && !build_extents(p_udf_dirent)) return -1;
+  *pp_extents = p_udf_dirent->p_extents;
+  return p_udf_dirent->i_extents;
+}
+
+/* Gives p_udf_dirent a copy of p_extents instead of decoding its descriptors */
+bool
+udf_set_extents(udf_dirent_t *p_udf_dirent, const udf_extent_t *p_extents, int i_extents)
+{
+  udf_extent_t *p_copy = NULL;
+
+  if (i_extents && !(p_copy = malloc(i_extents * sizeof(udf_extent_t)))) return false;
+  if (i_extents) memcpy(p_copy, p_extents, i_extents * sizeof(udf_extent_t));
+  free(p_udf_dirent->p_extents);
+  p_udf_dirent->p_extents = p_copy;
+  p_udf_dirent->i_extents = p_udf_dirent->i_extents_alloc = i_extents;
+  p_udf_dirent->i_extent_cur = 0;
+  p_udf_dirent->b_extents = true;
+  return true;
+}
+
+/*
+ * Finds the extent that contains file offset i_offset. Sequential reads
+ * stay in the current extent or move on to the next one, anything else
+ * is a binary search. Returns -1 if the offset is beyond the last one.
+ */
+static int
+find_extent(udf_dirent_t *p_udf_dirent, uint64_t i_offset)
+{
+  const udf_extent_t *p_extent = p_udf_dirent->p_extents;
+  int i = p_udf_dirent->i_extent_cur, lo = 0, hi = p_udf_dirent->i_extents;
+
+  if (!p_udf_dirent->b_extents && !build_extents(p_udf_dirent)) return -1;
+  p_extent = p_udf_dirent->p_extents;
+  for (; i < p_udf_dirent->i_extents && i <= p_udf_dirent->i_extent_cur + 1; i++)
+    if (i_offset >= p_extent[i].i_offset 
+	&& i_offset - p_extent[i].i_offset < p_extent[i].i_len)
+      return p_udf_dirent->i_extent_cur = i;
+  for (hi = p_udf_dirent->i_extents; lo < hi; ) {
+    i = (lo + hi) / 2;
+    if (p_extent[i].i_offset + p_extent[i].i_len <= i_offset) lo = i + 1;
+    else hi = i;
+  }
+  if (lo == p_udf_dirent->i_extents) return -1;
+  return p_udf_dirent->i_extent_cur = lo;
+}
+
+/*!
+  Finds the first part of the file range i_offset..i_offset+i_len that
+  lies in a bad area of the image, going through it extent by extent.
+*/
+bool
+udf_get_bad_range(udf_dirent_t *p_udf_dirent, uint64_t i_offset,
+		  uint64_t i_len, /*out*/ uint64_t *pi_bad_offset,
+		  /*out*/ uint64_t *pi_bad_len)
+{
+  const udf_badmap_t *p_map = p_udf_dirent->p_udf->p_badmap;
+  const udf_extent_t *p_extent;
+  uint64_t i_end = i_offset + i_len, i_extent_end, i_bad_pos, i_image_pos;
+  int i;
+
+  if (!p_map) return false;
+  for (; i_offset < i_end; i_offset = i_extent_end) {
+    if ((i = find_extent(p_udf_dirent, i_offset)) < 0) return false;
+    p_extent = &p_udf_dirent->p_extents[i];
+    i_extent_end = MIN(p_extent->i_offset + p_extent->i_len, i_end);
+    i_image_pos = (uint64_t)p_extent->i_lba * UDF_BLOCKSIZE + (i_offset - p_extent->i_offset);
+    if (udf_map_bad(p_map, i_image_pos, i_extent_end - i_offset, &i_bad_pos, pi_bad_len)) {
+      *pi_bad_offset = i_offset + (i_bad_pos - i_image_pos);
+      /* Continues into the following extents as long as they are bad from their start */
+      while (*pi_bad_offset + *pi_bad_len == i_extent_end && i_extent_end < i_end
+	     && (i = find_extent(p_udf_dirent, i_extent_end)) >= 0) {
+	p_extent = &p_udf_dirent->p_extents[i];
+	i_offset = i_extent_end;
+	i_extent_end = MIN(p_extent->i_offset + p_extent->i_len, i_end);
+	i_image_pos = (uint64_t)p_extent->i_lba * UDF_BLOCKSIZE;
+	if (!udf_map_bad(p_map, i_image_pos, i_extent_end - i_offset, &i_bad_pos, &i_len)
+	    || i_bad_pos != i_image_pos)
+	  break;
+	*pi_bad_len += i_len;
+      }
+      return true;
+    }
+  }
+  return false;
 }
 
 /**
@@ -227,28 +301,55 @@ offset_to_lba(const udf_dirent_t *p_udf_dirent, off_t i_offset,
 ssize_t
 udf_read_block(udf_dirent_t *p_udf_dirent, void * buf, size_t count)
 {
-  if (count == 0) return 0;
-  else {
-    driver_return_code_t ret;
-    uint32_t i_max_size=0;
-    udf_t *p_udf = p_udf_dirent->p_udf;
-    lba_t i_lba = offset_to_lba(p_udf_dirent, p_udf_dirent->i_position, &i_lba, 
-				&i_max_size);
-    if (i_lba != CDIO_INVALID_LBA) {
-      uint32_t i_max_blocks = CEILING(i_max_size, UDF_BLOCKSIZE);
-      if ( i_max_blocks < count ) {
-	printf("Warning: don't know how to handle yet\n" );
-	count = i_max_blocks;
-      }
-      ret = udf_read_sectors(p_udf, buf, i_lba, count);
-      if (DRIVER_OP_SUCCESS == ret) {
-	ssize_t i_read_len = MIN(i_max_size, count * UDF_BLOCKSIZE);
-	p_udf_dirent->i_position += i_read_len;
-	return i_read_len;
+  return udf_read_file(p_udf_dirent, buf, count * UDF_BLOCKSIZE);
+}
+
+/**
+  Reads up to count bytes of the file from the current position on into
+  buf, going across extent boundaries. Extents that follow each other in
+  the image are read with a single request. Returns the number of bytes
+  read, which is less than count only at the end of the file.
+*/
+ssize_t
+udf_read_file(udf_dirent_t *p_udf_dirent, void *buf, size_t count)
+{
+  const uint64_t i_file_length = udf_get_file_length(p_udf_dirent);
+  const udf_extent_t *p_extent;
+  uint64_t i_pos = p_udf_dirent->i_position, i_image, i_run_image = 0;
+  size_t i_done = 0, i_run = 0, i_len;
+  uint8_t *p_buf = buf;
+  int i;
+
+  if (i_pos >= i_file_length) return 0;
+  if (count > i_file_length - i_pos) count = i_file_length - i_pos;
+  while (i_done + i_run < count) {
+    if ((i = find_extent(p_udf_dirent, i_pos + i_run)) < 0) {
+      printf("File offset out of bounds\n");
+      break;
+    }
+    p_extent = &p_udf_dirent->p_extents[i];
+    i_image = (uint64_t)p_extent->i_lba * UDF_BLOCKSIZE 
+      + (i_pos + i_run - p_extent->i_offset);
+    i_len = MIN(p_extent->i_offset + p_extent->i_len - (i_pos + i_run), 
+		count - i_done - i_run);
+    if (i_run && i_image != i_run_image + i_run) {
+      if (udf_read_image(p_udf_dirent->p_udf, p_buf + i_done, i_run_image, i_run)
+	  != DRIVER_OP_SUCCESS) {
+	i_run = 0;
+	break;
       }
-      return ret;
-    } else {
-      return DRIVER_OP_ERROR;
+      i_done += i_run;
+      i_pos += i_run;
+      i_run = 0;
     }
+    if (!i_run) i_run_image = i_image;
+    i_run += i_len;
+  }
+  if (i_run && udf_read_image(p_udf_dirent->p_udf, p_buf + i_done, i_run_image, i_run)
+      == DRIVER_OP_SUCCESS) {
+    i_done += i_run;
+    i_pos += i_run;
   }
+  p_udf_dirent->i_position = i_pos;
+  return i_done ? (ssize_t)i_done : DRIVER_OP_ERROR;
 }
@@ -45,12 +45,22 @@
  */
 
 #define _LARGEFILE64_SOURCE
+#ifdef __linux__
+#define _GNU_SOURCE /* O_DIRECT */
+#endif
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <errno.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
 
 #ifndef O_LARGEFILE
 #define O_LARGEFILE 0
@@ -58,6 +68,15 @@
 #ifndef O_BINARY
 #define O_BINARY 0
 #endif
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#ifdef WIN32
+/* MinGW has no pread, the image is only read from one thread anyway */
+static ssize_t pread64(int fd, void *buf, size_t count, off64_t offset)
+{
+  if (lseek64(fd, offset, SEEK_SET) == (off64_t)-1) return -1;
+  return read(fd, buf, count);
+}
+#endif
 
 /* These definitions are also to make debugging easy. Note that they
    have to come *before* #include <cdio/ecma_167.h> which sets 
@@ -111,10 +130,6 @@
  *								|-->File data
  */
 
-static udf_dirent_t *
-udf_new_dirent(udf_file_entry_t *p_udf_fe, udf_t *p_udf,
-	       const char *psz_name, bool b_dir, bool b_parent);
-
 /**
  * Check the descriptor tag for both the correct id and correct checksum.
  * Return zero if all is good, -1 if not.
@@ -190,75 +205,6 @@ udf_get_lba(const udf_file_entry_t *p_udf_fe,
   return false;
 }
 
-#define udf_PATH_DELIMITERS "/\\"
-
-/* Searches p_udf_dirent a directory entry called psz_token.
-   Note p_udf_dirent is continuously updated. If the entry is
-   not found p_udf_dirent is useless and thus the caller should
-   not use it afterwards.
-*/
-static 
-udf_dirent_t *
-udf_ff_traverse(udf_dirent_t *p_udf_dirent, char *psz_token)
-{
-  while (udf_readdir(p_udf_dirent)) {
-    if (strcmp(psz_token, p_udf_dirent->psz_name) == 0) {
-      char *next_tok = strtok(NULL, udf_PATH_DELIMITERS);
-      
-      if (!next_tok)
-	return p_udf_dirent; /* found */
-      else if (p_udf_dirent->b_dir) {
-	udf_dirent_t * p_udf_dirent2 = udf_opendir(p_udf_dirent);
-	
-	if (p_udf_dirent2) {
-	  udf_dirent_t * p_udf_dirent3 = 
-	    udf_ff_traverse(p_udf_dirent2, next_tok);
-
-	  /* if p_udf_dirent3 is null p_udf_dirent2 is free'd. */
-	  return p_udf_dirent3;
-	}
-      }
-    }
-  }
-  free(p_udf_dirent->psz_name);
-  return NULL;
-}
-
-/* FIXME! */
-#define udf_MAX_PATHLEN 2048
-
-udf_dirent_t * 
-udf_fopen(udf_dirent_t *p_udf_root, const char *psz_name)
-{
-  udf_dirent_t *p_udf_file = NULL;
-  
-  if (p_udf_root) {
-    char tokenline[udf_MAX_PATHLEN];
-    char *psz_token;
-    
-    strncpy(tokenline, psz_name, udf_MAX_PATHLEN);
-    psz_token = strtok(tokenline, udf_PATH_DELIMITERS);
-    if (psz_token) {
-      /*** FIXME??? udf_dirent can be variable size due to the
-	   extended attributes and descriptors. Given that, is this
-	   correct? 
-       */
-      udf_dirent_t *p_udf_dirent = 
-	udf_new_dirent(p_udf_root->fe, p_udf_root->p_udf,
-		       p_udf_root->psz_name, p_udf_root->b_dir, 
-		       p_udf_root->b_parent);
-      p_udf_file = udf_ff_traverse(p_udf_dirent, psz_token);
-      udf_dirent_free(p_udf_dirent);
-    }
-    else if ( 0 == strncmp("/", psz_name, sizeof("/")) ) {
-      return udf_new_dirent(p_udf_root->fe, p_udf_root->p_udf,
-			    p_udf_root->psz_name, p_udf_root->b_dir, 
-			    p_udf_root->b_parent);
-    }
-  }
-  return p_udf_file;
-}
-
 /* Convert unicode16 to 8-bit char by dripping MSB. 
    Wonder if iconv can be used here
 */
@@ -279,37 +225,248 @@ unicode16_decode( const uint8_t *data, int i_len, char *target )
 }
 
 
-static udf_dirent_t *
-udf_new_dirent(udf_file_entry_t *p_udf_fe, udf_t *p_udf,
+/* Names of FIDs are at most 255 bytes */
+#define UDF_NAME_MAX 256
+
+/*
+  A dirent is a single allocation along with its file entry, its name
+  and, for a directory, the buffer for its sectors. udf_readdir reads
+  every entry into it without reallocating and udf_dirent_free gives
+  it all back at once.
+*/
+typedef struct udf_dirent_mem_s
+{
+  udf_dirent_t  dirent;
+  uint8_t       fe[UDF_BLOCKSIZE];
+  char          psz_name[UDF_NAME_MAX];
+  /* Sectors of a directory follow */
+} udf_dirent_mem_t;
+
+udf_dirent_t *
+udf_new_dirent(const udf_file_entry_t *p_udf_fe, udf_t *p_udf,
 	       const char *psz_name, bool b_dir, bool b_parent) 
 {
-  const unsigned int i_alloc_size = p_udf_fe->i_alloc_descs
-    + p_udf_fe->i_extended_attr;
-  udf_dirent_t *p_udf_dirent = (udf_dirent_t *)
-    calloc(1, sizeof(udf_dirent_t));
+  unsigned int i_alloc_size = uint32_from_le(p_udf_fe->i_alloc_descs)
+    + uint32_from_le(p_udf_fe->i_extended_attr);
+  uint32_t i_loc = 0, i_loc_end = 0;
+  size_t i_sectors_size = 0;
+  udf_dirent_mem_t *p_mem;
+  udf_dirent_t *p_udf_dirent;
 
-  if (!p_udf_dirent) return NULL;
-  if (!(p_udf_dirent->fe = calloc(1, 
-    sizeof(udf_file_entry_t) + i_alloc_size)))
-  {
-    free(p_udf_dirent);
-    return NULL;
-  }
-  p_udf_dirent->psz_name     = strdup(psz_name);
+  /* A file entry is never bigger than its block */
+  if (i_alloc_size > UDF_BLOCKSIZE - sizeof(udf_file_entry_t))
+    i_alloc_size = UDF_BLOCKSIZE - sizeof(udf_file_entry_t);
+  if (udf_get_lba(p_udf_fe, &i_loc, &i_loc_end) && b_dir)
+    i_sectors_size = (size_t)UDF_BLOCKSIZE * (i_loc_end - i_loc + 1);
+  if (!(p_mem = malloc(sizeof(udf_dirent_mem_t) + i_sectors_size))) return NULL;
+  memset(p_mem, 0, sizeof(udf_dirent_mem_t));
+
+  p_udf_dirent = &p_mem->dirent;
+  p_udf_dirent->fe           = (udf_file_entry_t *) p_mem->fe;
+  p_udf_dirent->psz_name     = p_mem->psz_name;
+  p_udf_dirent->sector       = i_sectors_size ? (uint8_t *)(p_mem + 1) : NULL;
+  snprintf(p_udf_dirent->psz_name, UDF_NAME_MAX, "%s", psz_name);
   p_udf_dirent->b_dir        = b_dir;
   p_udf_dirent->b_parent     = b_parent;
   p_udf_dirent->p_udf        = p_udf;
   p_udf_dirent->i_part_start = p_udf->i_part_start;
   p_udf_dirent->dir_left     = uint64_from_le(p_udf_fe->info_len); 
-  p_udf_dirent->i_fe_alloc_size = i_alloc_size;
+  p_udf_dirent->i_fe_alloc_size = UDF_BLOCKSIZE - sizeof(udf_file_entry_t);
+  p_udf_dirent->i_loc        = i_loc;
+  p_udf_dirent->i_loc_end    = i_loc_end;
 
   memcpy(p_udf_dirent->fe, p_udf_fe, 
 	 sizeof(udf_file_entry_t) + i_alloc_size);
-  udf_get_lba( p_udf_fe, &(p_udf_dirent->i_loc), 
-	       &(p_udf_dirent->i_loc_end) );
   return p_udf_dirent;
 }
 
+#define UDF_WINDOW     0x100000 /* Size of O_DIRECT requests, there is no readahead */
+#define UDF_ALIGN_MAX  0x10000  /* Largest block size requests get aligned to */
+
+/*
+  Reads through the O_DIRECT window, which gets refilled with an aligned
+  request at the needed position whenever the data isn't in there.
+*/
+static driver_return_code_t
+udf_read_direct (udf_window_t *p_win, uint8_t *ptr, uint64_t i_offset, 
+		 uint64_t i_len)
+{
+  ssize_t i_read;
+  uint64_t i_copy;
+
+  while (i_len > 0) {
+    /* Big aligned requests into an aligned buffer don't need to go through the window */
+    if (i_len >= UDF_WINDOW && !(i_offset % p_win->i_align)
+	&& !((uintptr_t)ptr % p_win->i_align)) {
+      i_copy = i_len / p_win->i_align * p_win->i_align;
+      if ((i_read = pread64(p_win->fd, ptr, i_copy, i_offset)) <= 0) return DRIVER_OP_ERROR;
+      ptr += i_read;
+      i_offset += i_read;
+      i_len -= i_read;
+      continue;
+    }
+    if (i_offset < p_win->i_start || i_offset >= p_win->i_start + p_win->i_len) {
+      p_win->i_start = i_offset / p_win->i_align * p_win->i_align;
+      p_win->i_len = 0;
+      if ((i_read = pread64(p_win->fd, p_win->p_buf, UDF_WINDOW, p_win->i_start)) <= 0
+	  || i_offset >= p_win->i_start + i_read)
+	return DRIVER_OP_ERROR;
+      p_win->i_len = i_read;
+    }
+    i_copy = p_win->i_start + p_win->i_len - i_offset;
+    if (i_copy > i_len) i_copy = i_len;
+    memcpy(ptr, p_win->p_buf + (i_offset - p_win->i_start), i_copy);
+    ptr += i_copy;
+    i_offset += i_copy;
+    i_len -= i_copy;
+  }
+  return DRIVER_OP_SUCCESS;
+}
+
+static int
+cmp_badarea(const void *a, const void *b)
+{
+  const udf_badarea_t *p_a = a, *p_b = b;
+
+  return p_a->i_pos < p_b->i_pos ? -1 : (p_a->i_pos > p_b->i_pos);
+}
+
+/*
+  Loads the areas of a ddrescue mapfile that are not finished ('+'),
+  these either couldn't be read or haven't been tried yet.
+*/
+static udf_badmap_t *
+udf_load_badmap (const char *psz_mapfile)
+{
+  udf_badmap_t *p_map;
+  udf_badarea_t *p_area;
+  FILE *fp;
+  char line[256], status;
+  long long pos, size;
+  uint64_t i_total;
+  int i, k, i_max = 0, b_hdr = 0;
+
+  if (!(fp = fopen(psz_mapfile, "r"))) {
+    fprintf(stderr, "Cannot open mapfile %s: %s\n", psz_mapfile, strerror(errno));
+    return NULL;
+  }
+  if (!(p_map = calloc(1, sizeof(udf_badmap_t)))) {
+    fclose(fp);
+    return NULL;
+  }
+  while (fgets(line, sizeof(line), fp)) {
+    if (line[0] == '#') continue;
+    /* First line is the status line: current_pos current_status [current_pass] */
+    if (!b_hdr++) continue;
+    if (sscanf(line, "%lli %lli %c", &pos, &size, &status) != 3 
+	|| status == '+' || size <= 0) continue;
+    if (p_map->i_count == i_max) {
+      i_max = i_max ? i_max * 2 : 256;
+      if (!(p_area = realloc(p_map->p_area, i_max * sizeof(udf_badarea_t)))) {
+	fprintf(stderr, "Out of memory loading mapfile %s\n", psz_mapfile);
+	break;
+      }
+      p_map->p_area = p_area;
+    }
+    p_map->p_area[p_map->i_count].i_pos = pos;
+    p_map->p_area[p_map->i_count++].i_len = size;
+  }
+  fclose(fp);
+
+  /* Merge adjacent areas, so that a lookup finds the whole unreadable range at once */
+  qsort(p_map->p_area, p_map->i_count, sizeof(udf_badarea_t), cmp_badarea);
+  for (i = 0, k = 0; i < p_map->i_count; i++) {
+    p_area = &p_map->p_area[i];
+    if (k && p_map->p_area[k-1].i_pos + p_map->p_area[k-1].i_len >= p_area->i_pos) {
+      if (p_area->i_pos + p_area->i_len > p_map->p_area[k-1].i_pos + p_map->p_area[k-1].i_len)
+	p_map->p_area[k-1].i_len = p_area->i_pos + p_area->i_len - p_map->p_area[k-1].i_pos;
+      continue;
+    }
+    p_map->p_area[k++] = *p_area;
+  }
+  p_map->i_count = k;
+  for (i = 0, i_total = 0; i < p_map->i_count; i++) i_total += p_map->p_area[i].i_len;
+  printf("Mapfile %s: %d bad areas, %llu bytes\n", psz_mapfile, p_map->i_count, i_total);
+  return p_map;
+}
+
+/*
+  Finds the first bad area that overlaps i_pos..i_pos+i_len by binary
+  search and returns the overlapping part.
+*/
+bool
+udf_map_bad(const udf_badmap_t *p_map, uint64_t i_pos, uint64_t i_len,
+	    /*out*/ uint64_t *pi_bad_pos, /*out*/ uint64_t *pi_bad_len)
+{
+  int lo = 0, hi, mid;
+  uint64_t i_end;
+
+  if (!p_map || !p_map->i_count || !i_len) return false;
+  /* First area that ends after i_pos */
+  for (hi = p_map->i_count; lo < hi; ) {
+    mid = (lo + hi) / 2;
+    if (p_map->p_area[mid].i_pos + p_map->p_area[mid].i_len <= i_pos) lo = mid + 1;
+    else hi = mid;
+  }
+  if (lo == p_map->i_count || p_map->p_area[lo].i_pos >= i_pos + i_len) return false;
+  if (pi_bad_pos) {
+    *pi_bad_pos = p_map->p_area[lo].i_pos > i_pos ? p_map->p_area[lo].i_pos : i_pos;
+    i_end = p_map->p_area[lo].i_pos + p_map->p_area[lo].i_len;
+    *pi_bad_len = (i_end < i_pos + i_len ? i_end : i_pos + i_len) - *pi_bad_pos;
+  }
+  return true;
+}
+
+/* What is beyond the end of the image reads as zeros */
+static driver_return_code_t
+udf_read_bytes (const udf_t *p_udf, uint8_t *ptr, uint64_t i_byte_offset, 
+		uint64_t i_len)
+{
+  ssize_t i_read;
+  uint64_t i_done;
+
+  if (p_udf->p_window)
+    return udf_read_direct(p_udf->p_window, ptr, i_byte_offset, i_len);
+
+  for (i_done = 0; i_done < i_len; i_done += i_read)
+    {
+      if ((i_read = pread64 (p_udf->stream, ptr + i_done, i_len - i_done, 
+			     i_byte_offset + i_done)) < 0)
+	return DRIVER_OP_ERROR;
+      if (!i_read)
+	{
+	  if (!i_done) return DRIVER_OP_ERROR;
+	  memset(ptr + i_done, 0, i_len - i_done);
+	  break;
+	}
+    }
+  return DRIVER_OP_SUCCESS;
+}
+
+/*!
+  Reads i_len bytes of the image at byte offset i_byte_offset, the
+  areas of the mapfile are zero-filled without touching the device.
+*/
+driver_return_code_t
+udf_read_image (const udf_t *p_udf, void *ptr, uint64_t i_byte_offset,
+		uint64_t i_len)
+{
+  uint64_t i_end = i_byte_offset + i_len, i_pos, i_bad_pos, i_bad_len;
+  uint8_t *p_buf = ptr;
+
+  /* Bad areas are zero-filled without touching the device, the rest is read as usual */
+  for (i_pos = i_byte_offset; 
+       udf_map_bad(p_udf->p_badmap, i_pos, i_end - i_pos, &i_bad_pos, &i_bad_len);
+       i_pos = i_bad_pos + i_bad_len) {
+    if (i_bad_pos > i_pos && udf_read_bytes(p_udf, p_buf + (i_pos - i_byte_offset), 
+					    i_pos, i_bad_pos - i_pos) != DRIVER_OP_SUCCESS)
+      return DRIVER_OP_ERROR;
+    memset(p_buf + (i_bad_pos - i_byte_offset), 0, i_bad_len);
+  }
+  if (i_pos == i_end) return DRIVER_OP_SUCCESS;
+  return udf_read_bytes(p_udf, p_buf + (i_pos - i_byte_offset), i_pos, i_end - i_pos);
+}
+
 /*!
   Seek to a position i_start and then read i_blocks. Number of blocks read is 
   returned. One normally expects the return to be equal to i_blocks.
@@ -318,48 +475,164 @@ driver_return_code_t
 udf_read_sectors (const udf_t *p_udf, void *ptr, lsn_t i_start, 
 		 long int i_blocks) 
 {
-  driver_return_code_t ret;
-  long int i_read;
-  uint64_t i_byte_offset;
-  
   if (!p_udf) return 0;
-  i_byte_offset = ((uint64_t)i_start * (uint64_t)UDF_BLOCKSIZE);
+  return udf_read_image(p_udf, ptr, (uint64_t)i_start * (uint64_t)UDF_BLOCKSIZE,
+			(uint64_t)UDF_BLOCKSIZE * i_blocks);
+}
 
-    ret = lseek64 (p_udf->stream, i_byte_offset, SEEK_SET);
-    if (ret != (off64_t)-1)
-    {
-      i_read = read (p_udf->stream, ptr, UDF_BLOCKSIZE * i_blocks);
-      if (i_read) return DRIVER_OP_SUCCESS;
+#define UDF_SEARCH_CHUNK  0x400000 /* Size of reads while scanning for the header */
+#define UDF_SEARCH_STRIDE 0x10000  /* Distance of header candidates */
+#define UDF_HINT_EXT      ".udfhdr"
+
+/* Reads the block at i_lsn unless it is in a bad area */
+static bool
+read_lsn(int fdd, const udf_badmap_t *p_map, lsn_t i_lsn, void *p_buf)
+{
+  uint64_t i_offset = (uint64_t)i_lsn * UDF_BLOCKSIZE;
+
+  if (udf_map_bad(p_map, i_offset, UDF_BLOCKSIZE, NULL, NULL)) return false;
+  return pread64(fdd, p_buf, UDF_BLOCKSIZE, i_offset) == UDF_BLOCKSIZE;
+}
+
+static bool
+check_fsd(int fdd, const udf_badmap_t *p_map, uint32_t part_start, uint32_t fsd_offset)
+{
+  uint8_t data[UDF_BLOCKSIZE];
+
+  return part_start && read_lsn(fdd, p_map, part_start + fsd_offset, data)
+    && !udf_checktag((udf_tag_t *)data, TAGID_FSD);
+}
+
+/*
+  Follows an Anchor Volume Descriptor Pointer at one of the places the
+  UDF specs put it to the partition and logical volume descriptors.
+  Panasonic recorders don't write them, but discs and images of other
+  devices are found at once this way.
+*/
+static bool
+probe_anchors(int fdd, const udf_badmap_t *p_map, uint64_t i_size,
+	      uint32_t *part_start, uint32_t *fsd_offset)
+{
+  uint8_t data[UDF_BLOCKSIZE];
+  const lsn_t i_last = i_size / UDF_BLOCKSIZE - 1;
+  const lsn_t anchors[] = { 256, 512, i_last - 256, i_last };
+  const anchor_vol_desc_ptr_t *p_avdp = (anchor_vol_desc_ptr_t *) data;
+  const udf_tag_t *p_tag = (udf_tag_t *) data;
+  lsn_t i_lsn, i_end;
+  uint32_t i_part = 0, i_fsd = 0;
+  bool b_part, b_fsd;
+  int i;
+
+  for (i = 0; i < sizeof(anchors) / sizeof(anchors[0]); i++) {
+    if (anchors[i] <= 0 || anchors[i] > i_last || !read_lsn(fdd, p_map, anchors[i], data)
+	|| udf_checktag(p_tag, TAGID_ANCHOR)) continue;
+    i_lsn = uint32_from_le(p_avdp->main_vol_desc_seq_ext.loc);
+    i_end = i_lsn + MIN(uint32_from_le(p_avdp->main_vol_desc_seq_ext.len) / UDF_BLOCKSIZE, 64);
+    for (b_part = b_fsd = false; i_lsn < i_end && read_lsn(fdd, p_map, i_lsn, data); i_lsn++) {
+      if (!udf_checktag(p_tag, TAGID_PARTITION)) {
+	i_part = uint32_from_le(((partition_desc_t *) data)->start_loc);
+	b_part = true;
+      } else if (!udf_checktag(p_tag, TAGID_LOGVOL)) {
+	i_fsd = uint32_from_le(((logical_vol_desc_t *) data)->lvd_use.fsd_loc.loc.lba);
+	b_fsd = true;
+      } else if (!udf_checktag(p_tag, TAGID_TERM)) break;
     }
-    return DRIVER_OP_ERROR;
+    if (b_part && b_fsd && check_fsd(fdd, p_map, i_part, i_fsd)) {
+      *part_start = i_part;
+      *fsd_offset = i_fsd;
+      printf("UDF filesystem found by anchor at sector %d\n", anchors[i]);
+      return true;
+    }
+  }
+  return false;
 }
 
+/* Where what was learned about an image is saved for the next run */
+void
+udf_sidecar_path(const char *psz_path, const char *psz_ext, char *psz_out, size_t i_len)
+{
+  struct stat st;
+  const char *psz_base = strrchr(psz_path, '/');
+
+  /* Nothing is written next to devices, their files go to the current directory */
+  if (stat(psz_path, &st) == 0 && S_ISREG(st.st_mode))
+    snprintf(psz_out, i_len, "%s%s", psz_path, psz_ext);
+  else
+    snprintf(psz_out, i_len, "%s%s", psz_base ? psz_base + 1 : psz_path, psz_ext);
+}
+
+/*
+  Looks for the filesystem: at the position saved by an earlier run, by
+  the anchors and finally by scanning the image for the File Set
+  Descriptor the Panasonic recorders put at the start of the partition.
+*/
 static int
-search_hdr(int fdd, uint32_t *part_start)
+search_hdr(int fdd, const char *psz_path, const udf_badmap_t *p_map, 
+	   uint32_t *part_start, uint32_t *fsd_offset)
 {
-  char buffer[4096];
-  udf_tag_t *tag=(udf_tag_t*)buffer;
-  uint64_t offset;
+  char psz_hint[4096], *buffer;
+  const udf_tag_t *tag;
+  uint64_t offset, end = lseek64(fdd, 0, SEEK_END);
+  unsigned long i_part, i_fsd;
+  ssize_t rd = 0, pos;
+  time_t now, last_progress = 0;
+  FILE *fp;
 
-  for (offset=0; lseek64(fdd, offset, SEEK_SET)!=(off64_t)-1; offset+=0x10000)
-  {
-    
-    if(read(fdd, buffer, sizeof(buffer))!=sizeof(buffer))
-    {
-      fprintf(stderr, "Read error @%10llX: %s\n", offset, strerror(errno));
+  udf_sidecar_path(psz_path, UDF_HINT_EXT, psz_hint, sizeof(psz_hint));
+  if ((fp = fopen(psz_hint, "r"))) {
+    if (fscanf(fp, "udf_dump 1 %lu %lu", &i_part, &i_fsd) == 2
+	&& check_fsd(fdd, p_map, i_part, i_fsd)) {
+      printf("UDF filesystem found at sector %lu, as saved in %s\n", i_part, psz_hint);
+      fclose(fp);
+      *part_start = i_part;
+      *fsd_offset = i_fsd;
+      return 0;
+    }
+    fclose(fp);
+  }
+  if (!probe_anchors(fdd, p_map, end, part_start, fsd_offset)) {
+    if (!(buffer = malloc(UDF_SEARCH_CHUNK))) {
+      fprintf(stderr, "Out of memory searching header\n");
       return -1;
     }
-    printf ("\rSearching UDF filesystem header...%10llX", offset);
-    fflush(stdout);
-    if (!udf_checktag(tag, TAGID_FSD))
-    {
-      printf (" FOUND!\n");
-      *part_start = offset/UDF_BLOCKSIZE;
-      return 0;
+    for (offset = 0, *part_start = 0; !*part_start && offset < end; offset += UDF_SEARCH_CHUNK) {
+      if (udf_map_bad(p_map, offset, UDF_SEARCH_CHUNK, NULL, NULL)) {
+	/* Just read the tags of the candidates that are readable */
+	for (pos = 0; pos < UDF_SEARCH_CHUNK && offset + pos < end; pos += UDF_SEARCH_STRIDE) {
+	  memset(buffer + pos, 0, sizeof(udf_tag_t));
+	  if (!udf_map_bad(p_map, offset + pos, sizeof(udf_tag_t), NULL, NULL)
+	      && pread64(fdd, buffer + pos, sizeof(udf_tag_t), offset + pos) != sizeof(udf_tag_t)) break;
+	}
+	rd = pos;
+      } else if ((rd = pread64(fdd, buffer, UDF_SEARCH_CHUNK, offset)) <= 0) break;
+      if ((now = time(NULL)) != last_progress) {
+	last_progress = now;
+	printf ("\rSearching UDF filesystem header...%10llX", offset);
+	fflush(stdout);
+      }
+      /* The tag id rules out nearly all candidates before the checksum is computed */
+      for (pos = 0; pos + (ssize_t)sizeof(udf_tag_t) <= rd; pos += UDF_SEARCH_STRIDE) {
+	tag = (const udf_tag_t *)(buffer + pos);
+	if (tag->id == TAGID_FSD && !udf_checktag(tag, TAGID_FSD)) {
+	  printf ("\rSearching UDF filesystem header...%10llX FOUND!\n", offset + pos);
+	  *part_start = (offset + pos) / UDF_BLOCKSIZE;
+	  *fsd_offset = 0;
+	  break;
+	}
+      }
+    }
+    free(buffer);
+    if (!*part_start) {
+      if (rd < 0) fprintf(stderr, "\nRead error @%10llX: %s\n", offset, strerror(errno));
+      else fprintf(stderr, "\nHeader could not be found!\n");
+      return rd < 0 ? -1 : -2;
     }
   }
-  fprintf(stderr, "\nHeader could not be found!\n");
-  return -2;
+  if ((fp = fopen(psz_hint, "w"))) {
+    fprintf(fp, "udf_dump 1 %lu %lu\n", (unsigned long)*part_start, (unsigned long)*fsd_offset);
+    fclose(fp);
+  }
+  return 0;
 }
 
 
@@ -368,9 +641,15 @@ search_hdr(int fdd, uint32_t *part_start)
   a mode. NULL is returned on error.
 
   Caller must free result - use udf_close for that.
+  The search is skipped if the position of the filesystem is known
+  from an index, i.e. i_part_start isn't 0, or if udf_open_sweep is
+  going to find it (UDF_PART_SWEEP).
 */
-udf_t *
-udf_open (const char *psz_path)
+#define UDF_PART_SWEEP ((uint32_t)-1)
+
+static udf_t *
+udf_open_badmap (const char *psz_path, udf_badmap_t *p_map,
+		 uint32_t i_part_start, uint32_t fsd_offset)
 {
   udf_t *p_udf = (udf_t *) calloc(1, sizeof(udf_t)) ;
   uint8_t data[UDF_BLOCKSIZE];
@@ -380,8 +659,15 @@ udf_open (const char *psz_path)
     p_udf->stream = open( psz_path, O_RDONLY|O_LARGEFILE|O_BINARY );
     if (p_udf->stream)
     {
-      if (search_hdr(p_udf->stream, &p_udf->i_part_start) == 0)
+      p_udf->i_part_start = i_part_start;
+      p_udf->fsd_offset   = fsd_offset;
+      if (i_part_start
+	  || search_hdr(p_udf->stream, psz_path, p_map, &p_udf->i_part_start, 
+			&p_udf->fsd_offset) == 0)
+      {
+        p_udf->p_badmap = p_map;
         return p_udf;
+      }
 
       close(p_udf->stream);
     }
@@ -391,6 +677,119 @@ udf_open (const char *psz_path)
   return NULL;
 }
 
+udf_t *
+udf_open (const char *psz_path)
+{
+  return udf_open_badmap (psz_path, NULL, 0, 0);
+}
+
+/*!
+  Read file data of p_udf with O_DIRECT. Requests are aligned to the
+  physical block size of the device, or at least to its logical one.
+*/
+static udf_t *
+udf_set_direct (udf_t *p_udf, const char *psz_path, bool b_quiet)
+{
+#ifdef O_DIRECT
+  udf_window_t *p_win;
+  int i_lbs = 0;
+  unsigned int i_pbs = 0;
+  struct stat st;
+
+  if (!p_udf) return NULL;
+  if (!(p_win = calloc(1, sizeof(udf_window_t)))) return p_udf;
+  if ((p_win->fd = open(psz_path, O_RDONLY|O_LARGEFILE|O_BINARY|O_DIRECT)) == -1) {
+    fprintf(stderr, "Warning: Cannot open %s with O_DIRECT, using page cache: %s\n",
+	    psz_path, strerror(errno));
+    free(p_win);
+    return p_udf;
+  }
+#ifdef BLKSSZGET
+  if (ioctl(p_win->fd, BLKSSZGET, &i_lbs) < 0) i_lbs = 0;
+#endif
+#ifdef BLKPBSZGET
+  if (ioctl(p_win->fd, BLKPBSZGET, &i_pbs) < 0) i_pbs = 0;
+#endif
+  /* Image files need to be aligned to the block size of their filesystem */
+  if (i_lbs <= 0)
+    i_lbs = fstat(p_win->fd, &st) == 0 && st.st_blksize > 0 ? st.st_blksize : 4096;
+  p_win->i_align = i_pbs > i_lbs && i_pbs <= UDF_ALIGN_MAX ? i_pbs : i_lbs;
+  if (p_win->i_align > UDF_ALIGN_MAX || (p_win->i_align & (p_win->i_align - 1))
+      || posix_memalign((void **)&p_win->p_buf, p_win->i_align, UDF_WINDOW)) {
+    fprintf(stderr, "Warning: Cannot read %s with O_DIRECT, using page cache\n", psz_path);
+    close(p_win->fd);
+    free(p_win);
+    return p_udf;
+  }
+  if (!b_quiet)
+    printf("Reading file data with O_DIRECT, block size %d/%u\n", i_lbs, i_pbs?i_pbs:i_lbs);
+  p_udf->p_window = p_win;
+#endif
+  return p_udf;
+}
+
+udf_t *
+udf_open_direct (const char *psz_path)
+{
+  return udf_set_direct (udf_open (psz_path), psz_path, false);
+}
+
+static udf_t *
+udf_open_ex (const char *psz_path, const char *psz_mapfile, bool b_direct,
+	     uint32_t i_part_start, uint32_t fsd_offset)
+{
+  udf_badmap_t *p_map = NULL;
+  udf_t *p_udf;
+
+  if (psz_mapfile && !(p_map = udf_load_badmap (psz_mapfile))) return NULL;
+  if (!(p_udf = udf_open_badmap (psz_path, p_map, i_part_start, fsd_offset))) {
+    if (p_map) {
+      free(p_map->p_area);
+      free(p_map);
+    }
+    return NULL;
+  }
+  return b_direct ? udf_set_direct (p_udf, psz_path, false) : p_udf;
+}
+
+udf_t *
+udf_open_mapfile (const char *psz_path, const char *psz_mapfile, bool b_direct)
+{
+  return udf_open_ex (psz_path, psz_mapfile, b_direct, 0, 0);
+}
+
+udf_t *
+udf_open_index (const char *psz_path, const udf_index_t *p_index,
+		const char *psz_mapfile, bool b_direct)
+{
+  uint32_t i_part_start, fsd_offset;
+
+  udf_index_position (p_index, &i_part_start, &fsd_offset);
+  return udf_open_ex (psz_path, psz_mapfile, b_direct, i_part_start, fsd_offset);
+}
+
+/*!
+  Open psz_path again for another thread, without searching the header.
+  The clone has its own descriptor and O_DIRECT window and shares the
+  mapfile with p_udf, so it has to be closed before p_udf.
+*/
+udf_t *
+udf_clone (const udf_t *p_udf, const char *psz_path)
+{
+  udf_t *p_clone = (udf_t *) calloc(1, sizeof(udf_t));
+
+  if (!p_clone) return NULL;
+  if ((p_clone->stream = open(psz_path, O_RDONLY|O_LARGEFILE|O_BINARY)) == -1) {
+    free(p_clone);
+    return NULL;
+  }
+  p_clone->i_part_start = p_udf->i_part_start;
+  p_clone->fsd_offset   = p_udf->fsd_offset;
+  p_clone->p_badmap     = p_udf->p_badmap;
+  p_clone->b_clone      = true;
+  return p_udf->p_window ? udf_set_direct(p_clone, psz_path, true) : p_clone;
+}
+
 /*!
   Get the root in p_udf. If b_any_partition is false then
   the root must be in the given partition.
@@ -445,6 +844,24 @@ udf_close (udf_t *p_udf)
 {
   if (!p_udf) return true;
   close(p_udf->stream);
+  if (p_udf->p_window) {
+    close(p_udf->p_window->fd);
+    free(p_udf->p_window->p_buf);
+    free(p_udf->p_window);
+  }
+  if (p_udf->p_badmap && !p_udf->b_clone) {
+    free(p_udf->p_badmap->p_area);
+    free(p_udf->p_badmap);
+  }
+  free(p_udf->p_fe_cache);
+  while (p_udf->p_dirhash) {
+    udf_dirhash_t *p_next = p_udf->p_dirhash->p_next;
+
+    free(p_udf->p_dirhash->p_data);
+    free(p_udf->p_dirhash->p_slot);
+    free(p_udf->p_dirhash);
+    p_udf->p_dirhash = p_next;
+  }
 
   /* Get rid of root directory if allocated. */
 
@@ -452,17 +869,119 @@ udf_close (udf_t *p_udf)
   return true;
 }
 
+#define UDF_FE_GAP    16  /* Largest gap of unneeded blocks read along in a batch */
+#define UDF_FE_BATCH  256 /* Largest batch of file entry blocks */
+
+/*
+  Points *pp_udf_fe to the file entry at i_lba, which includes the
+  partition start, in the cache of prefetched entries. It stays valid
+  until another block is read into the same slot.
+*/
+static driver_return_code_t
+udf_view_fe (udf_t *p_udf, lba_t i_lba, /*out*/ const udf_file_entry_t **pp_udf_fe)
+{
+  udf_fe_slot_t *p_slot;
+  driver_return_code_t i_ret;
+
+  if (!p_udf->p_fe_cache 
+      && !(p_udf->p_fe_cache = calloc(UDF_FE_CACHE, sizeof(udf_fe_slot_t))))
+    return DRIVER_OP_ERROR;
+  p_slot = &p_udf->p_fe_cache[(uint32_t)i_lba % UDF_FE_CACHE];
+  if (!p_slot->b_valid || p_slot->i_lba != i_lba) {
+    if ((i_ret = udf_read_sectors(p_udf, p_slot->data, i_lba, 1)) != DRIVER_OP_SUCCESS) {
+      p_slot->b_valid = false;
+      return i_ret;
+    }
+    p_slot->i_lba = i_lba;
+    p_slot->b_valid = true;
+  }
+  *pp_udf_fe = (const udf_file_entry_t *) p_slot->data;
+  return DRIVER_OP_SUCCESS;
+}
+
+/* Copies the file entry at i_lba out of the cache into p_udf_fe */
+static driver_return_code_t
+udf_read_fe (udf_t *p_udf, lba_t i_lba, udf_file_entry_t *p_udf_fe)
+{
+  const udf_file_entry_t *p_view;
+  driver_return_code_t i_ret;
+
+  if (!p_udf->p_fe_cache 
+      && !(p_udf->p_fe_cache = calloc(UDF_FE_CACHE, sizeof(udf_fe_slot_t))))
+    return udf_read_sectors(p_udf, p_udf_fe, i_lba, 1);
+  if ((i_ret = udf_view_fe(p_udf, i_lba, &p_view)) == DRIVER_OP_SUCCESS)
+    memcpy(p_udf_fe, p_view, UDF_BLOCKSIZE);
+  return i_ret;
+}
+
+static int
+cmp_lba(const void *a, const void *b)
+{
+  const lba_t *p_a = a, *p_b = b;
+
+  return *p_a < *p_b ? -1 : (*p_a > *p_b);
+}
+
+/*
+  Fetches the file entries of all FIDs of a directory into the cache
+  at once, sorted by LBA and in batches of merged reads, instead of
+  one random single block read per entry.
+*/
+static void
+udf_prefetch_fe (udf_t *p_udf, const uint8_t *p_dir, uint64_t i_dir_len)
+{
+  const udf_fileid_desc_t *p_fid;
+  lba_t *p_lba, i_lba;
+  uint8_t *p_buf;
+  uint64_t i_ofs;
+  int i, j, k, i_count = 0;
+
+  if (!p_udf->p_fe_cache 
+      && !(p_udf->p_fe_cache = calloc(UDF_FE_CACHE, sizeof(udf_fe_slot_t))))
+    return;
+  if (!(p_lba = malloc(UDF_FE_CACHE * sizeof(lba_t)))) return;
+  for (i_ofs = 0; i_ofs + sizeof(*p_fid) <= i_dir_len && i_count < UDF_FE_CACHE; ) {
+    p_fid = (const udf_fileid_desc_t *)(p_dir + i_ofs);
+    if (udf_checktag(&p_fid->tag, TAGID_FID)) break;
+    if (!(p_fid->file_characteristics & UDF_FILE_PARENT)) {
+      i_lba = p_udf->i_part_start + udf_fid_lba(p_fid);
+      if (!p_udf->p_fe_cache[(uint32_t)i_lba % UDF_FE_CACHE].b_valid
+	  || p_udf->p_fe_cache[(uint32_t)i_lba % UDF_FE_CACHE].i_lba != i_lba)
+	p_lba[i_count++] = i_lba;
+    }
+    i_ofs += udf_fid_size(p_fid);
+  }
+  qsort(p_lba, i_count, sizeof(lba_t), cmp_lba);
+
+  if (i_count && (p_buf = malloc(UDF_FE_BATCH * UDF_BLOCKSIZE))) {
+    for (i = 0; i < i_count; i = j) {
+      for (j = i + 1; j < i_count && p_lba[j] - p_lba[j-1] <= UDF_FE_GAP
+	     && p_lba[j] - p_lba[i] < UDF_FE_BATCH; j++);
+      /* A failed batch leaves the entries to the single block reads */
+      if (udf_read_sectors(p_udf, p_buf, p_lba[i], p_lba[j-1] - p_lba[i] + 1) 
+	  != DRIVER_OP_SUCCESS) continue;
+      for (k = i; k < j; k++) {
+	udf_fe_slot_t *p_slot = &p_udf->p_fe_cache[(uint32_t)p_lba[k] % UDF_FE_CACHE];
+	memcpy(p_slot->data, p_buf + (p_lba[k] - p_lba[i]) * UDF_BLOCKSIZE, UDF_BLOCKSIZE);
+	p_slot->i_lba = p_lba[k];
+	p_slot->b_valid = true;
+      }
+    }
+    free(p_buf);
+  }
+  free(p_lba);
+}
+
 udf_dirent_t * 
 udf_opendir(const udf_dirent_t *p_udf_dirent)
 {
   if (p_udf_dirent->b_dir && !p_udf_dirent->b_parent && p_udf_dirent->fid) {
     udf_t *p_udf = p_udf_dirent->p_udf;
-    uint8_t data[UDF_BLOCKSIZE];
-    udf_file_entry_t *p_udf_fe = (udf_file_entry_t *) &data;
+    const udf_file_entry_t *p_udf_fe;
     
     driver_return_code_t i_ret = 
-      udf_read_sectors(p_udf, p_udf_fe, p_udf->i_part_start 
-		       + p_udf_dirent->fid->icb.loc.lba, 1);
+      udf_view_fe(p_udf, p_udf->i_part_start 
+		  + udf_fid_lba(p_udf_dirent->fid), &p_udf_fe);
 
     if (DRIVER_OP_SUCCESS == i_ret 
 	&& !udf_checktag(&p_udf_fe->tag, TAGID_FILE_ENTRY)) {
@@ -491,9 +1010,7 @@ udf_readdir(udf_dirent_t *p_udf_dirent)
   if (p_udf_dirent->fid) { 
     /* advance to next File Identifier Descriptor */
     /* FIXME: need to advance file entry (fe) as well.  */
-    uint32_t ofs = 4 * 
-      ((sizeof(*(p_udf_dirent->fid)) + p_udf_dirent->fid->i_imp_use 
-	+ p_udf_dirent->fid->i_file_id + 3) / 4);
+    uint32_t ofs = udf_fid_size(p_udf_dirent->fid);
     
     p_udf_dirent->fid = 
       (udf_fileid_desc_t *)((uint8_t *)p_udf_dirent->fid + ofs);
@@ -510,17 +1027,17 @@ udf_readdir(udf_dirent_t *p_udf_dirent)
     i_ret = udf_read_sectors(p_udf, p_udf_dirent->sector, 
 			     p_udf_dirent->i_part_start+p_udf_dirent->i_loc, 
 			     i_sectors);
-    if (DRIVER_OP_SUCCESS == i_ret)
+    if (DRIVER_OP_SUCCESS == i_ret) {
       p_udf_dirent->fid = (udf_fileid_desc_t *) p_udf_dirent->sector;
-    else
+      udf_prefetch_fe(p_udf, p_udf_dirent->sector, 
+		      p_udf_dirent->dir_left < size ? p_udf_dirent->dir_left : size);
+    } else
       p_udf_dirent->fid = NULL;
   }
   
   if (p_udf_dirent->fid && !udf_checktag(&(p_udf_dirent->fid->tag), TAGID_FID))
     {
-      uint32_t ofs = 
-	4 * ((sizeof(*p_udf_dirent->fid) + p_udf_dirent->fid->i_imp_use 
-	      + p_udf_dirent->fid->i_file_id + 3) / 4);
+      uint32_t ofs = udf_fid_size(p_udf_dirent->fid);
       
       p_udf_dirent->dir_left -= ofs;
       p_udf_dirent->b_dir = 
@@ -530,42 +1047,341 @@ udf_readdir(udf_dirent_t *p_udf_dirent)
 
       {
 	const unsigned int i_len = p_udf_dirent->fid->i_file_id;
-    unsigned int i_alloc_size;
-	uint8_t data[UDF_BLOCKSIZE] = {0};
-	udf_file_entry_t *p_udf_fe = (udf_file_entry_t *) &data;
 
-	if (udf_read_sectors(p_udf, p_udf_fe, p_udf->i_part_start 
-			 + p_udf_dirent->fid->icb.loc.lba, 1) != DRIVER_OP_SUCCESS)
+	/* The file entry block fits the dirent as it is */
+	if (udf_read_fe(p_udf, p_udf->i_part_start 
+			+ udf_fid_lba(p_udf_dirent->fid), p_udf_dirent->fe) != DRIVER_OP_SUCCESS)
 		return NULL;
 
     // Loop over 0byte files
-	if (!p_udf_fe->i_alloc_descs) return udf_readdir(p_udf_dirent);
-
-	i_alloc_size = p_udf_fe->i_alloc_descs + p_udf_fe->i_extended_attr;
-	if (p_udf_dirent->i_fe_alloc_size < i_alloc_size)
-	{
-		udf_file_entry_t *p_udf_new_fe  = realloc(p_udf_dirent->fe, sizeof(udf_file_entry_t) + i_alloc_size);
-		if (!p_udf_new_fe) return NULL;
-		p_udf_dirent->fe = p_udf_new_fe;
-		p_udf_dirent->i_fe_alloc_size = i_alloc_size;
-	}
-	memcpy(p_udf_dirent->fe, p_udf_fe, 
-	       sizeof(udf_file_entry_t) + i_alloc_size);
+	if (!p_udf_dirent->fe->i_alloc_descs) return udf_readdir(p_udf_dirent);
 
-	if (strlen(p_udf_dirent->psz_name) < i_len) 
-	  p_udf_dirent->psz_name = (char *)
-	    realloc(p_udf_dirent->psz_name, sizeof(char)*i_len+1);
-	
-	unicode16_decode(p_udf_dirent->fid->imp_use 
-			 + p_udf_dirent->fid->i_imp_use, 
-			 i_len, p_udf_dirent->psz_name);
+	unicode16_decode(udf_fid_name(p_udf_dirent->fid), i_len, p_udf_dirent->psz_name);
 	p_udf_dirent->i_position=0;
+	p_udf_dirent->b_extents=false;
       }
       return p_udf_dirent;
     }
   return NULL;
 }
 
+#define udf_PATH_DELIMITERS "/\\"
+
+/* FIXME! */
+#define udf_MAX_PATHLEN 2048
+
+static uint32_t
+hash_name(const char *psz_name)
+{
+  uint32_t h = 2166136261U;
+
+  while (*psz_name) h = (h ^ (uint8_t)*psz_name++) * 16777619U;
+  return h;
+}
+
+/*
+  Returns the name hash of the directory p_udf_dir, which is read and
+  hashed on its first lookup. The FIDs stay in memory with it, so no
+  file entry of the directory has to be read to find a name.
+*/
+static udf_dirhash_t *
+udf_get_dirhash (udf_t *p_udf, const udf_dirent_t *p_udf_dir)
+{
+  const lba_t i_lba = p_udf_dir->i_part_start + p_udf_dir->i_loc;
+  const uint32_t i_size = UDF_BLOCKSIZE * (p_udf_dir->i_loc_end - p_udf_dir->i_loc + 1);
+  const uint64_t i_len = MIN(uint64_from_le(p_udf_dir->fe->info_len), i_size);
+  const udf_fileid_desc_t *p_fid;
+  udf_dirhash_t *p_hash;
+  char psz_name[256];
+  uint32_t i_ofs, i_count = 0, i;
+
+  for (p_hash = p_udf->p_dirhash; p_hash; p_hash = p_hash->p_next)
+    if (p_hash->i_lba == i_lba) return p_hash;
+
+  if (!(p_hash = calloc(1, sizeof(udf_dirhash_t)))) return NULL;
+  if (!(p_hash->p_data = malloc(i_size))
+      || udf_read_sectors(p_udf, p_hash->p_data, i_lba, i_size / UDF_BLOCKSIZE) 
+	 != DRIVER_OP_SUCCESS) {
+    free(p_hash->p_data);
+    free(p_hash);
+    return NULL;
+  }
+  for (i_ofs = 0; i_ofs + sizeof(*p_fid) <= i_len; i_count++) {
+    p_fid = (const udf_fileid_desc_t *)(p_hash->p_data + i_ofs);
+    if (udf_checktag(&p_fid->tag, TAGID_FID)) break;
+    i_ofs += udf_fid_size(p_fid);
+  }
+  /* At most half full, so that probing stays short */
+  for (p_hash->i_slots = 16; p_hash->i_slots < 2 * i_count; p_hash->i_slots *= 2);
+  if (!(p_hash->p_slot = calloc(p_hash->i_slots, sizeof(uint32_t)))) {
+    free(p_hash->p_data);
+    free(p_hash);
+    return NULL;
+  }
+  for (i_ofs = 0; i_count--; ) {
+    p_fid = (const udf_fileid_desc_t *)(p_hash->p_data + i_ofs);
+    if (!(p_fid->file_characteristics & UDF_FILE_PARENT)) {
+      unicode16_decode(udf_fid_name(p_fid), p_fid->i_file_id, psz_name);
+      for (i = hash_name(psz_name); p_hash->p_slot[i & (p_hash->i_slots - 1)]; i++);
+      p_hash->p_slot[i & (p_hash->i_slots - 1)] = i_ofs + 1;
+    }
+    i_ofs += udf_fid_size(p_fid);
+  }
+  p_hash->i_lba = i_lba;
+  p_hash->p_next = p_udf->p_dirhash;
+  p_udf->p_dirhash = p_hash;
+  return p_hash;
+}
+
+/* Looks up psz_name in the directory p_udf_dir, NULL if it isn't there */
+static udf_dirent_t *
+udf_find_name (udf_t *p_udf, const udf_dirent_t *p_udf_dir, const char *psz_name)
+{
+  udf_dirhash_t *p_hash = udf_get_dirhash(p_udf, p_udf_dir);
+  const udf_fileid_desc_t *p_fid;
+  const udf_file_entry_t *p_udf_fe;
+  char psz_fid_name[256];
+  uint32_t i;
+
+  if (!p_hash) return NULL;
+  for (i = hash_name(psz_name); p_hash->p_slot[i & (p_hash->i_slots - 1)]; i++) {
+    p_fid = (const udf_fileid_desc_t *)
+      (p_hash->p_data + p_hash->p_slot[i & (p_hash->i_slots - 1)] - 1);
+    unicode16_decode(udf_fid_name(p_fid), p_fid->i_file_id, psz_fid_name);
+    if (strcmp(psz_fid_name, psz_name)) continue;
+    if (udf_view_fe(p_udf, p_udf->i_part_start + udf_fid_lba(p_fid), &p_udf_fe) 
+	!= DRIVER_OP_SUCCESS || udf_checktag(&p_udf_fe->tag, TAGID_FILE_ENTRY))
+      return NULL;
+    return udf_new_dirent(p_udf_fe, p_udf, psz_name,
+			  (p_fid->file_characteristics & UDF_FILE_DIRECTORY) != 0, true);
+  }
+  return NULL;
+}
+
+/*!
+  Looks up psz_name component by component in the name hashes of the
+  directories on the way. A directory that is returned can be read
+  with udf_readdir.
+*/
+udf_dirent_t * 
+udf_fopen(udf_dirent_t *p_udf_root, const char *psz_name)
+{
+  udf_dirent_t *p_udf_dirent, *p_udf_next;
+  char tokenline[udf_MAX_PATHLEN];
+  char *psz_token;
+
+  if (!p_udf_root) return NULL;
+  snprintf(tokenline, sizeof(tokenline), "%s", psz_name);
+  if (!(p_udf_dirent = udf_new_dirent(p_udf_root->fe, p_udf_root->p_udf,
+				      p_udf_root->psz_name, p_udf_root->b_dir, 
+				      p_udf_root->b_parent)))
+    return NULL;
+  for (psz_token = strtok(tokenline, udf_PATH_DELIMITERS); psz_token;
+       psz_token = strtok(NULL, udf_PATH_DELIMITERS)) {
+    p_udf_next = p_udf_dirent->b_dir ? 
+      udf_find_name(p_udf_dirent->p_udf, p_udf_dirent, psz_token) : NULL;
+    udf_dirent_free(p_udf_dirent);
+    if (!(p_udf_dirent = p_udf_next)) return NULL;
+  }
+  return p_udf_dirent;
+}
+
+#define UDF_SWEEP_THREADS 64
+
+/* File entry found by the sweep */
+typedef struct udf_found_s
+{
+  lba_t     i_lba;
+  uint32_t  i_tag_loc; /* Where the tag says it is in its partition */
+} udf_found_t;
+
+typedef struct udf_sweep_s
+{
+  pthread_mutex_t  mtx;
+  const udf_t     *p_udf;
+  const char      *psz_path;
+  uint64_t         i_next, i_end;
+  udf_found_t     *p_found;
+  int              i_found, i_alloc;
+  time_t           last_progress;
+} udf_sweep_t;
+
+/* Takes the next chunk of the image and collects the file entry tags in it */
+static void *
+udf_sweep_worker (void *arg)
+{
+  udf_sweep_t *p_sweep = arg;
+  udf_t *p_udf = udf_clone(p_sweep->p_udf, p_sweep->psz_path);
+  udf_found_t p_chunk_found[UDF_SEARCH_CHUNK / UDF_BLOCKSIZE], *p_found;
+  const udf_tag_t *p_tag;
+  uint64_t i_offset, i_len, i_pos;
+  uint8_t *p_buf = NULL;
+  int i_count;
+  time_t now;
+
+#ifdef O_DIRECT
+  if (posix_memalign((void **)&p_buf, UDF_ALIGN_MAX, UDF_SEARCH_CHUNK)) p_buf = NULL;
+#else
+  p_buf = malloc(UDF_SEARCH_CHUNK);
+#endif
+  if (!p_udf || !p_buf) {
+    fprintf(stderr, "Cannot start sweep thread: %s\n", strerror(errno));
+    if (p_udf) udf_close(p_udf);
+    free(p_buf);
+    return NULL;
+  }
+  for (;;) {
+    pthread_mutex_lock(&p_sweep->mtx);
+    i_offset = p_sweep->i_next;
+    p_sweep->i_next += UDF_SEARCH_CHUNK;
+    if (i_offset < p_sweep->i_end && (now = time(NULL)) != p_sweep->last_progress) {
+      p_sweep->last_progress = now;
+      printf("\rSweeping for file entries...%3d%%, %d found",
+	     (int)(i_offset * 100 / p_sweep->i_end), p_sweep->i_found);
+      fflush(stdout);
+    }
+    pthread_mutex_unlock(&p_sweep->mtx);
+    if (i_offset >= p_sweep->i_end) break;
+
+    i_len = MIN(UDF_SEARCH_CHUNK, p_sweep->i_end - i_offset);
+    if (udf_read_image(p_udf, p_buf, i_offset, i_len) != DRIVER_OP_SUCCESS) {
+      fprintf(stderr, "\nRead error @%10llX, skipping %llu bytes\n", 
+	      (unsigned long long)i_offset, (unsigned long long)i_len);
+      continue;
+    }
+    /* The tag id rules out nearly all blocks before the checksum is computed */
+    for (i_pos = 0, i_count = 0; i_pos + UDF_BLOCKSIZE <= i_len; i_pos += UDF_BLOCKSIZE) {
+      p_tag = (const udf_tag_t *)(p_buf + i_pos);
+      if (p_tag->id == TAGID_FILE_ENTRY && !udf_checktag(p_tag, TAGID_FILE_ENTRY)) {
+	p_chunk_found[i_count].i_lba = (i_offset + i_pos) / UDF_BLOCKSIZE;
+	p_chunk_found[i_count++].i_tag_loc = uint32_from_le(p_tag->loc);
+      }
+    }
+    if (!i_count) continue;
+    pthread_mutex_lock(&p_sweep->mtx);
+    if (p_sweep->i_found + i_count > p_sweep->i_alloc) {
+      int i_alloc = p_sweep->i_alloc ? p_sweep->i_alloc : 4096;
+
+      while (i_alloc < p_sweep->i_found + i_count) i_alloc *= 2;
+      if ((p_found = realloc(p_sweep->p_found, i_alloc * sizeof(udf_found_t)))) {
+	p_sweep->p_found = p_found;
+	p_sweep->i_alloc = i_alloc;
+      }
+    }
+    if (p_sweep->i_found + i_count <= p_sweep->i_alloc) {
+      memcpy(p_sweep->p_found + p_sweep->i_found, p_chunk_found, i_count * sizeof(udf_found_t));
+      p_sweep->i_found += i_count;
+    } else
+      fprintf(stderr, "\nOut of memory, dropped %d file entries\n", i_count);
+    pthread_mutex_unlock(&p_sweep->mtx);
+  }
+  free(p_buf);
+  udf_close(p_udf);
+  return NULL;
+}
+
+static int
+cmp_found_part(const void *a, const void *b)
+{
+  const udf_found_t *p_a = a, *p_b = b;
+  int64_t i_a = (int64_t)p_a->i_lba - p_a->i_tag_loc, i_b = (int64_t)p_b->i_lba - p_b->i_tag_loc;
+
+  return i_a < i_b ? -1 : (i_a > i_b);
+}
+
+/*!
+  Open psz_path without a File Set Descriptor or root directory and
+  sweep the whole image with i_threads threads for file entries. Every
+  file entry tag records its block in the partition, so the partition
+  start is the one most of them agree on. *pp_lba gets the sorted
+  blocks of the file entries in that partition, free it when done.
+*/
+udf_t *
+udf_open_sweep (const char *psz_path, const char *psz_mapfile, bool b_direct,
+		int i_threads, /*out*/ lba_t **pp_lba, /*out*/ int *pi_count)
+{
+  udf_t *p_udf = udf_open_ex(psz_path, psz_mapfile, b_direct, UDF_PART_SWEEP, 0);
+  pthread_t tid[UDF_SWEEP_THREADS];
+  udf_sweep_t sweep;
+  int64_t i_part, i_best = -1;
+  int i, j, i_started = 0, i_best_count = 0;
+
+  if (!p_udf) return NULL;
+  if (i_threads < 1) i_threads = 1;
+  if (i_threads > UDF_SWEEP_THREADS) i_threads = UDF_SWEEP_THREADS;
+  memset(&sweep, 0, sizeof(sweep));
+  pthread_mutex_init(&sweep.mtx, NULL);
+  sweep.p_udf = p_udf;
+  sweep.psz_path = psz_path;
+  sweep.i_end = lseek64(p_udf->stream, 0, SEEK_END);
+  for (i = 0; i < i_threads; i++)
+    if (pthread_create(&tid[i_started], NULL, udf_sweep_worker, &sweep) == 0) i_started++;
+  for (i = 0; i < i_started; i++) pthread_join(tid[i], NULL);
+  pthread_mutex_destroy(&sweep.mtx);
+  printf("\rSweeping for file entries...100%%, %d found\n", sweep.i_found);
+
+  /* Largest group of file entries that agree on the partition start */
+  qsort(sweep.p_found, sweep.i_found, sizeof(udf_found_t), cmp_found_part);
+  for (i = 0; i < sweep.i_found; i = j) {
+    i_part = (int64_t)sweep.p_found[i].i_lba - sweep.p_found[i].i_tag_loc;
+    for (j = i + 1; j < sweep.i_found && !cmp_found_part(&sweep.p_found[i], &sweep.p_found[j]); j++);
+    if (i_part > 0 && j - i > i_best_count) {
+      i_best = i;
+      i_best_count = j - i;
+    }
+  }
+  if (i_best < 0 || !i_started || !(*pp_lba = malloc(i_best_count * sizeof(lba_t)))) {
+    fprintf(stderr, i_started ? "No file entries found in %s\n" : "Cannot start sweep of %s\n", psz_path);
+    free(sweep.p_found);
+    udf_close(p_udf);
+    return NULL;
+  }
+  p_udf->i_part_start = sweep.p_found[i_best].i_lba - sweep.p_found[i_best].i_tag_loc;
+  p_udf->fsd_offset = 0;
+  for (i = 0; i < i_best_count; i++) (*pp_lba)[i] = sweep.p_found[i_best + i].i_lba;
+  qsort(*pp_lba, i_best_count, sizeof(lba_t), cmp_lba);
+  *pi_count = i_best_count;
+  printf("Partition starts at sector %u, %d file entries in it\n", 
+	 p_udf->i_part_start, i_best_count);
+  free(sweep.p_found);
+  return p_udf;
+}
+
+/*!
+  Returns a dirent called psz_name for the file entry at block i_lba of
+  the image.
+*/
+udf_dirent_t *
+udf_get_fe_dirent (udf_t *p_udf, lba_t i_lba, const char *psz_name)
+{
+  const udf_file_entry_t *p_udf_fe;
+
+  if (udf_view_fe(p_udf, i_lba, &p_udf_fe) != DRIVER_OP_SUCCESS
+      || udf_checktag(&p_udf_fe->tag, TAGID_FILE_ENTRY))
+    return NULL;
+  return udf_new_dirent(p_udf_fe, p_udf, psz_name, 
+			ICBTAG_FILE_TYPE_DIRECTORY == p_udf_fe->icb_tag.file_type, true);
+}
+
+/*!
+  Copy of p_udf_dirent that stays valid when udf_readdir moves on,
+  reading through p_udf.
+*/
+udf_dirent_t *
+udf_dup_dirent(const udf_dirent_t *p_udf_dirent, udf_t *p_udf)
+{
+  udf_dirent_t *p_dup = udf_new_dirent(p_udf_dirent->fe, p_udf, p_udf_dirent->psz_name,
+				       p_udf_dirent->b_dir, p_udf_dirent->b_parent);
+
+  /* Entries from an index have no allocation descriptors to decode again */
+  if (p_dup && p_udf_dirent->b_extents
+      && !udf_set_extents(p_dup, p_udf_dirent->p_extents, p_udf_dirent->i_extents)) {
+    udf_dirent_free(p_dup);
+    return NULL;
+  }
+  return p_dup;
+}
+
 /*!
   free free resources associated with p_udf_dirent.
 */
@@ -573,11 +1389,13 @@ bool
 udf_dirent_free(udf_dirent_t *p_udf_dirent) 
 {
   if (p_udf_dirent) {
-    p_udf_dirent->fid = NULL;
-    free_and_null(p_udf_dirent->psz_name);
-    free_and_null(p_udf_dirent->sector);
-    free_and_null(p_udf_dirent->fe);
-    free_and_null(p_udf_dirent);
+    udf_dirent_mem_t *p_mem = (udf_dirent_mem_t *) p_udf_dirent;
+
+    /* Only a buffer that udf_readdir had to allocate is separate */
+    if (p_udf_dirent->sector != (uint8_t *)(p_mem + 1))
+      free(p_udf_dirent->sector);
+    free(p_udf_dirent->p_extents);
+    free(p_mem);
   }
   return true;
 }
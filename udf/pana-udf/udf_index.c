@@ -0,0 +1,400 @@
+/*
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Index of the tree of an image, saved next to it so that later runs
+ * can list and extract files without reading the metadata of a disk
+ * that may be failing. The file is mapped as it is:
+ *
+ *   udf_index_header_t
+ *   udf_index_entry_t    i_entries times, in the order they were added
+ *   udf_index_extent_t   i_extents times, the extents of each entry follow each other
+ *   char                 i_strings bytes of NUL-terminated paths and names
+ *
+ * Numbers are little-endian, the file entries are kept as on disk.
+ * Any change of the layout needs a new UDF_INDEX_VERSION.
+ */
+
+#define _LARGEFILE64_SOURCE
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <errno.h>
+#include <sys/stat.h>
+#ifndef WIN32
+#include <sys/mman.h>
+#endif
+
+#ifndef O_LARGEFILE
+#define O_LARGEFILE 0
+#endif
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+#include "cdio/bytesex.h"
+#include "udf_private.h"
+
+#define UDF_INDEX_EXT     ".udfidx"
+#define UDF_INDEX_MAGIC   "UDFINDEX"
+#define UDF_INDEX_VERSION 1
+#define UDF_INDEX_DIR     1   /* Entry flag */
+
+typedef struct udf_index_header_s
+{
+  char      magic[8];
+  uint32_t  i_version;
+  uint32_t  i_entries;
+  uint32_t  i_extents;
+  uint32_t  i_strings;      /* Size of the string table */
+  uint32_t  i_part_start;
+  uint32_t  fsd_offset;
+  uint64_t  i_image_size;   /* The index is only used for an image of the same size */
+} udf_index_header_t;
+
+typedef struct udf_index_entry_s
+{
+  uint64_t  i_size;
+  int64_t   i_mtime;
+  uint32_t  i_dir;          /* Offsets in the string table */
+  uint32_t  i_name;
+  uint32_t  i_extent;       /* First extent */
+  uint32_t  i_extents;
+  uint32_t  i_flags;
+  uint32_t  i_reserved;
+  uint8_t   fe[sizeof(udf_file_entry_t)]; /* Without extended attributes and descriptors */
+} udf_index_entry_t;
+
+typedef struct udf_index_extent_s
+{
+  uint64_t  i_offset;
+  uint32_t  i_len;
+  uint32_t  i_lba;          /* Including the partition start */
+} udf_index_extent_t;
+
+struct udf_index_s
+{
+  udf_index_header_t  hdr;        /* Host byte order */
+  udf_index_entry_t  *p_entries;
+  udf_index_extent_t *p_extents;
+  char               *p_strings;
+  uint8_t            *p_file;     /* Mapped or read file, NULL while being built */
+  size_t              i_file_len;
+  uint32_t            i_entries_alloc, i_extents_alloc, i_strings_alloc;
+};
+
+static uint64_t
+image_size(const char *psz_path)
+{
+  int fd = open(psz_path, O_RDONLY|O_LARGEFILE|O_BINARY);
+  off64_t i_size;
+
+  if (fd == -1) return 0;
+  i_size = lseek64(fd, 0, SEEK_END);
+  close(fd);
+  return i_size < 0 ? 0 : i_size;
+}
+
+/* Grows an array of the index by doubling until i_need elements of i_size fit */
+static bool
+grow(void **pp, uint32_t *pi_alloc, uint32_t i_need, size_t i_size)
+{
+  uint32_t i_alloc = *pi_alloc ? *pi_alloc : 256;
+  void *p;
+
+  if (i_need <= *pi_alloc) return true;
+  while (i_alloc < i_need) i_alloc *= 2;
+  if (!(p = realloc(*pp, (size_t)i_alloc * i_size))) return false;
+  *pp = p;
+  *pi_alloc = i_alloc;
+  return true;
+}
+
+static bool
+add_string(udf_index_t *p_index, const char *psz, uint32_t *pi_ofs)
+{
+  size_t i_len = strlen(psz) + 1;
+
+  if (!grow((void **)&p_index->p_strings, &p_index->i_strings_alloc,
+	    p_index->hdr.i_strings + i_len, 1))
+    return false;
+  *pi_ofs = p_index->hdr.i_strings;
+  memcpy(p_index->p_strings + p_index->hdr.i_strings, psz, i_len);
+  p_index->hdr.i_strings += i_len;
+  return true;
+}
+
+udf_index_t *
+udf_index_new (const udf_t *p_udf)
+{
+  udf_index_t *p_index = calloc(1, sizeof(udf_index_t));
+
+  if (!p_index) return NULL;
+  memcpy(p_index->hdr.magic, UDF_INDEX_MAGIC, sizeof(p_index->hdr.magic));
+  p_index->hdr.i_version    = UDF_INDEX_VERSION;
+  p_index->hdr.i_part_start = p_udf->i_part_start;
+  p_index->hdr.fsd_offset   = p_udf->fsd_offset;
+  return p_index;
+}
+
+bool
+udf_index_add (udf_index_t *p_index, udf_dirent_t *p_udf_dirent, const char *psz_dir)
+{
+  const udf_extent_t *p_extents = NULL;
+  udf_index_entry_t *p_ent;
+  udf_index_extent_t *p_ext;
+  udf_file_entry_t *p_fe;
+  int i, i_extents = 0;
+
+  if (p_index->p_file) return false;
+  if (!udf_is_dir(p_udf_dirent)
+      && (i_extents = udf_get_extents(p_udf_dirent, &p_extents)) < 0)
+    i_extents = 0;
+  if (!grow((void **)&p_index->p_entries, &p_index->i_entries_alloc,
+	    p_index->hdr.i_entries + 1, sizeof(udf_index_entry_t))
+      || !grow((void **)&p_index->p_extents, &p_index->i_extents_alloc,
+	       p_index->hdr.i_extents + i_extents, sizeof(udf_index_extent_t)))
+    return false;
+
+  p_ent = &p_index->p_entries[p_index->hdr.i_entries];
+  memset(p_ent, 0, sizeof(*p_ent));
+  if (!add_string(p_index, psz_dir, &p_ent->i_dir)
+      || !add_string(p_index, udf_get_filename(p_udf_dirent), &p_ent->i_name))
+    return false;
+  p_ent->i_size    = uint64_to_le(udf_get_file_length(p_udf_dirent));
+  p_ent->i_mtime   = uint64_to_le(udf_get_modification_time(p_udf_dirent));
+  p_ent->i_extent  = uint32_to_le(p_index->hdr.i_extents);
+  p_ent->i_extents = uint32_to_le(i_extents);
+  p_ent->i_flags   = uint32_to_le(udf_is_dir(p_udf_dirent) ? UDF_INDEX_DIR : 0);
+  memcpy(p_ent->fe, p_udf_dirent->fe, sizeof(p_ent->fe));
+  p_fe = (udf_file_entry_t *)p_ent->fe;
+  p_fe->i_extended_attr = 0;
+  p_fe->i_alloc_descs   = 0;
+
+  for (i = 0; i < i_extents; i++) {
+    p_ext = &p_index->p_extents[p_index->hdr.i_extents++];
+    p_ext->i_offset = uint64_to_le(p_extents[i].i_offset);
+    p_ext->i_len    = uint32_to_le(p_extents[i].i_len);
+    p_ext->i_lba    = uint32_to_le(p_extents[i].i_lba);
+  }
+  p_index->hdr.i_entries++;
+  return true;
+}
+
+bool
+udf_index_save (udf_index_t *p_index, const char *psz_path)
+{
+  char psz_index[4096], psz_tmp[4096 + 4];
+  udf_index_header_t hdr = p_index->hdr;
+  FILE *fp;
+  bool b_ok;
+
+  udf_sidecar_path(psz_path, UDF_INDEX_EXT, psz_index, sizeof(psz_index));
+  snprintf(psz_tmp, sizeof(psz_tmp), "%s.tmp", psz_index);
+  hdr.i_version    = uint32_to_le(hdr.i_version);
+  hdr.i_entries    = uint32_to_le(hdr.i_entries);
+  hdr.i_extents    = uint32_to_le(hdr.i_extents);
+  hdr.i_strings    = uint32_to_le(hdr.i_strings);
+  hdr.i_part_start = uint32_to_le(hdr.i_part_start);
+  hdr.fsd_offset   = uint32_to_le(hdr.fsd_offset);
+  hdr.i_image_size = uint64_to_le(image_size(psz_path));
+
+  /* Written under another name first, so that an interrupted run leaves no truncated index */
+  if (!(fp = fopen(psz_tmp, "wb"))) {
+    fprintf(stderr, "Cannot create index %s: %s\n", psz_tmp, strerror(errno));
+    return false;
+  }
+  b_ok = fwrite(&hdr, sizeof(hdr), 1, fp) == 1
+    && fwrite(p_index->p_entries, sizeof(udf_index_entry_t), p_index->hdr.i_entries, fp)
+       == p_index->hdr.i_entries
+    && fwrite(p_index->p_extents, sizeof(udf_index_extent_t), p_index->hdr.i_extents, fp)
+       == p_index->hdr.i_extents
+    && fwrite(p_index->p_strings, 1, p_index->hdr.i_strings, fp) == p_index->hdr.i_strings;
+  if (fclose(fp) || !b_ok) {
+    fprintf(stderr, "Error writing index %s: %s\n", psz_tmp, strerror(errno));
+    unlink(psz_tmp);
+    return false;
+  }
+#ifdef WIN32
+  unlink(psz_index);
+#endif
+  if (rename(psz_tmp, psz_index)) {
+    fprintf(stderr, "Cannot rename %s to %s: %s\n", psz_tmp, psz_index, strerror(errno));
+    unlink(psz_tmp);
+    return false;
+  }
+  printf("Index of %u entries saved to %s\n", p_index->hdr.i_entries, psz_index);
+  return true;
+}
+
+/* Checks that everything the entries refer to lies within the file */
+static bool
+check_index(const udf_index_t *p_index)
+{
+  const udf_index_header_t *p_hdr = &p_index->hdr;
+  uint32_t i, i_extent, i_extents;
+
+  if ((uint64_t)sizeof(udf_index_header_t)
+      + (uint64_t)p_hdr->i_entries * sizeof(udf_index_entry_t)
+      + (uint64_t)p_hdr->i_extents * sizeof(udf_index_extent_t)
+      + p_hdr->i_strings != p_index->i_file_len
+      || !p_hdr->i_strings || p_index->p_strings[p_hdr->i_strings - 1])
+    return false;
+  for (i = 0; i < p_hdr->i_entries; i++) {
+    i_extent  = uint32_from_le(p_index->p_entries[i].i_extent);
+    i_extents = uint32_from_le(p_index->p_entries[i].i_extents);
+    if (uint32_from_le(p_index->p_entries[i].i_dir) >= p_hdr->i_strings
+	|| uint32_from_le(p_index->p_entries[i].i_name) >= p_hdr->i_strings
+	|| i_extent > p_hdr->i_extents || i_extents > p_hdr->i_extents - i_extent)
+      return false;
+  }
+  return true;
+}
+
+udf_index_t *
+udf_index_load (const char *psz_path)
+{
+  char psz_index[4096];
+  const udf_index_header_t *p_hdr;
+  udf_index_t *p_index;
+  struct stat st;
+  uint8_t *p_file;
+  int fd;
+
+  udf_sidecar_path(psz_path, UDF_INDEX_EXT, psz_index, sizeof(psz_index));
+  if ((fd = open(psz_index, O_RDONLY|O_BINARY)) == -1) return NULL;
+  if (fstat(fd, &st) || st.st_size < (off_t)sizeof(udf_index_header_t)
+      || !(p_index = calloc(1, sizeof(udf_index_t)))) {
+    close(fd);
+    return NULL;
+  }
+  p_index->i_file_len = st.st_size;
+#ifdef WIN32
+  if ((p_file = malloc(p_index->i_file_len))
+      && read(fd, p_file, p_index->i_file_len) != (ssize_t)p_index->i_file_len) {
+    free(p_file);
+    p_file = NULL;
+  }
+#else
+  if ((p_file = mmap(NULL, p_index->i_file_len, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED)
+    p_file = NULL;
+#endif
+  close(fd);
+  if (!(p_index->p_file = p_file)) {
+    fprintf(stderr, "Cannot read index %s: %s\n", psz_index, strerror(errno));
+    free(p_index);
+    return NULL;
+  }
+
+  p_hdr = (const udf_index_header_t *)p_file;
+  memcpy(p_index->hdr.magic, p_hdr->magic, sizeof(p_hdr->magic));
+  p_index->hdr.i_version    = uint32_from_le(p_hdr->i_version);
+  p_index->hdr.i_entries    = uint32_from_le(p_hdr->i_entries);
+  p_index->hdr.i_extents    = uint32_from_le(p_hdr->i_extents);
+  p_index->hdr.i_strings    = uint32_from_le(p_hdr->i_strings);
+  p_index->hdr.i_part_start = uint32_from_le(p_hdr->i_part_start);
+  p_index->hdr.fsd_offset   = uint32_from_le(p_hdr->fsd_offset);
+  p_index->hdr.i_image_size = uint64_from_le(p_hdr->i_image_size);
+  p_index->p_entries = (udf_index_entry_t *)(p_file + sizeof(udf_index_header_t));
+  p_index->p_extents = (udf_index_extent_t *)(p_index->p_entries + p_index->hdr.i_entries);
+  p_index->p_strings = (char *)(p_index->p_extents + p_index->hdr.i_extents);
+
+  if (memcmp(p_index->hdr.magic, UDF_INDEX_MAGIC, sizeof(p_index->hdr.magic))
+      || p_index->hdr.i_version != UDF_INDEX_VERSION) {
+    fprintf(stderr, "Ignoring index %s of another version\n", psz_index);
+  } else if (p_index->hdr.i_image_size != image_size(psz_path)) {
+    fprintf(stderr, "Ignoring index %s, it was made from an image of another size\n", psz_index);
+  } else if (!p_index->hdr.i_part_start || !check_index(p_index)) {
+    fprintf(stderr, "Ignoring damaged index %s\n", psz_index);
+  } else {
+    printf("Using index %s: %u entries, UDF filesystem at sector %u\n", psz_index,
+	   p_index->hdr.i_entries, p_index->hdr.i_part_start);
+    return p_index;
+  }
+  udf_index_free(p_index);
+  return NULL;
+}
+
+int
+udf_index_count (const udf_index_t *p_index)
+{
+  return p_index->hdr.i_entries;
+}
+
+udf_dirent_t *
+udf_index_dirent (const udf_index_t *p_index, int i, udf_t *p_udf, const char **ppsz_dir)
+{
+  const udf_index_entry_t *p_ent = &p_index->p_entries[i];
+  const udf_index_extent_t *p_ext = &p_index->p_extents[uint32_from_le(p_ent->i_extent)];
+  udf_dirent_t *p_udf_dirent;
+  udf_extent_t *p_extent;
+  uint32_t k, i_extents = uint32_from_le(p_ent->i_extents);
+
+  /* The file entry is packed, so it is read in place in the mapped file */
+  if (!(p_udf_dirent = udf_new_dirent((const udf_file_entry_t *) p_ent->fe, p_udf, p_index->p_strings + uint32_from_le(p_ent->i_name),
+				      uint32_from_le(p_ent->i_flags) & UDF_INDEX_DIR, false)))
+    return NULL;
+  if (i_extents && !(p_udf_dirent->p_extents = malloc(i_extents * sizeof(udf_extent_t)))) {
+    udf_dirent_free(p_udf_dirent);
+    return NULL;
+  }
+  for (k = 0; k < i_extents; k++) {
+    p_extent = &p_udf_dirent->p_extents[k];
+    p_extent->i_offset = uint64_from_le(p_ext[k].i_offset);
+    p_extent->i_len    = uint32_from_le(p_ext[k].i_len);
+    p_extent->i_lba    = uint32_from_le(p_ext[k].i_lba);
+  }
+  p_udf_dirent->i_extents = p_udf_dirent->i_extents_alloc = i_extents;
+  p_udf_dirent->b_extents = !(uint32_from_le(p_ent->i_flags) & UDF_INDEX_DIR);
+  if (ppsz_dir) *ppsz_dir = p_index->p_strings + uint32_from_le(p_ent->i_dir);
+  return p_udf_dirent;
+}
+
+void
+udf_index_position (const udf_index_t *p_index, uint32_t *pi_part_start,
+		    uint32_t *pi_fsd_offset)
+{
+  *pi_part_start = p_index->hdr.i_part_start;
+  *pi_fsd_offset = p_index->hdr.fsd_offset;
+}
+
+void
+udf_index_free (udf_index_t *p_index)
+{
+  if (!p_index) return;
+  if (p_index->p_file) {
+#ifdef WIN32
+    free(p_index->p_file);
+#else
+    munmap(p_index->p_file, p_index->i_file_len);
+#endif
+  } else {
+    free(p_index->p_entries);
+    free(p_index->p_extents);
+    free(p_index->p_strings);
+  }
+  free(p_index);
+}
+
+
+/*
+ * Local variables:
+ *  c-file-style: "gnu"
+ *  tab-width: 8
+ *  indent-tabs-mode: nil
+ * End:
+ */
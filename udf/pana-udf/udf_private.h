@@ -24,18 +24,110 @@
 #include "config.h"
 #endif
 
+#include <stddef.h>
 #include "cdio/types.h"
+#include "cdio/bytesex.h"
 #include "cdio/ecma_167.h"
 #include "cdio/udf.h"
 
+/* Descriptors are used in place in the sectors they were read into, so
+   their layout has to match ECMA-167 exactly */
+#define UDF_LAYOUT_CHECK(name, cond) typedef char udf_layout_##name[(cond) ? 1 : -1]
+
+UDF_LAYOUT_CHECK(tag,         sizeof(udf_tag_t) == 16);
+UDF_LAYOUT_CHECK(long_ad,     sizeof(udf_long_ad_t) == 16);
+UDF_LAYOUT_CHECK(fid,         sizeof(udf_fileid_desc_t) == 38);
+UDF_LAYOUT_CHECK(fid_icb,     offsetof(udf_fileid_desc_t, icb) == 20);
+UDF_LAYOUT_CHECK(fe,          sizeof(udf_file_entry_t) == UDF_FENTRY_SIZE);
+UDF_LAYOUT_CHECK(fe_info_len, offsetof(udf_file_entry_t, info_len) == 56);
+UDF_LAYOUT_CHECK(fe_alloc,    offsetof(udf_file_entry_t, i_alloc_descs) == 172);
+
+/* Size of a FID including its name and padding (ECMA 167r3 4/14.4) */
+static inline uint32_t
+udf_fid_size (const udf_fileid_desc_t *p_fid)
+{
+  return 4 * ((sizeof(*p_fid) + uint16_from_le(p_fid->i_imp_use)
+	       + p_fid->i_file_id + 3) / 4);
+}
+
+/* Partition relative LBA of the file entry a FID points to */
+static inline uint32_t
+udf_fid_lba (const udf_fileid_desc_t *p_fid)
+{
+  return uint32_from_le(p_fid->icb.loc.lba);
+}
+
+/* d-string of the name of a FID, i_file_id bytes long */
+static inline const uint8_t *
+udf_fid_name (const udf_fileid_desc_t *p_fid)
+{
+  return p_fid->imp_use + uint16_from_le(p_fid->i_imp_use);
+}
+
 /* Implementation of opaque types */
 
+/* Aligned read window for O_DIRECT access */
+typedef struct udf_window_s
+{
+  int       fd;      /* Image opened with O_DIRECT */
+  uint32_t  i_align; /* Alignment of requests */
+  uint8_t  *p_buf;
+  uint64_t  i_start; /* Image offset of window */
+  uint64_t  i_len;   /* Valid bytes in window */
+} udf_window_t;
+
+/* Areas of the image that ddrescue couldn't read, sorted and merged */
+typedef struct udf_badarea_s
+{
+  uint64_t  i_pos;
+  uint64_t  i_len;
+} udf_badarea_t;
+
+typedef struct udf_badmap_s
+{
+  udf_badarea_t *p_area;
+  int            i_count;
+} udf_badmap_t;
+
+/* File entry cache of udf_readdir, direct mapped by LBA */
+#define UDF_FE_CACHE 1024
+
+typedef struct udf_fe_slot_s
+{
+  lba_t     i_lba;   /* Including the partition start */
+  bool      b_valid;
+  uint8_t   data[UDF_BLOCKSIZE];
+} udf_fe_slot_t;
+
+/* Names of the FIDs of a directory, hashed on its first lookup by udf_fopen */
+typedef struct udf_dirhash_s
+{
+  struct udf_dirhash_s *p_next;
+  lba_t     i_lba;     /* Directory data, including the partition start */
+  uint8_t  *p_data;    /* FIDs of the directory */
+  uint32_t *p_slot;    /* Offset of a FID in p_data + 1, 0 if free */
+  uint32_t  i_slots;   /* Power of 2 */
+} udf_dirhash_t;
+
 struct udf_s {
   int                   stream;  /* Stream pointer if stream */
   uint32_t              i_part_start; /* start of Partition Descriptor */
   uint32_t              fsd_offset;   /* lba of fileset descriptor */
+  udf_window_t         *p_window;     /* NULL unless opened with udf_open_direct */
+  udf_badmap_t         *p_badmap;     /* NULL unless opened with a ddrescue mapfile */
+  udf_fe_slot_t        *p_fe_cache;   /* UDF_FE_CACHE entries, allocated on first use */
+  bool                  b_clone;      /* p_badmap belongs to the udf_t this was cloned from */
+  udf_dirhash_t        *p_dirhash;    /* Directories looked up by udf_fopen */
 };
 
+/* Allocation descriptor decoded by the file offset it starts at */
+typedef struct udf_extent_s
+{
+  uint64_t  i_offset;
+  uint32_t  i_len;
+  lba_t     i_lba;   /* Including the partition start */
+} udf_extent_t;
+
 struct udf_dirent_s
 {
   char	            *psz_name;
@@ -50,12 +142,33 @@ struct udf_dirent_s
   uint8_t           *sector;
   uint64_t          i_position; /* Position in file if positive. */
   udf_fileid_desc_t *fid;
+  udf_extent_t      *p_extents;  /* Valid if b_extents is set */
+  int                i_extents, i_extents_alloc;
+  int                i_extent_cur; /* Extent of the last lookup */
+  bool               b_extents;
 
  /* This field has to come last because it is variable in length. */
   uint32_t			 i_fe_alloc_size;
   udf_file_entry_t   *fe;
 };
 
+driver_return_code_t udf_read_image(const udf_t *p_udf, void *ptr,
+				    uint64_t i_byte_offset, uint64_t i_len);
+
+bool udf_map_bad(const udf_badmap_t *p_map, uint64_t i_pos, uint64_t i_len,
+		 /*out*/ uint64_t *pi_bad_pos, /*out*/ uint64_t *pi_bad_len);
+
+udf_dirent_t *udf_new_dirent(const udf_file_entry_t *p_udf_fe, udf_t *p_udf,
+			     const char *psz_name, bool b_dir, bool b_parent);
+
+/* Decodes the extents of p_udf_dirent if needed, returns their number or -1 */
+int udf_get_extents(udf_dirent_t *p_udf_dirent, /*out*/ const udf_extent_t **pp_extents);
+
+/* Gives p_udf_dirent a copy of p_extents instead of decoding its descriptors */
+bool udf_set_extents(udf_dirent_t *p_udf_dirent, const udf_extent_t *p_extents, int i_extents);
+
+void udf_sidecar_path(const char *psz_path, const char *psz_ext, char *psz_out, size_t i_len);
+
 bool udf_get_lba(const udf_file_entry_t *p_udf_fe, 
                  /*out*/ uint32_t *start, /*out*/ uint32_t *end);
 